@@ -0,0 +1,80 @@
+#ifndef EFANNA2E_ATTRIBUTE_DICTIONARY_H
+#define EFANNA2E_ATTRIBUTE_DICTIONARY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace efanna2e {
+
+// String <-> code table of every attribute. While an index is built it is a
+// list of values plus an unordered_map per attribute. Save() writes a binary
+// file with an open-addressing hash index per attribute, which Load() maps
+// in place, so query-time lookups are O(1) without any parsing. The old
+// space-separated text tables are still accepted by Load().
+class AttributeDictionary {
+ public:
+  AttributeDictionary() = default;
+  ~AttributeDictionary();
+  AttributeDictionary(const AttributeDictionary &) = delete;
+  AttributeDictionary &operator=(const AttributeDictionary &) = delete;
+
+  void Resize(unsigned n_attr);
+  unsigned AttributeNumber() const;
+  // number of distinct values of attribute attr
+  size_t Size(unsigned attr) const;
+  // code of value in attribute attr, -1 if it is unknown
+  int Find(unsigned attr, const std::string &value) const;
+  // code of value, adding it if it is unknown
+  int Insert(unsigned attr, const std::string &value);
+  std::string Value(unsigned attr, unsigned code) const;
+
+  bool Save(const std::string &fname) const;
+  // writes the binary table at the current position of out
+  bool Save(std::ostream &out) const;
+  bool Load(const std::string &fname, bool use_mmap = true);
+  // uses a binary table that lives in memory owned by the caller, which
+  // must outlive the dictionary or the next Clear()
+  void Attach(const char *base, size_t size);
+  void Clear();
+  void PrintSummary() const;
+
+ private:
+  struct Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_attr;
+    uint32_t reserved;
+  };
+  // byte offsets are relative to the start of the file
+  struct Section {
+    uint64_t offsets;  // uint32_t[n_values + 1] into the string blob
+    uint64_t strings;
+    uint64_t table;    // uint32_t[table_size], code + 1 or 0 for empty
+    uint32_t n_values;
+    uint32_t table_size;
+  };
+
+  bool LoadText(const std::string &fname);
+  void Validate(size_t size, const std::string &name);
+  void Materialize();
+  static uint64_t Hash(const char *s, size_t len);
+  inline bool IsMapped() const { return base_ != nullptr; }
+
+  std::vector<std::vector<std::string>> values_;
+  std::vector<std::unordered_map<std::string, unsigned>> index_;
+
+  const char *base_ = nullptr;
+  const Section *sections_ = nullptr;
+  unsigned n_mapped_ = 0;
+  char *map_ = nullptr;
+  size_t map_size_ = 0;
+  std::vector<char> buffer_;
+};
+
+}
+
+#endif //EFANNA2E_ATTRIBUTE_DICTIONARY_H
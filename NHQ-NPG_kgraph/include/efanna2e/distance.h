@@ -2,14 +2,55 @@
 #define EFANNA2E_DISTANCE_H
 
 #include <x86intrin.h>
+#include <stdint.h>
+#include <cmath>
 #include <iostream>
 namespace efanna2e{
   enum Metric{
     L2 = 0,
     INNER_PRODUCT = 1,
     FAST_L2 = 2,
-    PQ = 3
+    PQ = 3,
+    COSINE = 4
   };
+  // Attribute codes are kept in zero-padded rows of AttributeStride(n) bytes,
+  // so CountMismatch compares whole SIMD lanes and the padding never differs.
+  inline unsigned AttributeStride(unsigned n) {
+    if (n <= 16) return 16;
+    if (n <= 32) return 32;
+    return (n + 63) & ~63U;
+  }
+
+  // Kernels of one SIMD level. distance_kernels points to the widest level
+  // the running CPU supports, picked once at startup (src/distance.cpp).
+  struct DistanceKernels {
+    const char* name;
+    float (*l2)(const float* a, const float* b, unsigned size);
+    float (*inner_product)(const float* a, const float* b, unsigned size);
+    // <qs, code> with the uint8 codes widened to floats
+    float (*sq8_dot)(const float* qs, const uint8_t* code, unsigned size);
+    // sum over j < m of table[j * 256 + code[j]]
+    float (*pq_sum)(const float* table, const uint8_t* code, unsigned m);
+    // out[j] = <qs[j], b> for the n queries qs, b loaded once
+    void (*inner_product_many)(const float* const* qs, unsigned n, const float* b, unsigned size, float* out);
+    // out[j] = <qs[j], code>, the codes widened once
+    void (*sq8_dot_many)(const float* const* qs, unsigned n, const uint8_t* code, unsigned size, float* out);
+    // number of differing bytes of two attribute rows, width a multiple of 16
+    unsigned (*mismatch)(const char* a, const char* b, unsigned width);
+  };
+  extern const DistanceKernels* distance_kernels;
+
+  // The 16-byte rows of up to 16 attributes take one SSE2 compare, which
+  // every x86-64 host has, so only wider rows go through the kernels.
+  inline unsigned CountMismatch(const char* a, const char* b, unsigned width) {
+    if (width == 16) {
+      __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a),
+                                  _mm_loadu_si128((const __m128i*)b));
+      return 16 - __builtin_popcount((unsigned)_mm_movemask_epi8(eq));
+    }
+    return distance_kernels->mismatch(a, b, width);
+  }
+
     class Distance {
     public:
         virtual float compare(const float* a, const float* b, unsigned length) const = 0;
@@ -19,296 +60,39 @@ namespace efanna2e{
     class DistanceL2 : public Distance{
     public:
         float compare(const float* a, const float* b, unsigned size) const {
-            float result = 0;
-
-#ifdef __GNUC__
-#ifdef __AVX__
-
-  #define AVX_L2SQR(addr1, addr2, dest, tmp1, tmp2) \
-      tmp1 = _mm256_loadu_ps(addr1);\
-      tmp2 = _mm256_loadu_ps(addr2);\
-      tmp1 = _mm256_sub_ps(tmp1, tmp2); \
-      tmp1 = _mm256_mul_ps(tmp1, tmp1); \
-      dest = _mm256_add_ps(dest, tmp1);
-
-      __m256 sum;
-      __m256 l0, l1;
-      __m256 r0, r1;
-      unsigned D = (size + 7) & ~7U;
-      unsigned DR = D % 16;
-      unsigned DD = D - DR;
-      const float *l = a;
-      const float *r = b;
-      const float *e_l = l + DD;
-      const float *e_r = r + DD;
-      float unpack[8] __attribute__ ((aligned (32))) = {0, 0, 0, 0, 0, 0, 0, 0};
-
-      sum = _mm256_loadu_ps(unpack);
-      if(DR){AVX_L2SQR(e_l, e_r, sum, l0, r0);}
-
-      for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-      	AVX_L2SQR(l, r, sum, l0, r0);
-      	AVX_L2SQR(l + 8, r + 8, sum, l1, r1);
-      }
-      _mm256_storeu_ps(unpack, sum);
-      result = unpack[0] + unpack[1] + unpack[2] + unpack[3] + unpack[4] + unpack[5] + unpack[6] + unpack[7];
-
-#else
-#ifdef __SSE2__
-  #define SSE_L2SQR(addr1, addr2, dest, tmp1, tmp2) \
-          tmp1 = _mm_load_ps(addr1);\
-          tmp2 = _mm_load_ps(addr2);\
-          tmp1 = _mm_sub_ps(tmp1, tmp2); \
-          tmp1 = _mm_mul_ps(tmp1, tmp1); \
-          dest = _mm_add_ps(dest, tmp1);
-
-  __m128 sum;
-  __m128 l0, l1, l2, l3;
-  __m128 r0, r1, r2, r3;
-  unsigned D = (size + 3) & ~3U;
-  unsigned DR = D % 16;
-  unsigned DD = D - DR;
-  const float *l = a;
-  const float *r = b;
-  const float *e_l = l + DD;
-  const float *e_r = r + DD;
-  float unpack[4] __attribute__ ((aligned (16))) = {0, 0, 0, 0};
-
-  sum = _mm_load_ps(unpack);
-  switch (DR) {
-      case 12:
-      SSE_L2SQR(e_l+8, e_r+8, sum, l2, r2);
-      case 8:
-      SSE_L2SQR(e_l+4, e_r+4, sum, l1, r1);
-      case 4:
-      SSE_L2SQR(e_l, e_r, sum, l0, r0);
-    default:
-      break;
-  }
-  for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-      SSE_L2SQR(l, r, sum, l0, r0);
-      SSE_L2SQR(l + 4, r + 4, sum, l1, r1);
-      SSE_L2SQR(l + 8, r + 8, sum, l2, r2);
-      SSE_L2SQR(l + 12, r + 12, sum, l3, r3);
-  }
-  _mm_storeu_ps(unpack, sum);
-  result += unpack[0] + unpack[1] + unpack[2] + unpack[3];
-
-//nomal distance
-#else
-
-      float diff0, diff1, diff2, diff3;
-      const float* last = a + size;
-      const float* unroll_group = last - 3;
-
-      /* Process 4 items with each loop for efficiency. */
-      while (a < unroll_group) {
-          diff0 = a[0] - b[0];
-          diff1 = a[1] - b[1];
-          diff2 = a[2] - b[2];
-          diff3 = a[3] - b[3];
-          result += diff0 * diff0 + diff1 * diff1 + diff2 * diff2 + diff3 * diff3;
-          a += 4;
-          b += 4;
-      }
-      /* Process last 0-3 pixels.  Not needed for standard vector lengths. */
-      while (a < last) {
-          diff0 = *a++ - *b++;
-          result += diff0 * diff0;
-      }
-#endif
-#endif
-#endif
-
-            return result;
+            return distance_kernels->l2(a, b, size);
         }
     };
 
   class DistanceInnerProduct : public Distance{
   public:
     float compare(const float* a, const float* b, unsigned size) const {
-      float result = 0;
-#ifdef __GNUC__
-#ifdef __AVX__
-      #define AVX_DOT(addr1, addr2, dest, tmp1, tmp2) \
-          tmp1 = _mm256_loadu_ps(addr1);\
-          tmp2 = _mm256_loadu_ps(addr2);\
-          tmp1 = _mm256_mul_ps(tmp1, tmp2); \
-          dest = _mm256_add_ps(dest, tmp1);
-
-	  __m256 sum;
-   	  __m256 l0, l1;
-   	  __m256 r0, r1;
-      unsigned D = (size + 7) & ~7U;
-      unsigned DR = D % 16;
-      unsigned DD = D - DR;
-   	  const float *l = a;
-   	  const float *r = b;
-      const float *e_l = l + DD;
-   	  const float *e_r = r + DD;
-      float unpack[8] __attribute__ ((aligned (32))) = {0, 0, 0, 0, 0, 0, 0, 0};
-
-      sum = _mm256_loadu_ps(unpack);
-      if(DR){AVX_DOT(e_l, e_r, sum, l0, r0);}
-
-      for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-	    AVX_DOT(l, r, sum, l0, r0);
-	    AVX_DOT(l + 8, r + 8, sum, l1, r1);
-      }
-      _mm256_storeu_ps(unpack, sum);
-      result = unpack[0] + unpack[1] + unpack[2] + unpack[3] + unpack[4] + unpack[5] + unpack[6] + unpack[7];
-
-#else
-#ifdef __SSE2__
-      #define SSE_DOT(addr1, addr2, dest, tmp1, tmp2) \
-          tmp1 = _mm128_loadu_ps(addr1);\
-          tmp2 = _mm128_loadu_ps(addr2);\
-          tmp1 = _mm128_mul_ps(tmp1, tmp2); \
-          dest = _mm128_add_ps(dest, tmp1);
-      __m128 sum;
-      __m128 l0, l1, l2, l3;
-      __m128 r0, r1, r2, r3;
-      unsigned D = (size + 3) & ~3U;
-      unsigned DR = D % 16;
-      unsigned DD = D - DR;
-      const float *l = a;
-      const float *r = b;
-      const float *e_l = l + DD;
-      const float *e_r = r + DD;
-      float unpack[4] __attribute__ ((aligned (16))) = {0, 0, 0, 0};
-
-      sum = _mm_load_ps(unpack);
-      switch (DR) {
-          case 12:
-          SSE_DOT(e_l+8, e_r+8, sum, l2, r2);
-          case 8:
-          SSE_DOT(e_l+4, e_r+4, sum, l1, r1);
-          case 4:
-          SSE_DOT(e_l, e_r, sum, l0, r0);
-        default:
-          break;
-      }
-      for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-          SSE_DOT(l, r, sum, l0, r0);
-          SSE_DOT(l + 4, r + 4, sum, l1, r1);
-          SSE_DOT(l + 8, r + 8, sum, l2, r2);
-          SSE_DOT(l + 12, r + 12, sum, l3, r3);
-      }
-      _mm_storeu_ps(unpack, sum);
-      result += unpack[0] + unpack[1] + unpack[2] + unpack[3];
-#else
-
-      float dot0, dot1, dot2, dot3;
-      const float* last = a + size;
-      const float* unroll_group = last - 3;
-
-      /* Process 4 items with each loop for efficiency. */
-      while (a < unroll_group) {
-          dot0 = a[0] * b[0];
-          dot1 = a[1] * b[1];
-          dot2 = a[2] * b[2];
-          dot3 = a[3] * b[3];
-          result += dot0 + dot1 + dot2 + dot3;
-          a += 4;
-          b += 4;
-      }
-      /* Process last 0-3 pixels.  Not needed for standard vector lengths. */
-      while (a < last) {
-          result += *a++ * *b++;
-      }
-#endif
-#endif
-#endif
-      return result;
+      return distance_kernels->inner_product(a, b, size);
     }
 
   };
+  // -<a, b>, so that a larger inner product is nearer as for the other metrics
+  class DistanceMaxInnerProduct : public Distance{
+  public:
+    float compare(const float* a, const float* b, unsigned size) const {
+      return -distance_kernels->inner_product(a, b, size);
+    }
+  };
+  // 1 - cos(a, b); a zero vector is at distance 1 from everything
+  class DistanceCosine : public Distance{
+  public:
+    float compare(const float* a, const float* b, unsigned size) const {
+      float ab = distance_kernels->inner_product(a, b, size);
+      float aa = distance_kernels->inner_product(a, a, size);
+      float bb = distance_kernels->inner_product(b, b, size);
+      if (aa <= 0 || bb <= 0) return 1;
+      return 1 - ab / std::sqrt(aa * bb);
+    }
+  };
   class DistanceFastL2 : public DistanceInnerProduct{
    public:
     float norm(const float* a, unsigned size) const{
-      float result = 0;
-#ifdef __GNUC__
-#ifdef __AVX__
-#define AVX_L2NORM(addr, dest, tmp) \
-    tmp = _mm256_loadu_ps(addr); \
-    tmp = _mm256_mul_ps(tmp, tmp); \
-    dest = _mm256_add_ps(dest, tmp);
-
-    __m256 sum;
-   	__m256 l0, l1;
-    unsigned D = (size + 7) & ~7U;
-    unsigned DR = D % 16;
-    unsigned DD = D - DR;
-    const float *l = a;
-    const float *e_l = l + DD;
-    float unpack[8] __attribute__ ((aligned (32))) = {0, 0, 0, 0, 0, 0, 0, 0};
-
-    sum = _mm256_loadu_ps(unpack);
-    if(DR){AVX_L2NORM(e_l, sum, l0);}
-	for (unsigned i = 0; i < DD; i += 16, l += 16) {
-      AVX_L2NORM(l, sum, l0);
-      AVX_L2NORM(l + 8, sum, l1);
-    }
-    _mm256_storeu_ps(unpack, sum);
-    result = unpack[0] + unpack[1] + unpack[2] + unpack[3] + unpack[4] + unpack[5] + unpack[6] + unpack[7];
-#else
-#ifdef __SSE2__
-#define SSE_L2NORM(addr, dest, tmp) \
-    tmp = _mm128_loadu_ps(addr); \
-    tmp = _mm128_mul_ps(tmp, tmp); \
-    dest = _mm128_add_ps(dest, tmp);
-
-    __m128 sum;
-    __m128 l0, l1, l2, l3;
-    unsigned D = (size + 3) & ~3U;
-    unsigned DR = D % 16;
-    unsigned DD = D - DR;
-    const float *l = a;
-    const float *e_l = l + DD;
-    float unpack[4] __attribute__ ((aligned (16))) = {0, 0, 0, 0};
-
-    sum = _mm_load_ps(unpack);
-    switch (DR) {
-        case 12:
-        SSE_L2NORM(e_l+8, sum, l2);
-        case 8:
-        SSE_L2NORM(e_l+4, sum, l1);
-        case 4:
-        SSE_L2NORM(e_l, sum, l0);
-      default:
-        break;
-    }
-    for (unsigned i = 0; i < DD; i += 16, l += 16) {
-        SSE_L2NORM(l, sum, l0);
-        SSE_L2NORM(l + 4, sum, l1);
-        SSE_L2NORM(l + 8, sum, l2);
-        SSE_L2NORM(l + 12, sum, l3);
-    }
-    _mm_storeu_ps(unpack, sum);
-    result += unpack[0] + unpack[1] + unpack[2] + unpack[3];
-#else
-    float dot0, dot1, dot2, dot3;
-    const float* last = a + size;
-    const float* unroll_group = last - 3;
-
-    /* Process 4 items with each loop for efficiency. */
-    while (a < unroll_group) {
-        dot0 = a[0] * a[0];
-        dot1 = a[1] * a[1];
-        dot2 = a[2] * a[2];
-        dot3 = a[3] * a[3];
-        result += dot0 + dot1 + dot2 + dot3;
-        a += 4;
-    }
-    /* Process last 0-3 pixels.  Not needed for standard vector lengths. */
-    while (a < last) {
-        result += (*a) * (*a);
-        a++;
-    }
-#endif
-#endif
-#endif
-      return result;
+      return distance_kernels->inner_product(a, a, size);
     }
     using DistanceInnerProduct::compare;
     float compare(const float* a, const float* b, float norm, unsigned size) const {//not implement
@@ -316,6 +100,20 @@ namespace efanna2e{
       result += norm;
       return result;
     }
+    // same as compare(a, b, norm, DIM), with the length known at compile
+    // time; the kernel is the runtime-dispatched one, which is at least as
+    // wide as anything the build flags would allow inline.
+    template <unsigned DIM>
+    inline float compare_fixed(const float* a, const float* b, float norm) const {
+      return norm - 2 * distance_kernels->inner_product(a, b, DIM);
+    }
+    // Asymmetric PQ distance: the sum over m subspaces of table[j][code[j]],
+    // where the 256-entry row j holds |c|^2 - 2<q_j, c> (or -<q_j, c> for
+    // the inner product) for every centroid c of subspace j, so the result
+    // is |x|^2 - 2<q, x> (or -<q, x>) of the decoded x.
+    inline float compare_pq(const float* table, const uint8_t* code, unsigned m) const {
+      return distance_kernels->pq_sum(table, code, m);
+    }
   };
 }
 
@@ -0,0 +1,130 @@
+#ifndef EFANNA2E_FUSION_H
+#define EFANNA2E_FUSION_H
+
+#include <cfloat>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include "distance.h"
+
+namespace efanna2e {
+
+// how an attribute mismatch is folded into a vector distance, chosen by
+// "fusion" when the index is built and stored with it
+enum FusionPolicy {
+  FUSION_MULTIPLICATIVE = 0,
+  FUSION_ADDITIVE = 1,
+  FUSION_WEIGHTED = 2,
+  FUSION_MASK = 3
+};
+
+// Fused distance of a vector distance d and the attribute mismatch m:
+//   multiplicative  d + |d| * weight * m / attribute_number
+//   additive        d + weight * m
+//   weighted        d + weight * m, m summing weights[k] over mismatching k
+//   mask            d if m is 0, FLT_MAX otherwise
+// m counts the mismatching attributes except under "weighted". Search pools
+// hold d less a per-query offset (|q|^2 for L2), which the multiplicative
+// penalty adds back since it scales d itself. Every policy is
+// non-decreasing in d, so LowerBound of a pool's floor lets nodes be
+// dropped on their attributes alone.
+struct AttributeFusion {
+  FusionPolicy policy = FUSION_MULTIPLICATIVE;
+  float weight = 1;
+  float attribute_number = 1;
+  // one per attribute byte, zero in the row padding
+  const float *weights = nullptr;
+
+  inline float Mismatch(const char *a, const char *b, unsigned width) const;
+  inline float Apply(float d, float m, float offset = 0) const;
+  // lowest Apply(x, m, offset) over x >= floor
+  inline float LowerBound(float floor, float m, float offset = 0) const;
+};
+
+template <unsigned POLICY>
+struct Fusion {
+  static inline float Apply(const AttributeFusion &f, float d, float m, float offset) {
+    return d + f.weight * m;
+  }
+  static inline float LowerBound(const AttributeFusion &f, float floor, float m, float offset) {
+    return Apply(f, floor, m, offset);
+  }
+};
+
+template <>
+struct Fusion<FUSION_MULTIPLICATIVE> {
+  static inline float Apply(const AttributeFusion &f, float d, float m, float offset) {
+    // |d|, so mismatches still push away under the signed inner-product distance
+    return d + std::fabs(d + offset) * (f.weight * m) / f.attribute_number;
+  }
+  static inline float LowerBound(const AttributeFusion &f, float floor, float m, float offset) {
+    // below a zero distance the fused one only falls while the penalty
+    // factor stays under 1, and bottoms out at zero otherwise
+    float c = f.weight * m / f.attribute_number;
+    if (floor + offset >= 0 || c <= 1) return Apply(f, floor, m, offset);
+    return -offset;
+  }
+};
+
+template <>
+struct Fusion<FUSION_MASK> {
+  static inline float Apply(const AttributeFusion &f, float d, float m, float offset) {
+    return m > 0 ? FLT_MAX : d;
+  }
+  static inline float LowerBound(const AttributeFusion &f, float floor, float m, float offset) {
+    return Apply(f, floor, m, offset);
+  }
+};
+
+// sum of weights[i] over the bytes where a and b differ; width is a
+// multiple of 16
+inline float WeightedMismatch(const char *a, const char *b, unsigned width, const float *weights) {
+  float sum = 0;
+  for (unsigned i = 0; i < width; i += 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                _mm_loadu_si128((const __m128i *)(b + i)));
+    unsigned diff = ~(unsigned)_mm_movemask_epi8(eq) & 0xffff;
+    for (; diff; diff &= diff - 1) sum += weights[i + __builtin_ctz(diff)];
+  }
+  return sum;
+}
+
+inline float AttributeFusion::Mismatch(const char *a, const char *b, unsigned width) const {
+  if (policy == FUSION_WEIGHTED) return WeightedMismatch(a, b, width, weights);
+  return (float)CountMismatch(a, b, width);
+}
+
+inline float AttributeFusion::Apply(float d, float m, float offset) const {
+  switch (policy) {
+    case FUSION_MULTIPLICATIVE:
+      return Fusion<FUSION_MULTIPLICATIVE>::Apply(*this, d, m, offset);
+    case FUSION_MASK:
+      return Fusion<FUSION_MASK>::Apply(*this, d, m, offset);
+    default:
+      return Fusion<FUSION_ADDITIVE>::Apply(*this, d, m, offset);
+  }
+}
+
+inline float AttributeFusion::LowerBound(float floor, float m, float offset) const {
+  switch (policy) {
+    case FUSION_MULTIPLICATIVE:
+      return Fusion<FUSION_MULTIPLICATIVE>::LowerBound(*this, floor, m, offset);
+    case FUSION_MASK:
+      return Fusion<FUSION_MASK>::LowerBound(*this, floor, m, offset);
+    default:
+      return Fusion<FUSION_ADDITIVE>::LowerBound(*this, floor, m, offset);
+  }
+}
+
+// "multiplicative", "additive", "weighted" or "mask", or their number
+inline FusionPolicy ParseFusionPolicy(const std::string &name) {
+  static const char *names[] = {"multiplicative", "additive", "weighted", "mask"};
+  for (unsigned i = 0; i < 4; i++) {
+    if (name == names[i] || name == std::to_string(i)) return (FusionPolicy)i;
+  }
+  throw std::invalid_argument("[Error] Unknown fusion policy: " + name);
+}
+
+}
+
+#endif //EFANNA2E_FUSION_H
@@ -43,6 +43,7 @@ class Index {
   size_t nd_;
   bool has_built;
   Distance* distance_;
+  Metric metric_;
   char *opt_graph_;
   size_t node_size;
   size_t data_len;
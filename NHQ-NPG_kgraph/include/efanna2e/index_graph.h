@@ -6,15 +6,102 @@
 #include <vector>
 #include <cassert>
 #include <algorithm>
+#include <memory>
+#include <unordered_map>
 #include "util.h"
 #include "parameters.h"
 #include "neighbor.h"
 #include "index.h"
+#include "search_context.h"
+#include "attribute_dictionary.h"
+#include "fusion.h"
 #include <boost/dynamic_bitset.hpp>
 
 namespace efanna2e
 {
 
+  class IndexGraph;
+
+  // vector rows of the optimized graph, chosen by "opt_quantize"
+  enum OptQuantization
+  {
+    OPT_FLOAT = 0,
+    OPT_SQ8 = 1,
+    OPT_PQ = 2
+  };
+
+  // bounded by the width of the member masks of SearchContext, which cost a
+  // grouped search 8 bytes per node it touches (see GroupMasks)
+  const unsigned kMaxSearchGroup = 16;
+  const unsigned kMaxSearchInterleave = 16;
+
+  // What one NN-Descent iteration did. updates counts the pool insertions
+  // of its join, update_rate the same per pool slot; recall is the
+  // control-set estimate (-1 if not evaluated) and seconds the time since
+  // NNDescent started.
+  struct NNDescentStats
+  {
+    unsigned iter = 0;
+    size_t updates = 0;
+    float update_rate = 0;
+    float recall = -1;
+    double seconds = 0;
+  };
+
+  // When NNDescent stops before "iter" iterations: once the estimated recall
+  // reaches "stop_recall" (0.8 by default; <= 0 disables it and the control
+  // set), the update rate drops below "stop_delta" (the kgraph criterion,
+  // off by default) or "stop_seconds" have passed (off by default).
+  struct NNDescentStopRule
+  {
+    float recall = 0.8f;
+    float delta = 0;
+    double seconds = 0;
+
+    inline bool Stop(const NNDescentStats &stats) const
+    {
+      return (recall > 0 && stats.recall >= recall) ||
+             (delta > 0 && stats.update_rate < delta) ||
+             (seconds > 0 && stats.seconds >= seconds);
+    }
+  };
+
+  // Per-query search inputs resolved once by IndexGraph::MakeQueryPlan, so the
+  // hot path neither parses Parameters nor looks up attribute strings.
+  struct HybridQueryPlan
+  {
+    std::vector<char> attribute; // codes padded to the index stride; empty if unresolved
+    unsigned L = 0;
+    size_t K = 0;
+    // "weight_search" alone keeps the additive penalty of weight_search per
+    // mismatching attribute; otherwise the fusion the index was built with
+    // applies, or "search_fusion" with "weight_search" as its weight
+    AttributeFusion fusion;
+    SearchStopRule stop; // "search_patience" / "search_slack", off by default
+    // "search_strict": return only exact attribute matches, doubling the
+    // fusion weight until K are found or "strict_budget" distances (0: nd_)
+    // are spent
+    bool strict = false;
+    size_t strict_budget = 0;
+    // "rerank_depth": pool entries re-scored with the full-precision vectors
+    // when the layout is quantized (0: the whole pool of L)
+    unsigned rerank = 0;
+    // "search_group": BatchSearchWithOptGraph walks up to this many queries
+    // with the same attributes and plan in lock-step, scoring each node it
+    // loads for all of them (0, 1: one query at a time; at most
+    // kMaxSearchGroup). Strict and early-stopping plans are never grouped.
+    unsigned group = 0;
+    // "search_interleave": BatchSearchWithOptGraph runs this many queries per
+    // thread as interleaved state machines, each stage prefetching what the
+    // query needs next while the other queries compute; results are
+    // unchanged (0, 1: off; at most kMaxSearchInterleave). Strict plans and
+    // grouped queries are not interleaved.
+    unsigned interleave = 0;
+    void (IndexGraph::*kernel)(SearchContext &ctx, const char *attribute,
+                               const float *query, size_t K, unsigned L,
+                               const AttributeFusion &fusion, unsigned *indices) = nullptr;
+  };
+
   class IndexGraph : public Index
   {
   public:
@@ -25,6 +112,24 @@ namespace efanna2e
     virtual void Save(const char *filename) override;
     virtual void Load(const char *filename) override;
     void OptimizeGraph(float *data);
+    // "opt_layout" = "split" stores attributes and neighbour lists apart from
+    // the vectors in 64-byte aligned rows, so filtered-out neighbours are
+    // rejected without their vectors being read; default "packed".
+    // "opt_quantize" = "sq8" stores the vectors as per-dimension min/scale
+    // uint8 codes for traversal and re-ranks the final pool against data,
+    // which must then outlive the index. "pq" does the same with "pq_m"
+    // subspace codes of 256 centroids each, trained by k-means on "pq_train"
+    // sampled vectors for "pq_iter" rounds. Default "none", or "pq" for an
+    // index created with the PQ metric. An index created with INNER_PRODUCT
+    // or COSINE searches by that metric (PQ codes: inner product only),
+    // every other metric by squared L2.
+    void OptimizeGraph(float *data, const Parameters &parameters);
+    // Writes the optimized layout with its entry points and attribute table,
+    // so LoadOptimized can start serving without Load, OptimizeGraph or
+    // LoadAttributeTable. Loading maps the file read-only (use_mmap, with
+    // MAP_POPULATE if populate) or reads it into memory.
+    void SaveOptimized(const char *filename) const;
+    void LoadOptimized(const char *filename, bool use_mmap = true, bool populate = false);
     void SearchWithOptGraph(std::vector<std::string> attributes,
                             const float *query, size_t K,
                             const Parameters &parameters,
@@ -33,7 +138,62 @@ namespace efanna2e
                             const float *query, size_t K,
                             const Parameters &parameters,
                             unsigned *indices);
-    size_t GetDistCount() { return dist_cout; }
+    // Plans must be made after OptimizeGraph, which picks the kernel.
+    HybridQueryPlan MakeQueryPlan(const std::vector<std::string> &attributes,
+                                  size_t K, const Parameters &parameters) const;
+    // re-resolves only the attribute codes, so one plan can serve many filters
+    bool SetPlanAttributes(HybridQueryPlan &plan,
+                           const std::vector<std::string> &attributes) const;
+    // distances, if given, receives the distance plus penalty of each result:
+    // squared L2, -<q, x> for INNER_PRODUCT or 1 - cos for COSINE. In strict
+    // mode slots without a match get id UINT_MAX.
+    void SearchWithOptGraph(const HybridQueryPlan &plan, const float *query,
+                            unsigned *indices, float *distances = nullptr);
+    // Searches queries[i * dimension_] with attributes[i] for every i on
+    // n_threads threads (omp default if <= 0); results[i] receives K ids.
+    void BatchSearchWithOptGraph(const float *queries,
+                                 const std::vector<std::vector<std::string>> &attributes,
+                                 size_t K,
+                                 const Parameters &parameters,
+                                 std::vector<std::vector<unsigned>> &results,
+                                 int n_threads = 0);
+    // stats, if given, receives the SearchStats of every query
+    void BatchSearchWithOptGraph(const float *queries,
+                                 const std::vector<HybridQueryPlan> &plans,
+                                 std::vector<std::vector<unsigned>> &results,
+                                 int n_threads = 0,
+                                 std::vector<SearchStats> *stats = nullptr);
+    // Every node whose fused distance to the query (the metric distance as
+    // above fused with its attribute mismatch, see plan.fusion) is at most
+    // radius, nearest first. L_search sizes the pool of the initial descent
+    // only; the search then keeps expanding nodes inside the radius until
+    // none is left.
+    void RangeSearchWithOptGraph(const float *query,
+                                 const std::vector<std::string> &attributes,
+                                 float radius, const Parameters &parameters,
+                                 std::vector<std::pair<unsigned, float>> &results);
+    void RangeSearchWithOptGraph(const HybridQueryPlan &plan, const float *query,
+                                 float radius,
+                                 std::vector<std::pair<unsigned, float>> &results);
+    // stats of the last single-query SearchWithOptGraph or RangeSearchWithOptGraph
+    // call, empty before the first one
+    const SearchStats &GetLastSearchStats() const
+    {
+      static const SearchStats none;
+      return search_pool_.empty() ? none : search_pool_[0]->stats;
+    }
+    // per-iteration stats of the last NN-Descent run
+    const std::vector<NNDescentStats> &GetNNDescentStats() const
+    {
+      return nndescent_stats_;
+    }
+    size_t GetDistCount() const
+    {
+      size_t sum = dist_cout;
+      for (const auto &ctx : search_pool_)
+        sum += ctx->dist_count;
+      return sum;
+    }
 
     virtual void Build(size_t n, const float *data, const Parameters &parameters) override;
 
@@ -47,8 +207,11 @@ namespace efanna2e
     void RefineGraph(const float *data, const Parameters &parameters);
 
     bool SaveAttributeTable(const std::string &fname) const;
-    bool LoadAttributeTable(const std::string &fname);
+    bool LoadAttributeTable(const std::string &fname, bool use_mmap = true);
     void AddAllNodeAttributes(std::vector<std::string> attributes);
+    // codes all nodes at once, one attribute per thread; every row must have
+    // as many values as the first
+    void AddAllNodeAttributes(const std::vector<std::vector<std::string>> &attributes);
     void statistic()
     {
       int sum = 0;
@@ -79,14 +242,8 @@ namespace efanna2e
           int flag = 1;
           int id = final_graph_[i][j];
           summ++;
-          for (int k = 0; k < attribute_number_; k++)
-          {
-            if (attributes_[i][k] != attributes_[id][k])
-            {
-              flag = 0;
-              break;
-            }
-          }
+          if (CountMismatch(NodeAttributes(i), NodeAttributes(id), attribute_stride_))
+            flag = 0;
           if (flag)
           {
             tsum++;
@@ -172,10 +329,12 @@ namespace efanna2e
     void reset_distcount()
     {
       this->dist_cout = 0;
+      for (auto &ctx : search_pool_)
+        ctx->dist_count = 0;
     };
 
   protected:
-    typedef std::vector<nhood> KNNGraph;
+    typedef NNDescentGraph KNNGraph;
     typedef std::vector<std::vector<unsigned>> CompactGraph;
     typedef std::vector<LockNeighbor> LockGraph;
 
@@ -183,36 +342,64 @@ namespace efanna2e
     KNNGraph graph_;
     CompactGraph final_graph_;
 
-    std::vector<std::vector<char>> attributes_;
-    std::vector<std::vector<std::string>> attributes_code;
+    // build-time attribute codes, one zero-padded row of attribute_stride_
+    // bytes per node in a single cache-line aligned block
+    char *attributes_ = nullptr;
+    size_t attribute_rows_ = 0;
+    size_t attribute_capacity_ = 0;
+    AttributeDictionary attribute_dict_;
     int attribute_number_ = 3;
+    // padded row width of attributes_, see AttributeStride()
+    unsigned attribute_stride_ = AttributeStride(3);
+    // fusion the graph was built with, saved with the index
+    FusionPolicy fusion_policy_ = FUSION_MULTIPLICATIVE;
+    float fusion_weight_ = 1;
+    // one per attribute byte, zero in the padding
+    std::vector<float> fusion_weights_;
+    AttributeFusion build_fusion_;
+
+    inline char *NodeAttributes(size_t id) const
+    {
+      return attributes_ + id * attribute_stride_;
+    }
+    // grows attributes_ to hold rows rows of stride bytes, re-padding the
+    // existing ones if the stride changed
+    void ReserveAttributes(size_t rows, unsigned stride);
+    void ReleaseAttributes();
 
   private:
     void InitializeGraph(const Parameters &parameters);
     void InitializeGraph_Refine(const Parameters &parameters);
     void NNDescent(const Parameters &parameters);
-    void join();
+    // both joins return the number of pool insertions they made
+    size_t join();
+    // join() with each node's pairs from one sgemm over its gathered
+    // candidates; norms holds |x|^2 for L2, |x| for cosine
+    size_t join_blas(const std::vector<float> &norms);
     void update(const Parameters &parameters);
     void Cut_Link(const Parameters &parameters, SimpleNeighbor *cut_graph_);
+    // appends to pool the two-hop neighbours of q not yet in visited
     void get_neighbors(const unsigned q, const Parameters &parameter,
-                       std::vector<Neighbor> &pool, boost::dynamic_bitset<> &flags);
+                       std::vector<Neighbor> &pool, VisitedBits &visited);
     void get_neighbors(const float *query, const Parameters &parameter,
                        std::vector<Neighbor> &retset,
                        std::vector<Neighbor> &fullset,
                        boost::dynamic_bitset<> cflags);
-    void sync_prune(unsigned q, std::vector<Neighbor> &pool, float m,
+    void sync_prune(unsigned q, BuildContext &bc, float m,
                     const Parameters &parameters, SimpleNeighbor *cut_graph_);
-    void InterInsert(unsigned n, unsigned range, float m,
-                     std::vector<std::mutex> &locks,
-                     SimpleNeighbor *cut_graph_);
+    // merges the n_reverse edges into n (in any order) with n's pruned list,
+    // pruning the union again if it outgrows range
+    void InterInsert(unsigned n, unsigned range, const SimpleNeighbor *reverse,
+                     size_t n_reverse, BuildContext &bc, SimpleNeighbor *cut_graph_);
     void DFS_expand(const Parameters &parameter);
     void get_cluster_center(const Parameters &parameter, boost::dynamic_bitset<> flags, unsigned &cc);
+    // v[i] = the k nearest of the sample to control point c[i]
     void generate_control_set(std::vector<unsigned> &c,
                               std::vector<std::vector<unsigned>> &v,
-                              unsigned N);
+                              const std::vector<unsigned> &sample, unsigned k);
     float eval_recall(std::vector<unsigned> &ctrl_points, std::vector<std::vector<unsigned>> &acc_eval_set);
     void get_neighbor_to_add(const float *point, const Parameters &parameters, LockGraph &g,
-                             std::mt19937 &rng, std::vector<Neighbor> &retset, unsigned n_total);
+                             BuildContext &bc, std::vector<Neighbor> &retset, unsigned n_total);
     void compact_to_Lockgraph(LockGraph &g);
     void parallel_graph_insert(unsigned id, Neighbor nn, LockGraph &g, size_t K);
     //  void strong_connect(const Parameters &parameter);
@@ -225,11 +412,199 @@ namespace efanna2e
     void get_neighbors(const float *query, const Parameters &parameter,
                        std::vector<Neighbor> &retset,
                        std::vector<Neighbor> &fullset);
-    void fusion_distance(float &dist, float &cnt);
+    // distance between data rows i and j in the build phases; for COSINE it
+    // takes the inverse norms Build keeps instead of two more dot products
+    inline float PairDistance(unsigned i, unsigned j) const
+    {
+      const float *a = data_ + dimension_ * (size_t)i;
+      const float *b = data_ + dimension_ * (size_t)j;
+      if (!inv_norms_.empty())
+        return 1 - distance_kernels->inner_product(a, b, (unsigned)dimension_) * inv_norms_[i] * inv_norms_[j];
+      return distance_->compare(a, b, (unsigned)dimension_);
+    }
+    inline void fusion_distance(float &dist, float cnt)
+    {
+      dist = build_fusion_.Apply(dist, cnt);
+    }
+    inline void fusion_distance(float &dist, unsigned a, unsigned b)
+    {
+      fusion_distance(dist, build_fusion_.Mismatch(NodeAttributes(a), NodeAttributes(b), attribute_stride_));
+    }
+    // reads "fusion", "fusion_weight" and "fusion_weights" (comma separated,
+    // one per attribute, 1 if left out) for the build
+    void SetFusion(const Parameters &parameters);
+    // policy with weight over the current attributes and fusion_weights_
+    AttributeFusion MakeFusion(FusionPolicy policy, float weight) const;
+    // sizes fusion_weights_ to the attribute stride and refreshes build_fusion_
+    void UpdateFusion();
+    void BuildEntryPoints(const Parameters &parameters);
+    unsigned InitEntryPoints(SearchContext &ctx, const char *attribute, unsigned L);
     unsigned width;
+    // global navigating points, used when the query's attribute combination
+    // has no entry of its own
     std::vector<unsigned> eps_;
+    // spread-out entries of every attribute-value combination (medoid
+    // first), keyed by the raw attribute codes
+    std::unordered_map<std::string, std::vector<unsigned>> entry_points_;
+
+    std::vector<char> Attribute2int(std::vector<std::string> str) const;
 
-    std::vector<char> Attribute2int(std::vector<std::string> str);
+    void PrepareSearchPool(size_t n_threads);
+    // one build context per OpenMP thread, with visited marks for n_nodes
+    void PrepareBuildPool(size_t n_nodes);
+    // distinct unvisited neighbours of the pool entries the full-degree pass
+    // left unexpanded; marks them visited, so call it only to end a search
+    size_t PendingExpansionCost(const Neighbor *retset, unsigned L,
+                                VisitedList &visited) const;
+    // DIM / ATTR_WIDTH of 0 fall back to the runtime dimension_ / attribute_stride_;
+    // QUANT is the OptQuantization of the vector rows, METRIC the search Metric
+    template <unsigned DIM, unsigned ATTR_WIDTH, bool SPLIT, unsigned QUANT, unsigned METRIC>
+    void SearchWithOptGraph_(SearchContext &ctx, const char *attribute,
+                             const float *query, size_t K, unsigned L,
+                             const AttributeFusion &fusion, unsigned *indices);
+    void RunQueryPlan(SearchContext &ctx, const HybridQueryPlan &plan,
+                      const float *query, unsigned *indices, float *distances);
+    // Searches the n queries of one plan.group in lock-step from shared
+    // entry points: each round every query expands one node, and each row
+    // the round needs is fetched once and scored for all queries that need
+    // it. Query j's pool is left in ctx.group[j].
+    template <bool SPLIT, unsigned QUANT, unsigned METRIC>
+    void GroupSearchWithOptGraph_(SearchContext &ctx, const char *attribute,
+                                  const float *const *queries, unsigned n,
+                                  unsigned L, const AttributeFusion &fusion);
+    void RunQueryGroup(SearchContext &ctx, const HybridQueryPlan &plan,
+                       const float *const *queries, unsigned n, unsigned *const *indices);
+    // Runs the n queries on up to lanes interleaved lanes of ctx (a lane
+    // takes the next query when its own finishes), seeding query i's entry
+    // points with seeds[i]. Each query returns what RunQueryPlan would;
+    // stats[i] may be null.
+    template <unsigned DIM, unsigned ATTR_WIDTH, bool SPLIT, unsigned QUANT, unsigned METRIC>
+    void InterleavedSearch_(SearchContext &ctx, const HybridQueryPlan *const *plans,
+                            const float *const *queries, const unsigned *seeds, unsigned n,
+                            unsigned lanes, unsigned *const *indices, SearchStats *const *stats);
+    void StrictSearch_(SearchContext &ctx, const char *attribute, const float *query,
+                       size_t K, unsigned L, const AttributeFusion &fusion, size_t budget,
+                       unsigned *indices, float *distances);
+    void RangeSearch_(SearchContext &ctx, const char *attribute, const float *query,
+                      float radius, unsigned L, const AttributeFusion &fusion,
+                      std::vector<std::pair<unsigned, float>> &results);
+    typedef void (IndexGraph::*SearchKernel)(SearchContext &ctx, const char *attribute,
+                                             const float *query, size_t K, unsigned L,
+                                             const AttributeFusion &fusion, unsigned *indices);
+    typedef void (IndexGraph::*InterleaveKernel)(SearchContext &ctx, const HybridQueryPlan *const *plans,
+                                                 const float *const *queries, const unsigned *seeds,
+                                                 unsigned n, unsigned lanes, unsigned *const *indices,
+                                                 SearchStats *const *stats);
+    // the single-query and the interleaved kernel of one instantiation
+    struct OptKernels
+    {
+      SearchKernel search;
+      InterleaveKernel interleave;
+    };
+    template <unsigned DIM, unsigned ATTR_WIDTH, bool SPLIT, unsigned QUANT, unsigned METRIC>
+    static OptKernels MakeKernels();
+    template <unsigned DIM, unsigned QUANT, unsigned METRIC>
+    OptKernels SelectKernels(unsigned attr_width);
+    OptKernels SelectKernels(unsigned dim, unsigned attr_width);
+    SearchKernel search_kernel_;
+    InterleaveKernel interleave_kernel_ = nullptr;
+    typedef void (IndexGraph::*GroupKernel)(SearchContext &ctx, const char *attribute,
+                                            const float *const *queries, unsigned n,
+                                            unsigned L, const AttributeFusion &fusion);
+    template <unsigned QUANT, unsigned METRIC>
+    GroupKernel SelectGroupKernel() const;
+    GroupKernel SelectGroupKernel() const;
+    GroupKernel group_kernel_ = nullptr;
+
+    // Node records of the optimized graph. The packed layout keeps
+    // [norm|vector|attributes|k|kk|neighbors] per node in opt_graph_; the
+    // split layout keeps attribute rows and [k|kk|neighbors] rows (hot) apart
+    // from [norm|vector] rows (cold).
+    template <bool SPLIT>
+    inline float *OptVector(unsigned id) const
+    {
+      return (float *)(SPLIT ? cold_graph_ + cold_size_ * id : opt_graph_ + node_size * id);
+    }
+    template <bool SPLIT>
+    inline char *OptAttributes(unsigned id) const
+    {
+      return SPLIT ? hot_attributes_ + attribute_len * id : opt_graph_ + node_size * id + data_len;
+    }
+    template <bool SPLIT>
+    inline unsigned *OptLinks(unsigned id) const
+    {
+      return (unsigned *)(SPLIT ? hot_links_ + link_size_ * id
+                                : opt_graph_ + node_size * id + data_len + attribute_len);
+    }
+    inline float *OptVector(unsigned id) const
+    {
+      return split_layout_ ? OptVector<true>(id) : OptVector<false>(id);
+    }
+    inline char *OptAttributes(unsigned id) const
+    {
+      return split_layout_ ? OptAttributes<true>(id) : OptAttributes<false>(id);
+    }
+    inline unsigned *OptLinks(unsigned id) const
+    {
+      return split_layout_ ? OptLinks<true>(id) : OptLinks<false>(id);
+    }
+    // per-dimension min and scale of the SQ8 codes, from the data's range
+    void TrainScalarQuantizer(const float *data);
+    // k-means codebooks of the pq_m_ subspaces, from a sample of data
+    void TrainProductQuantizer(const float *data, const Parameters &parameters);
+    void EncodeProductQuantized(const float *v, uint8_t *code) const;
+    // fills the per-query terms of ctx: offset, floor and scale of the
+    // metric, and the table of a quantized layout
+    void PrepareQuery(SearchContext &ctx, const float *query) const;
+    // pool distance (the metric distance less ctx.query_offset) from the
+    // optimized layout, quantized or not; needs PrepareQuery first
+    float OptDistanceTo(const SearchContext &ctx, const float *query, unsigned id) const;
+    // the same from the full-precision vector
+    float ExactDistance(const SearchContext &ctx, const float *query, unsigned id) const;
+    // re-scores the first n pool entries exactly and sorts them
+    void RerankPool(SearchContext &ctx, const char *attribute, const float *query,
+                    unsigned n, const AttributeFusion &fusion) const;
+    void SaveEntryPoints(std::ostream &out) const;
+    void LoadEntryPoints(std::istream &in);
+    // [policy|weight|attribute_number|weights]; LoadFusion keeps the current
+    // fusion if the record is missing or does not fit the attributes
+    void SaveFusion(std::ostream &out) const;
+    void LoadFusion(std::istream &in);
+    // frees or unmaps the optimized layout
+    void ReleaseOptimized();
+    bool split_layout_ = false;
+    char *hot_attributes_ = nullptr;
+    char *hot_links_ = nullptr;
+    char *cold_graph_ = nullptr;
+    size_t link_size_ = 0;
+    size_t cold_size_ = 0;
+    // file image of LoadOptimized, which the layout pointers point into
+    char *opt_map_ = nullptr;
+    size_t opt_map_size_ = 0;
+    bool opt_map_mapped_ = false;
+    // quantized layouts: codes replace the vector rows, and the
+    // full-precision vectors (the caller's data or part of the file image)
+    // serve re-ranking
+    OptQuantization quantize_ = OPT_FLOAT;
+    // L2, INNER_PRODUCT or COSINE; the row norm slot holds |x|^2, or 1 / |x|
+    // for COSINE
+    Metric opt_metric_ = L2;
+    // largest |x| of the stored vectors, bounds the inner-product prune
+    float max_norm_ = 0;
+    DistanceFastL2 opt_distance_;
+    std::vector<float> sq_min_;
+    std::vector<float> sq_scale_;
+    unsigned pq_m_ = 0;
+    // [pq_m_][256][dimension_ / pq_m_] centroids
+    std::vector<float> pq_codebook_;
+    const float *rerank_data_ = nullptr;
+    std::vector<std::shared_ptr<SearchContext>> search_pool_;
+    // indexed by omp_get_thread_num() in the build phases, freed once the
+    // graph is built
+    std::vector<std::shared_ptr<BuildContext>> build_pool_;
+    // 1 / |x| of every row (0 for a zero row) while a COSINE graph is built
+    std::vector<float> inv_norms_;
+    std::vector<NNDescentStats> nndescent_stats_;
   };
 }
 
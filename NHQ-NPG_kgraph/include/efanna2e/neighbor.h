@@ -4,6 +4,9 @@
 #include <cstddef>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
 
 namespace efanna2e {
 
@@ -90,11 +93,12 @@ struct nhood{
     return ;
   }
 
-  void insert (unsigned id, float dist) {
+  // returns whether id entered the pool
+  bool insert (unsigned id, float dist) {
     LockGuard guard(lock);
-    if (dist > pool.back().distance) return;
+    if (dist > pool.back().distance) return false;
     for(unsigned i=0; i<pool.size(); i++){
-      if(id == pool[i].id)return;
+      if(id == pool[i].id)return false;
     }
     bool is_insert = true;
     // for (unsigned i = 0; i < pool.size(); i++) {
@@ -122,6 +126,7 @@ struct nhood{
     }
     // pool.reserve(L + 1);
     // if (pool.size() > L) {pool.resize(L);}
+    return is_insert;
   }
 
   template <typename C>
@@ -174,6 +179,129 @@ static inline int InsertIntoPool (Neighbor *addr, unsigned K, Neighbor nn) {
   return right;
 }
 
+// NN-Descent state of every node in flat arrays of fixed capacity, so the
+// build allocates once up front instead of growing per-node vectors. Each
+// node owns a pool of up to L + 1 neighbours sorted by distance, its new and
+// old samples for the next join, and the reverse samples update() collects:
+// those land in the tail of the new/old rows ([S, S + R) and [L, L + R)) and
+// are folded into the samples in place. A one-byte spinlock per node guards
+// its pool and reverse samples.
+class NNDescentGraph {
+ public:
+  struct Counts {
+    unsigned pool, M, n_new, n_old, r_new, r_old;
+  };
+
+  class Guard {
+   public:
+    Guard(NNDescentGraph &g, unsigned n) : lock_(g.locks_[n]) {
+      while (lock_.exchange(1, std::memory_order_acquire))
+        while (lock_.load(std::memory_order_relaxed)) {}
+    }
+    ~Guard() { lock_.store(0, std::memory_order_release); }
+   private:
+    std::atomic<unsigned char> &lock_;
+  };
+
+  void Init(size_t n, unsigned L, unsigned S, unsigned R) {
+    n_ = n; L_ = L; S_ = S; R_ = R;
+    pool_cap_ = L + 1;
+    new_cap_ = std::max(2 * S, S + R);
+    old_cap_ = L + R;
+    pool_.assign(n * pool_cap_, Neighbor());
+    new_.assign(n * new_cap_, 0);
+    old_.assign(n * old_cap_, 0);
+    Counts zero = {0, 0, 0, 0, 0, 0};
+    counts_.assign(n, zero);
+    locks_.reset(new std::atomic<unsigned char>[n]());
+  }
+
+  void Clear() {
+    std::vector<Neighbor>().swap(pool_);
+    std::vector<unsigned>().swap(new_);
+    std::vector<unsigned>().swap(old_);
+    std::vector<Counts>().swap(counts_);
+    locks_.reset();
+    n_ = 0;
+  }
+
+  size_t size() const { return n_; }
+  unsigned PoolCapacity() const { return pool_cap_; }
+  unsigned NewCapacity() const { return new_cap_; }
+
+  Neighbor *Pool(unsigned n) { return pool_.data() + (size_t)n * pool_cap_; }
+  const Neighbor *Pool(unsigned n) const { return pool_.data() + (size_t)n * pool_cap_; }
+  unsigned *New(unsigned n) { return new_.data() + (size_t)n * new_cap_; }
+  const unsigned *New(unsigned n) const { return new_.data() + (size_t)n * new_cap_; }
+  unsigned *Old(unsigned n) { return old_.data() + (size_t)n * old_cap_; }
+  const unsigned *Old(unsigned n) const { return old_.data() + (size_t)n * old_cap_; }
+  unsigned *RevNew(unsigned n) { return New(n) + S_; }
+  unsigned *RevOld(unsigned n) { return Old(n) + L_; }
+  Counts &count(unsigned n) { return counts_[n]; }
+  const Counts &count(unsigned n) const { return counts_[n]; }
+
+  // returns whether id entered the pool of n
+  bool Insert(unsigned n, unsigned id, float dist) {
+    Guard guard(*this, n);
+    Neighbor *pool = Pool(n);
+    unsigned &size = counts_[n].pool;
+    if (size && dist > pool[size - 1].distance) return false;
+    for (unsigned i = 0; i < size; i++) {
+      if (id == pool[i].id) return false;
+    }
+    Neighbor nn(id, dist, true);
+    if (size == 0) {
+      pool[0] = nn;
+      size = 1;
+    } else if (size < pool_cap_) {
+      InsertIntoPool(pool, size, nn);
+      size++;
+    } else {
+      InsertIntoPool(pool, pool_cap_ - 1, nn);
+    }
+    return true;
+  }
+
+  template <typename C>
+  void Join(unsigned n, C callback) const {
+    const unsigned *nn_new = New(n), *nn_old = Old(n);
+    const Counts &c = counts_[n];
+    for (unsigned a = 0; a < c.n_new; a++) {
+      unsigned const i = nn_new[a];
+      for (unsigned b = 0; b < c.n_new; b++) {
+        if (i < nn_new[b]) {
+          callback(i, nn_new[b]);
+        }
+      }
+      for (unsigned b = 0; b < c.n_old; b++) {
+        callback(i, nn_old[b]);
+      }
+    }
+  }
+
+  // folds the reverse samples of n into its new/old samples, keeping at most
+  // 2R old ones
+  void MergeReverse(unsigned n) {
+    Counts &c = counts_[n];
+    unsigned *nn_new = New(n), *nn_old = Old(n);
+    std::copy(nn_new + S_, nn_new + S_ + c.r_new, nn_new + c.n_new);
+    c.n_new += c.r_new;
+    std::copy(nn_old + L_, nn_old + L_ + c.r_old, nn_old + c.n_old);
+    c.n_old = std::min(c.n_old + c.r_old, 2 * R_);
+    c.r_new = c.r_old = 0;
+  }
+
+ private:
+  size_t n_ = 0;
+  unsigned L_ = 0, S_ = 0, R_ = 0;
+  unsigned pool_cap_ = 0, new_cap_ = 0, old_cap_ = 0;
+  std::vector<Neighbor> pool_;
+  std::vector<unsigned> new_;
+  std::vector<unsigned> old_;
+  std::vector<Counts> counts_;
+  std::unique_ptr<std::atomic<unsigned char>[]> locks_;
+};
+
 }
 
 #endif //EFANNA2E_GRAPH_H
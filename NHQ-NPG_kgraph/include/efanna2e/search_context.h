@@ -0,0 +1,229 @@
+#ifndef EFANNA2E_SEARCH_CONTEXT_H
+#define EFANNA2E_SEARCH_CONTEXT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+#include "util.h"
+#include "neighbor.h"
+
+namespace efanna2e {
+
+// Epoch-stamped visited marks: Reset() is O(1) except on mark wrap-around,
+// so a query no longer pays for allocating and zeroing an nd_-sized bitset.
+class VisitedList {
+ public:
+  explicit VisitedList(size_t size) : mark_(1), visited_(size, 0) {}
+
+  inline void Reset() {
+    if (++mark_ == 0) {
+      mark_ = 1;
+      std::fill(visited_.begin(), visited_.end(), 0);
+    }
+  }
+  inline bool Visited(unsigned id) const { return visited_[id] == mark_; }
+  inline void Visit(unsigned id) { visited_[id] = mark_; }
+  // returns true if id was already visited in the current epoch
+  inline bool TestAndVisit(unsigned id) {
+    if (visited_[id] == mark_) return true;
+    visited_[id] = mark_;
+    return false;
+  }
+  inline size_t Size() const { return visited_.size(); }
+
+ private:
+  unsigned mark_;
+  std::vector<unsigned> visited_;
+};
+
+// Visited bits for the build phases, where each node's search touches a few
+// hundred of nd_ nodes: one bit per node keeps the marks cache-resident at
+// scale, and Reset() clears only the words set since the last reset.
+class VisitedBits {
+ public:
+  explicit VisitedBits(size_t size) : size_(size), bits_((size + 63) / 64, 0) {}
+
+  inline void Reset() {
+    for (unsigned w : touched_) bits_[w] = 0;
+    touched_.clear();
+  }
+  inline bool Visited(unsigned id) const {
+    return (bits_[id >> 6] >> (id & 63)) & 1;
+  }
+  inline void Visit(unsigned id) { TestAndVisit(id); }
+  // returns true if id was already visited since the last Reset()
+  inline bool TestAndVisit(unsigned id) {
+    uint64_t &word = bits_[id >> 6];
+    uint64_t bit = (uint64_t)1 << (id & 63);
+    if (word & bit) return true;
+    if (word == 0) touched_.push_back(id >> 6);
+    word |= bit;
+    return false;
+  }
+  inline size_t Size() const { return size_; }
+
+ private:
+  size_t size_;
+  std::vector<uint64_t> bits_;
+  std::vector<unsigned> touched_;
+};
+
+// Member masks of a grouped search, kept for the nodes it touches only: an
+// open-addressing table of 8 bytes per touched node that grows as needed,
+// where per-node arrays would cost 4 bytes of every one of nd_ nodes in each
+// context. Reset() clears only the slots used since the last reset.
+class GroupMasks {
+ public:
+  struct Entry {
+    unsigned id;
+    uint16_t scored;  // members that scored the node, bit j for member j
+    uint16_t wanted;  // members that want it scored in the current round
+  };
+
+  inline void Reset() {
+    for (unsigned s : used_) slots_[s].id = kEmpty;
+    used_.clear();
+  }
+  // entry of id, zeroed the first time id is asked for since Reset(); the
+  // reference is valid until the next call
+  inline Entry &Get(unsigned id) {
+    if (2 * (used_.size() + 1) > slots_.size()) Grow();
+    size_t mask = slots_.size() - 1;
+    for (size_t s = (id * 0x9E3779B1u) >> shift_;; s = (s + 1) & mask) {
+      Entry &e = slots_[s];
+      if (e.id == id) return e;
+      if (e.id == kEmpty) {
+        e.id = id;
+        e.scored = 0;
+        e.wanted = 0;
+        used_.push_back((unsigned)s);
+        return e;
+      }
+    }
+  }
+  inline size_t Size() const { return used_.size(); }
+
+ private:
+  static const unsigned kEmpty = 0xffffffffu;
+
+  void Grow() {
+    std::vector<Entry> old;
+    std::vector<unsigned> used;
+    old.swap(slots_);
+    used.swap(used_);
+    size_t capacity = old.empty() ? 1024 : 2 * old.size();
+    Entry empty = {kEmpty, 0, 0};
+    slots_.assign(capacity, empty);
+    shift_ = 32;
+    for (size_t c = capacity; c > 1; c >>= 1) shift_--;
+    for (unsigned s : used) {
+      Entry &e = Get(old[s].id);
+      e.scored = old[s].scored;
+      e.wanted = old[s].wanted;
+    }
+  }
+
+  std::vector<Entry> slots_;
+  std::vector<unsigned> used_;
+  unsigned shift_ = 32;
+};
+
+// Opt-in adaptive termination of a search pass. A pass stops once the top-K
+// has not changed for `patience` expansions (0 disables), or once every
+// top-K entry is expanded and the best unexpanded candidate is farther than
+// the K-th result by more than `slack` times its magnitude (< 0 disables).
+struct SearchStopRule {
+  unsigned patience = 0;
+  float slack = -1;
+
+  inline bool Enabled() const { return patience > 0 || slack >= 0; }
+  // k is the next pool position the pass would look at, stale the number of
+  // expansions since the top-K last changed
+  inline bool Stop(const Neighbor *retset, unsigned L, size_t K, unsigned k,
+                   unsigned stale) const {
+    if (patience > 0 && stale >= patience) return true;
+    if (slack < 0 || k < K || k >= L) return false;
+    float kth = retset[K - 1].distance;
+    return retset[k].distance > kth + slack * std::fabs(kth);
+  }
+};
+
+// What the last search on a context did. dist_saved estimates the distance
+// computations an early stop skipped: the distinct unvisited neighbours of
+// the pool entries the full-degree pass left unexpanded. Only the next hop is
+// counted, the candidates it would have queued are not.
+struct SearchStats {
+  size_t dist_count = 0;
+  size_t expansions = 0;
+  size_t dist_saved = 0;
+  bool early_stopped = false;
+};
+
+// Per-thread scratch for SearchWithOptGraph. One context must never be
+// used by two searches at the same time.
+struct SearchContext {
+  VisitedList visited;
+  std::vector<Neighbor> retset;
+  std::vector<unsigned> init_ids;
+  // neighbours that survived the attribute check, and their mismatch counts
+  std::vector<unsigned> cand_ids;
+  std::vector<float> cand_cnt;
+  // per-query table of a quantized layout: q * scale and the bias <q, min>
+  // for SQ8, the ADC lookup table for PQ
+  std::vector<float> query_table;
+  float query_bias = 0;
+  // Pool distances leave out the per-query constant query_offset (|q|^2 for
+  // L2, 1 for cosine) and are never below query_floor; query_scale is 1 / |q|
+  // for cosine
+  float query_offset = 0;
+  float query_floor = 0;
+  float query_scale = 1;
+  std::mt19937 rng;
+  size_t dist_count;
+  SearchStopRule stop;
+  SearchStats stats;
+  // members of a query group this context leads (their pools, tables and
+  // stats), and the member masks of the nodes the group search touches
+  std::vector<std::shared_ptr<SearchContext>> group;
+  GroupMasks group_masks;
+  // contexts of the queries this one interleaves, with their own pools and
+  // visited marks
+  std::vector<std::shared_ptr<SearchContext>> lanes;
+
+  explicit SearchContext(size_t n) : visited(n), rng(rand()), dist_count(0) {}
+
+  // grows the pools for a search list of length L and starts a new epoch
+  inline void Prepare(unsigned L) {
+    if (retset.size() < L + 1) retset.resize(L + 1);
+    if (init_ids.size() < L) init_ids.resize(L);
+    visited.Reset();
+  }
+};
+
+// Per-thread scratch of the build phases, reused across the nodes a thread
+// processes: the visited marks, candidate pools and random stream that
+// would otherwise be allocated (and nd_-sized marks cleared) per node.
+struct BuildContext {
+  VisitedBits visited;
+  std::vector<Neighbor> pool;
+  std::vector<Neighbor> result;
+  std::vector<SimpleNeighbor> links;
+  std::vector<SimpleNeighbor> pruned;
+  std::vector<unsigned> ids;
+  // a node's join candidates gathered row by row, and their Gram matrix
+  std::vector<float> block;
+  std::vector<float> gram;
+  std::mt19937 rng;
+
+  BuildContext(size_t n, unsigned seed) : visited(n), rng(seed) {}
+};
+
+}
+
+#endif //EFANNA2E_SEARCH_CONTEXT_H
@@ -0,0 +1,286 @@
+#include <efanna2e/attribute_dictionary.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace efanna2e {
+
+static const char kDictionaryMagic[4] = {'N', 'H', 'Q', 'D'};
+static const uint32_t kDictionaryVersion = 1;
+
+AttributeDictionary::~AttributeDictionary() { Clear(); }
+
+void AttributeDictionary::Clear() {
+  if (map_ != nullptr) munmap(map_, map_size_);
+  map_ = nullptr;
+  map_size_ = 0;
+  std::vector<char>().swap(buffer_);
+  base_ = nullptr;
+  sections_ = nullptr;
+  n_mapped_ = 0;
+  values_.clear();
+  index_.clear();
+}
+
+uint64_t AttributeDictionary::Hash(const char *s, size_t len) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void AttributeDictionary::Resize(unsigned n_attr) {
+  Materialize();
+  values_.resize(n_attr);
+  index_.resize(n_attr);
+}
+
+unsigned AttributeDictionary::AttributeNumber() const {
+  return IsMapped() ? n_mapped_ : (unsigned)values_.size();
+}
+
+size_t AttributeDictionary::Size(unsigned attr) const {
+  return IsMapped() ? sections_[attr].n_values : values_[attr].size();
+}
+
+int AttributeDictionary::Find(unsigned attr, const std::string &value) const {
+  if (attr >= AttributeNumber()) return -1;
+  if (!IsMapped()) {
+    auto it = index_[attr].find(value);
+    return it == index_[attr].end() ? -1 : (int)it->second;
+  }
+  const Section &sec = sections_[attr];
+  const uint32_t *offsets = (const uint32_t *)(base_ + sec.offsets);
+  const uint32_t *table = (const uint32_t *)(base_ + sec.table);
+  const char *strings = base_ + sec.strings;
+  uint32_t mask = sec.table_size - 1;
+  uint32_t h = Hash(value.data(), value.size()) & mask;
+  // Validate() leaves codes unchecked, and a table with no empty slot would
+  // probe forever, so both are bounded here
+  for (uint32_t probe = 0; probe < sec.table_size && table[h] != 0; probe++, h = (h + 1) & mask) {
+    uint32_t code = table[h] - 1;
+    if (code >= sec.n_values) return -1;
+    uint32_t len = offsets[code + 1] - offsets[code];
+    if (len == value.size() && std::memcmp(strings + offsets[code], value.data(), len) == 0)
+      return (int)code;
+  }
+  return -1;
+}
+
+int AttributeDictionary::Insert(unsigned attr, const std::string &value) {
+  Materialize();
+  if (attr >= values_.size()) Resize(attr + 1);
+  auto it = index_[attr].find(value);
+  if (it != index_[attr].end()) return (int)it->second;
+  unsigned code = values_[attr].size();
+  values_[attr].push_back(value);
+  index_[attr].emplace(value, code);
+  return (int)code;
+}
+
+std::string AttributeDictionary::Value(unsigned attr, unsigned code) const {
+  if (!IsMapped()) return values_[attr][code];
+  const Section &sec = sections_[attr];
+  const uint32_t *offsets = (const uint32_t *)(base_ + sec.offsets);
+  return std::string(base_ + sec.strings + offsets[code], offsets[code + 1] - offsets[code]);
+}
+
+void AttributeDictionary::Materialize() {
+  // a mapped table is read-only; copy it out before it is modified
+  if (!IsMapped()) return;
+  unsigned n_attr = n_mapped_;
+  std::vector<std::vector<std::string>> values(n_attr);
+  for (unsigned i = 0; i < n_attr; i++) {
+    values[i].reserve(sections_[i].n_values);
+    for (unsigned j = 0; j < sections_[i].n_values; j++) values[i].push_back(Value(i, j));
+  }
+  Clear();
+  values_.swap(values);
+  index_.resize(n_attr);
+  for (unsigned i = 0; i < n_attr; i++)
+    for (unsigned j = 0; j < values_[i].size(); j++) index_[i].emplace(values_[i][j], j);
+}
+
+bool AttributeDictionary::Save(const std::string &fname) const {
+  std::ofstream out(fname.c_str(), std::ios::binary | std::ios::out);
+  if (!out) return false;
+  return Save(out);
+}
+
+bool AttributeDictionary::Save(std::ostream &out) const {
+  uint64_t start = out.tellp();
+  unsigned n_attr = AttributeNumber();
+  Header header;
+  std::memcpy(header.magic, kDictionaryMagic, sizeof(header.magic));
+  header.version = kDictionaryVersion;
+  header.n_attr = n_attr;
+  header.reserved = 0;
+
+  std::vector<Section> sections(n_attr);
+  std::vector<std::vector<uint32_t>> offsets(n_attr), tables(n_attr);
+  uint64_t pos = sizeof(Header) + n_attr * sizeof(Section);
+  auto align8 = [](uint64_t x) { return (x + 7) & ~(uint64_t)7; };
+  for (unsigned i = 0; i < n_attr; i++) {
+    uint32_t n = Size(i);
+    uint32_t table_size = 2;
+    while (table_size < 2 * n) table_size <<= 1;
+    offsets[i].resize(n + 1);
+    offsets[i][0] = 0;
+    tables[i].assign(table_size, 0);
+    for (uint32_t j = 0; j < n; j++) {
+      std::string v = Value(i, j);
+      offsets[i][j + 1] = offsets[i][j] + v.size();
+      uint32_t h = Hash(v.data(), v.size()) & (table_size - 1);
+      while (tables[i][h] != 0) h = (h + 1) & (table_size - 1);
+      tables[i][h] = j + 1;
+    }
+    sections[i].n_values = n;
+    sections[i].table_size = table_size;
+    sections[i].offsets = pos;
+    pos = align8(pos + (n + 1) * sizeof(uint32_t));
+    sections[i].table = pos;
+    pos = align8(pos + table_size * sizeof(uint32_t));
+    sections[i].strings = pos;
+    pos = align8(pos + offsets[i][n]);
+  }
+
+  out.write((char *)&header, sizeof(Header));
+  out.write((char *)sections.data(), n_attr * sizeof(Section));
+  const char zeros[8] = {0};
+  auto pad_to = [&](uint64_t target) {
+    uint64_t cur = (uint64_t)out.tellp() - start;
+    out.write(zeros, target - cur);
+  };
+  for (unsigned i = 0; i < n_attr; i++) {
+    pad_to(sections[i].offsets);
+    out.write((char *)offsets[i].data(), offsets[i].size() * sizeof(uint32_t));
+    pad_to(sections[i].table);
+    out.write((char *)tables[i].data(), tables[i].size() * sizeof(uint32_t));
+    pad_to(sections[i].strings);
+    for (uint32_t j = 0; j < sections[i].n_values; j++) {
+      std::string v = Value(i, j);
+      out.write(v.data(), v.size());
+    }
+  }
+  pad_to(pos);
+  return out.good();
+}
+
+bool AttributeDictionary::Load(const std::string &fname, bool use_mmap) {
+  char magic[4] = {0};
+  {
+    std::ifstream in(fname.c_str(), std::ios::binary);
+    if (!in.is_open()) return false;
+    in.read(magic, sizeof(magic));
+  }
+  if (std::memcmp(magic, kDictionaryMagic, sizeof(magic)) != 0) return LoadText(fname);
+
+  Clear();
+  int fd = open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+  if (use_mmap) {
+    void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    map_ = (char *)p;
+    map_size_ = size;
+    base_ = map_;
+  } else {
+    buffer_.resize(size);
+    size_t done = 0;
+    while (done < size) {
+      ssize_t r = read(fd, buffer_.data() + done, size - done);
+      if (r <= 0) break;
+      done += r;
+    }
+    if (done != size) {
+      close(fd);
+      Clear();
+      return false;
+    }
+    base_ = buffer_.data();
+  }
+  close(fd);
+  Validate(size, fname);
+  return true;
+}
+
+void AttributeDictionary::Attach(const char *base, size_t size) {
+  Clear();
+  base_ = base;
+  Validate(size, "embedded table");
+}
+
+void AttributeDictionary::Validate(size_t size, const std::string &name) {
+  const Header *header = (const Header *)base_;
+  if (size < sizeof(Header) || std::memcmp(header->magic, kDictionaryMagic, sizeof(header->magic)) != 0 ||
+      header->version != kDictionaryVersion ||
+      size < sizeof(Header) + header->n_attr * sizeof(Section)) {
+    Clear();
+    throw std::runtime_error("[Error] Unsupported or truncated attribute table: " + name);
+  }
+  n_mapped_ = header->n_attr;
+  sections_ = (const Section *)(base_ + sizeof(Header));
+  for (unsigned i = 0; i < n_mapped_; i++) {
+    const Section &sec = sections_[i];
+    // Find() masks hashes with table_size - 1 and needs an empty slot
+    bool valid = sec.table_size != 0 && (sec.table_size & (sec.table_size - 1)) == 0 &&
+                 sec.table_size > sec.n_values && sec.strings <= size && sec.table <= size &&
+                 sec.offsets <= size &&
+                 (uint64_t)sec.table_size * sizeof(uint32_t) <= size - sec.table &&
+                 ((uint64_t)sec.n_values + 1) * sizeof(uint32_t) <= size - sec.offsets;
+    if (valid) {
+      // every value must lie in the string blob, which must fit in the file
+      const uint32_t *offsets = (const uint32_t *)(base_ + sec.offsets);
+      for (uint32_t j = 0; valid && j < sec.n_values; j++) valid = offsets[j] <= offsets[j + 1];
+      valid = valid && offsets[sec.n_values] <= size - sec.strings;
+    }
+    if (!valid) {
+      Clear();
+      throw std::runtime_error("[Error] Corrupted attribute table: " + name);
+    }
+  }
+}
+
+bool AttributeDictionary::LoadText(const std::string &fname) {
+  // one line per attribute, values separated by single spaces
+  std::ifstream in(fname.c_str());
+  if (!in.is_open()) return false;
+  Clear();
+  std::string s;
+  const std::string c = " ";
+  unsigned attr = 0;
+  while (getline(in, s)) {
+    Resize(attr + 1);
+    std::string::size_type pos1 = 0, pos2 = s.find(c);
+    while (std::string::npos != pos2) {
+      Insert(attr, s.substr(pos1, pos2 - pos1));
+      pos1 = pos2 + c.size();
+      pos2 = s.find(c, pos1);
+    }
+    if (pos1 != s.length()) Insert(attr, s.substr(pos1));
+    attr++;
+  }
+  return true;
+}
+
+void AttributeDictionary::PrintSummary() const {
+  std::cout << "attribute table: " << AttributeNumber() << " attributes (";
+  for (unsigned i = 0; i < AttributeNumber(); i++) std::cout << (i ? ", " : "") << Size(i);
+  std::cout << " values)" << (IsMapped() ? ", hash indexed" : "") << std::endl;
+}
+
+}
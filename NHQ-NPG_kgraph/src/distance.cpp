@@ -0,0 +1,484 @@
+#include <efanna2e/distance.h>
+#include <immintrin.h>
+#include <cstdlib>
+#include <cstring>
+
+// Distance kernels for every SIMD level, compiled with per-function target
+// attributes so one binary carries all of them whatever -march it was built
+// with. The widest level the CPU (and OS) supports is picked once at startup.
+// Every kernel handles the tail exactly and never reads past size.
+
+namespace efanna2e {
+namespace {
+
+  float L2Scalar(const float* a, const float* b, unsigned size) {
+    float result = 0;
+    for (unsigned i = 0; i < size; i++) {
+      float diff = a[i] - b[i];
+      result += diff * diff;
+    }
+    return result;
+  }
+
+  float InnerProductScalar(const float* a, const float* b, unsigned size) {
+    float result = 0;
+    for (unsigned i = 0; i < size; i++) {
+      result += a[i] * b[i];
+    }
+    return result;
+  }
+
+  float Sq8DotScalar(const float* qs, const uint8_t* code, unsigned size) {
+    float result = 0;
+    for (unsigned i = 0; i < size; i++) {
+      result += qs[i] * code[i];
+    }
+    return result;
+  }
+
+  float PqSumScalar(const float* table, const uint8_t* code, unsigned m) {
+    float result = 0;
+    for (unsigned j = 0; j < m; j++) {
+      result += table[j * 256 + code[j]];
+    }
+    return result;
+  }
+
+  // The *Many kernels score one vector against n queries. The vector chunk
+  // is loaded (and for SQ8 widened) once for four queries, so a group of
+  // queries pays for a node's record only once.
+  void InnerProductManyScalar(const float* const* qs, unsigned n, const float* b, unsigned size, float* out) {
+    for (unsigned j = 0; j < n; j++) {
+      out[j] = InnerProductScalar(qs[j], b, size);
+    }
+  }
+
+  void Sq8DotManyScalar(const float* const* qs, unsigned n, const uint8_t* code, unsigned size, float* out) {
+    for (unsigned j = 0; j < n; j++) {
+      out[j] = Sq8DotScalar(qs[j], code, size);
+    }
+  }
+
+  unsigned MismatchScalar(const char* a, const char* b, unsigned width) {
+    unsigned cnt = 0;
+    for (unsigned i = 0; i < width; i++) {
+      cnt += a[i] != b[i];
+    }
+    return cnt;
+  }
+
+  __attribute__((target("sse4.2")))
+  inline float HorizontalSum(__m128 sum) {
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+  }
+
+  __attribute__((target("sse4.2")))
+  float L2Sse(const float* a, const float* b, unsigned size) {
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    unsigned i = 0;
+    for (; i + 8 <= size; i += 8) {
+      __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+      __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+      sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+    }
+    if (i + 4 <= size) {
+      __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+      i += 4;
+    }
+    float result = HorizontalSum(_mm_add_ps(sum0, sum1));
+    return result + L2Scalar(a + i, b + i, size - i);
+  }
+
+  __attribute__((target("sse4.2")))
+  float InnerProductSse(const float* a, const float* b, unsigned size) {
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    unsigned i = 0;
+    for (; i + 8 <= size; i += 8) {
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+      sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    if (i + 4 <= size) {
+      sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+      i += 4;
+    }
+    float result = HorizontalSum(_mm_add_ps(sum0, sum1));
+    return result + InnerProductScalar(a + i, b + i, size - i);
+  }
+
+  __attribute__((target("sse4.2")))
+  float Sq8DotSse(const float* qs, const uint8_t* code, unsigned size) {
+    __m128 sum = _mm_setzero_ps();
+    unsigned i = 0;
+    for (; i + 4 <= size; i += 4) {
+      int packed;
+      std::memcpy(&packed, code + i, sizeof(packed));
+      __m128 x = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+      sum = _mm_add_ps(sum, _mm_mul_ps(x, _mm_loadu_ps(qs + i)));
+    }
+    return HorizontalSum(sum) + Sq8DotScalar(qs + i, code + i, size - i);
+  }
+
+  __attribute__((target("sse4.2")))
+  void InnerProductManySse(const float* const* qs, unsigned n, const float* b, unsigned size, float* out) {
+    unsigned j = 0;
+    for (; j + 4 <= n; j += 4) {
+      __m128 sum[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+      unsigned i = 0;
+      for (; i + 4 <= size; i += 4) {
+        __m128 x = _mm_loadu_ps(b + i);
+        for (unsigned r = 0; r < 4; r++) {
+          sum[r] = _mm_add_ps(sum[r], _mm_mul_ps(x, _mm_loadu_ps(qs[j + r] + i)));
+        }
+      }
+      for (unsigned r = 0; r < 4; r++) {
+        out[j + r] = HorizontalSum(sum[r]) + InnerProductScalar(qs[j + r] + i, b + i, size - i);
+      }
+    }
+    for (; j < n; j++) {
+      out[j] = InnerProductSse(qs[j], b, size);
+    }
+  }
+
+  __attribute__((target("sse4.2")))
+  void Sq8DotManySse(const float* const* qs, unsigned n, const uint8_t* code, unsigned size, float* out) {
+    unsigned j = 0;
+    for (; j + 4 <= n; j += 4) {
+      __m128 sum[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+      unsigned i = 0;
+      for (; i + 4 <= size; i += 4) {
+        int packed;
+        std::memcpy(&packed, code + i, sizeof(packed));
+        __m128 x = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+        for (unsigned r = 0; r < 4; r++) {
+          sum[r] = _mm_add_ps(sum[r], _mm_mul_ps(x, _mm_loadu_ps(qs[j + r] + i)));
+        }
+      }
+      for (unsigned r = 0; r < 4; r++) {
+        out[j + r] = HorizontalSum(sum[r]) + Sq8DotScalar(qs[j + r] + i, code + i, size - i);
+      }
+    }
+    for (; j < n; j++) {
+      out[j] = Sq8DotSse(qs[j], code, size);
+    }
+  }
+
+  __attribute__((target("sse4.2")))
+  unsigned MismatchSse(const char* a, const char* b, unsigned width) {
+    unsigned cnt = 0;
+    for (unsigned i = 0; i < width; i += 16) {
+      __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                  _mm_loadu_si128((const __m128i*)(b + i)));
+      cnt += 16 - __builtin_popcount((unsigned)_mm_movemask_epi8(eq));
+    }
+    return cnt;
+  }
+
+  __attribute__((target("avx2,fma")))
+  inline float HorizontalSum(__m256 sum) {
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+  }
+
+  __attribute__((target("avx2,fma")))
+  float L2Avx2(const float* a, const float* b, unsigned size) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    unsigned i = 0;
+    for (; i + 16 <= size; i += 16) {
+      __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+      __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+      sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+      sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+    }
+    if (i + 8 <= size) {
+      __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+      sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+      i += 8;
+    }
+    float result = HorizontalSum(_mm256_add_ps(sum0, sum1));
+    return result + L2Scalar(a + i, b + i, size - i);
+  }
+
+  __attribute__((target("avx2,fma")))
+  float InnerProductAvx2(const float* a, const float* b, unsigned size) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    unsigned i = 0;
+    for (; i + 16 <= size; i += 16) {
+      sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+      sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    if (i + 8 <= size) {
+      sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+      i += 8;
+    }
+    float result = HorizontalSum(_mm256_add_ps(sum0, sum1));
+    return result + InnerProductScalar(a + i, b + i, size - i);
+  }
+
+  __attribute__((target("avx2,fma")))
+  float Sq8DotAvx2(const float* qs, const uint8_t* code, unsigned size) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    unsigned i = 0;
+    for (; i + 16 <= size; i += 16) {
+      __m128i c = _mm_loadu_si128((const __m128i*)(code + i));
+      __m256 x0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(c));
+      __m256 x1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(c, 8)));
+      sum0 = _mm256_fmadd_ps(x0, _mm256_loadu_ps(qs + i), sum0);
+      sum1 = _mm256_fmadd_ps(x1, _mm256_loadu_ps(qs + i + 8), sum1);
+    }
+    if (i + 8 <= size) {
+      __m256 x0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(code + i))));
+      sum0 = _mm256_fmadd_ps(x0, _mm256_loadu_ps(qs + i), sum0);
+      i += 8;
+    }
+    float result = HorizontalSum(_mm256_add_ps(sum0, sum1));
+    return result + Sq8DotScalar(qs + i, code + i, size - i);
+  }
+
+  __attribute__((target("avx2,fma")))
+  float PqSumAvx2(const float* table, const uint8_t* code, unsigned m) {
+    const __m256i rows = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+    __m256 sum = _mm256_setzero_ps();
+    unsigned j = 0;
+    for (; j + 8 <= m; j += 8) {
+      __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(code + j)));
+      sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table + j * 256, _mm256_add_epi32(idx, rows), 4));
+    }
+    return HorizontalSum(sum) + PqSumScalar(table + j * 256, code + j, m - j);
+  }
+
+  __attribute__((target("avx2,fma")))
+  void InnerProductManyAvx2(const float* const* qs, unsigned n, const float* b, unsigned size, float* out) {
+    unsigned j = 0;
+    for (; j + 4 <= n; j += 4) {
+      __m256 sum[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+      unsigned i = 0;
+      for (; i + 8 <= size; i += 8) {
+        __m256 x = _mm256_loadu_ps(b + i);
+        for (unsigned r = 0; r < 4; r++) {
+          sum[r] = _mm256_fmadd_ps(x, _mm256_loadu_ps(qs[j + r] + i), sum[r]);
+        }
+      }
+      for (unsigned r = 0; r < 4; r++) {
+        out[j + r] = HorizontalSum(sum[r]) + InnerProductScalar(qs[j + r] + i, b + i, size - i);
+      }
+    }
+    for (; j < n; j++) {
+      out[j] = InnerProductAvx2(qs[j], b, size);
+    }
+  }
+
+  __attribute__((target("avx2,fma")))
+  void Sq8DotManyAvx2(const float* const* qs, unsigned n, const uint8_t* code, unsigned size, float* out) {
+    unsigned j = 0;
+    for (; j + 4 <= n; j += 4) {
+      __m256 sum[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+      unsigned i = 0;
+      for (; i + 8 <= size; i += 8) {
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(code + i))));
+        for (unsigned r = 0; r < 4; r++) {
+          sum[r] = _mm256_fmadd_ps(x, _mm256_loadu_ps(qs[j + r] + i), sum[r]);
+        }
+      }
+      for (unsigned r = 0; r < 4; r++) {
+        out[j + r] = HorizontalSum(sum[r]) + Sq8DotScalar(qs[j + r] + i, code + i, size - i);
+      }
+    }
+    for (; j < n; j++) {
+      out[j] = Sq8DotAvx2(qs[j], code, size);
+    }
+  }
+
+  // widths are 16, 32 or multiples of 64, so at most one 16-byte step is left
+  __attribute__((target("avx2,fma")))
+  unsigned MismatchAvx2(const char* a, const char* b, unsigned width) {
+    unsigned cnt = 0;
+    unsigned i = 0;
+    for (; i + 32 <= width; i += 32) {
+      __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                     _mm256_loadu_si256((const __m256i*)(b + i)));
+      cnt += 32 - __builtin_popcount((unsigned)_mm256_movemask_epi8(eq));
+    }
+    if (i < width) {
+      __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                  _mm_loadu_si128((const __m128i*)(b + i)));
+      cnt += 16 - __builtin_popcount((unsigned)_mm_movemask_epi8(eq));
+    }
+    return cnt;
+  }
+
+  // GCC's AVX-512 headers seed some intrinsics with _mm512_undefined_*(),
+  // which trips its own uninitialized-use warnings
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+  // the tail is loaded under a mask, so there is no scalar remainder
+  __attribute__((target("avx512f")))
+  float L2Avx512(const float* a, const float* b, unsigned size) {
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    unsigned i = 0;
+    for (; i + 32 <= size; i += 32) {
+      __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+      __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+      sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+      sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+    }
+    for (; i < size; i += 16) {
+      __mmask16 mask = size - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (size - i)) - 1);
+      __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+      sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+  }
+
+  __attribute__((target("avx512f")))
+  float InnerProductAvx512(const float* a, const float* b, unsigned size) {
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    unsigned i = 0;
+    for (; i + 32 <= size; i += 32) {
+      sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+      sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+    }
+    for (; i < size; i += 16) {
+      __mmask16 mask = size - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (size - i)) - 1);
+      sum0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+  }
+
+  __attribute__((target("avx512f")))
+  float Sq8DotAvx512(const float* qs, const uint8_t* code, unsigned size) {
+    __m512 sum = _mm512_setzero_ps();
+    unsigned i = 0;
+    for (; i + 16 <= size; i += 16) {
+      __m512 x = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(code + i))));
+      sum = _mm512_fmadd_ps(x, _mm512_loadu_ps(qs + i), sum);
+    }
+    return _mm512_reduce_add_ps(sum) + Sq8DotScalar(qs + i, code + i, size - i);
+  }
+
+  __attribute__((target("avx512f")))
+  float PqSumAvx512(const float* table, const uint8_t* code, unsigned m) {
+    const __m512i rows = _mm512_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792,
+                                           2048, 2304, 2560, 2816, 3072, 3328, 3584, 3840);
+    __m512 sum = _mm512_setzero_ps();
+    unsigned j = 0;
+    for (; j + 16 <= m; j += 16) {
+      __m512i idx = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(code + j)));
+      sum = _mm512_add_ps(sum, _mm512_i32gather_ps(_mm512_add_epi32(idx, rows), table + j * 256, 4));
+    }
+    return _mm512_reduce_add_ps(sum) + PqSumAvx2(table + j * 256, code + j, m - j);
+  }
+
+  __attribute__((target("avx512f")))
+  void InnerProductManyAvx512(const float* const* qs, unsigned n, const float* b, unsigned size, float* out) {
+    unsigned j = 0;
+    for (; j + 4 <= n; j += 4) {
+      __m512 sum[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps()};
+      for (unsigned i = 0; i < size; i += 16) {
+        __mmask16 mask = size - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (size - i)) - 1);
+        __m512 x = _mm512_maskz_loadu_ps(mask, b + i);
+        for (unsigned r = 0; r < 4; r++) {
+          sum[r] = _mm512_fmadd_ps(x, _mm512_maskz_loadu_ps(mask, qs[j + r] + i), sum[r]);
+        }
+      }
+      for (unsigned r = 0; r < 4; r++) {
+        out[j + r] = _mm512_reduce_add_ps(sum[r]);
+      }
+    }
+    for (; j < n; j++) {
+      out[j] = InnerProductAvx512(qs[j], b, size);
+    }
+  }
+
+  __attribute__((target("avx512f")))
+  void Sq8DotManyAvx512(const float* const* qs, unsigned n, const uint8_t* code, unsigned size, float* out) {
+    unsigned j = 0;
+    for (; j + 4 <= n; j += 4) {
+      __m512 sum[4] = {_mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps()};
+      unsigned i = 0;
+      for (; i + 16 <= size; i += 16) {
+        __m512 x = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(code + i))));
+        for (unsigned r = 0; r < 4; r++) {
+          sum[r] = _mm512_fmadd_ps(x, _mm512_loadu_ps(qs[j + r] + i), sum[r]);
+        }
+      }
+      for (unsigned r = 0; r < 4; r++) {
+        out[j + r] = _mm512_reduce_add_ps(sum[r]) + Sq8DotScalar(qs[j + r] + i, code + i, size - i);
+      }
+    }
+    for (; j < n; j++) {
+      out[j] = Sq8DotAvx512(qs[j], code, size);
+    }
+  }
+
+  // byte compares need AVX512BW on top of the avx512f the level is picked
+  // by, so the AVX-512 table only takes this when the CPU has both
+  __attribute__((target("avx512f,avx512bw")))
+  unsigned MismatchAvx512(const char* a, const char* b, unsigned width) {
+    unsigned cnt = 0;
+    unsigned i = 0;
+    for (; i + 64 <= width; i += 64) {
+      __mmask64 eq = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+      cnt += 64 - __builtin_popcountll(eq);
+    }
+    return cnt + MismatchAvx2(a + i, b + i, width - i);
+  }
+
+#pragma GCC diagnostic pop
+
+  const DistanceKernels kScalarKernels = {
+      "scalar", L2Scalar, InnerProductScalar, Sq8DotScalar, PqSumScalar,
+      InnerProductManyScalar, Sq8DotManyScalar, MismatchScalar};
+  const DistanceKernels kSseKernels = {
+      "sse4.2", L2Sse, InnerProductSse, Sq8DotSse, PqSumScalar,
+      InnerProductManySse, Sq8DotManySse, MismatchSse};
+  const DistanceKernels kAvx2Kernels = {
+      "avx2", L2Avx2, InnerProductAvx2, Sq8DotAvx2, PqSumAvx2,
+      InnerProductManyAvx2, Sq8DotManyAvx2, MismatchAvx2};
+  const DistanceKernels kAvx512Kernels = {
+      "avx512", L2Avx512, InnerProductAvx512, Sq8DotAvx512, PqSumAvx512,
+      InnerProductManyAvx512, Sq8DotManyAvx512, MismatchAvx512};
+  const DistanceKernels kAvx512NoBwKernels = {
+      "avx512", L2Avx512, InnerProductAvx512, Sq8DotAvx512, PqSumAvx512,
+      InnerProductManyAvx512, Sq8DotManyAvx512, MismatchAvx2};
+
+  // EFANNA2E_SIMD=avx512|avx2|sse4.2|scalar caps the level, e.g. to compare
+  // kernels or to reproduce results of older hosts
+  const DistanceKernels* PickDistanceKernels() {
+    __builtin_cpu_init();
+    const char* cap = std::getenv("EFANNA2E_SIMD");
+    int level = 3;
+    if (cap != nullptr) {
+      if (std::strcmp(cap, "scalar") == 0) level = 0;
+      else if (std::strcmp(cap, "sse4.2") == 0) level = 1;
+      else if (std::strcmp(cap, "avx2") == 0) level = 2;
+    }
+    if (level >= 3 && __builtin_cpu_supports("avx512f"))
+      return __builtin_cpu_supports("avx512bw") ? &kAvx512Kernels : &kAvx512NoBwKernels;
+    if (level >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return &kAvx2Kernels;
+    if (level >= 1 && __builtin_cpu_supports("sse4.2")) return &kSseKernels;
+    return &kScalarKernels;
+  }
+
+}
+
+  // constant-initialized, so distances computed during static
+  // initialization of other units fall back to scalar instead of crashing
+  const DistanceKernels* distance_kernels = &kScalarKernels;
+  static const bool distance_kernels_picked = (distance_kernels = PickDistanceKernels(), true);
+
+}
@@ -5,78 +5,140 @@
 #include <set>
 #include <queue>
 #include <stack>
+#include <limits>
+#include <cmath>
+#include <numeric>
+#include <sstream>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cblas.h>
+#include <chrono>
 
 namespace efanna2e
 {
 #define _CONTROL_NUM 100
+#define _CACHE_LINE 64
+// nodes OptimizeGraph copies before returning freed rows to the system
+#define _OPTIMIZE_CHUNK ((size_t)1 << 20)
+// optional section after the attribute rows of an index file
+#define _TRAILER_MAGIC 0x5851484e // "NHQX"
+#define _TRAILER_VERSION 2
+#define _OPTIMIZED_VERSION 4
   IndexGraph::IndexGraph(const size_t dimension, const size_t n, Metric m, Index *initializer)
       : Index(dimension, n, m),
         initializer_{initializer}
   {
-    assert(dimension == initializer->GetDimension());
+    search_kernel_ = &IndexGraph::SearchWithOptGraph_<0, 0, false, OPT_FLOAT, L2>;
+    opt_graph_ = nullptr;
+    assert(initializer == nullptr || dimension == initializer->GetDimension());
+  }
+  IndexGraph::~IndexGraph()
+  {
+    ReleaseOptimized();
+    ReleaseAttributes();
+    std::cout << "release index." << std::endl;
   }
-  IndexGraph::~IndexGraph() { std::cout << "release index." << std::endl; }
 
-  void IndexGraph::join()
+  size_t IndexGraph::join()
   {
-#pragma omp parallel for default(shared) schedule(dynamic, 100)
+    size_t updates = 0;
+#pragma omp parallel for default(shared) schedule(dynamic, 100) reduction(+ : updates)
     for (unsigned n = 0; n < nd_; n++)
     {
-      graph_[n].join([&](unsigned i, unsigned j)
+      graph_.Join(n, [&](unsigned i, unsigned j)
                      {
                        if (i != j)
                        {
-                         float dist = distance_->compare(data_ + i * dimension_, data_ + j * dimension_, dimension_);
-
-                         float cnt = 0;
-                         for (int k = 0; k < attribute_number_; k++)
-                         {
-                           if (attributes_[i][k] != attributes_[j][k])
-                           {
-                             cnt++;
-                           }
-                         }
-                         fusion_distance(dist, cnt);
-
-                         graph_[i].insert(j, dist);
-                         graph_[j].insert(i, dist);
+                         float dist = PairDistance(i, j);
+
+                         fusion_distance(dist, i, j);
+
+                         updates += graph_.Insert(i, j, dist);
+                         updates += graph_.Insert(j, i, dist);
                        }
                      });
     }
+    return updates;
+  }
+
+  size_t IndexGraph::join_blas(const std::vector<float> &norms)
+  {
+    PrepareBuildPool(nd_);
+    size_t updates = 0;
+    auto pair_distance = [&](unsigned i, unsigned j, float ip)
+    {
+      if (metric_ == INNER_PRODUCT)
+        return -ip;
+      if (metric_ == COSINE)
+        return norms[i] <= 0 || norms[j] <= 0 ? 1 : 1 - ip / (norms[i] * norms[j]);
+      return std::max(norms[i] + norms[j] - 2 * ip, 0.0f);
+    };
+#pragma omp parallel for default(shared) schedule(dynamic, 100) reduction(+ : updates)
+    for (unsigned n = 0; n < nd_; n++)
+    {
+      const unsigned *nn_new = graph_.New(n);
+      const unsigned *nn_old = graph_.Old(n);
+      unsigned a = graph_.count(n).n_new, rows = a + graph_.count(n).n_old;
+      if (a == 0)
+        continue;
+      BuildContext &bc = *build_pool_[omp_get_thread_num()];
+      bc.block.resize((size_t)rows * dimension_);
+      bc.gram.resize((size_t)a * rows);
+      for (unsigned r = 0; r < rows; r++)
+      {
+        unsigned id = r < a ? nn_new[r] : nn_old[r - a];
+        std::memcpy(bc.block.data() + (size_t)r * dimension_, data_ + (size_t)id * dimension_,
+                    dimension_ * sizeof(float));
+      }
+      // gram[r][c] = <new r, candidate c>
+      cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, a, rows, (int)dimension_, 1.0f,
+                  bc.block.data(), (int)dimension_, bc.block.data(), (int)dimension_, 0.0f,
+                  bc.gram.data(), rows);
+      // the pairs of NNDescentGraph::Join: new-new once (i < j), new-old all
+      for (unsigned r = 0; r < a; r++)
+      {
+        unsigned i = nn_new[r];
+        const float *g = bc.gram.data() + (size_t)r * rows;
+        for (unsigned c = 0; c < rows; c++)
+        {
+          unsigned j = c < a ? nn_new[c] : nn_old[c - a];
+          if (c < a ? i >= j : i == j)
+            continue;
+          float dist = pair_distance(i, j, g[c]);
+          fusion_distance(dist, i, j);
+
+          updates += graph_.Insert(i, j, dist);
+          updates += graph_.Insert(j, i, dist);
+        }
+      }
+    }
+    return updates;
   }
+
   void IndexGraph::update(const Parameters &parameters)
   {
     unsigned S = parameters.Get<unsigned>("S");
     unsigned R = parameters.Get<unsigned>("R");
     unsigned L = parameters.Get<unsigned>("L");
-#pragma omp parallel for
-    for (unsigned i = 0; i < nd_; i++)
-    {
-      std::vector<unsigned>().swap(graph_[i].nn_new);
-      std::vector<unsigned>().swap(graph_[i].nn_old);
-      //std::vector<unsigned>().swap(graph_[i].rnn_new);
-      //std::vector<unsigned>().swap(graph_[i].rnn_old);
-      //graph_[i].nn_new.clear();
-      //graph_[i].nn_old.clear();
-      //graph_[i].rnn_new.clear();
-      //graph_[i].rnn_old.clear();
-    }
+    PrepareBuildPool(nd_);
 #pragma omp parallel for
     for (unsigned n = 0; n < nd_; ++n)
     {
-      auto &nn = graph_[n];
-      // std::sort(nn.pool.begin(), nn.pool.end());
-      if (nn.pool.size() > L)
-        nn.pool.resize(L);
-      nn.pool.reserve(L + 1);
-      unsigned maxl = std::min(nn.M + S, (unsigned)nn.pool.size());
+      NNDescentGraph::Counts &nn = graph_.count(n);
+      nn.n_new = nn.n_old = 0;
+      // std::sort(pool, pool + nn.pool);
+      if (nn.pool > L)
+        nn.pool = L;
+      const Neighbor *pool = graph_.Pool(n);
+      unsigned maxl = std::min(nn.M + S, nn.pool);
       unsigned c = 0;
       unsigned l = 0;
-      //std::sort(nn.pool.begin(), nn.pool.end());
-      //if(n==0)std::cout << nn.pool[0].distance<<","<< nn.pool[1].distance<<","<< nn.pool[2].distance<< std::endl;
       while ((l < maxl) && (c < S))
       {
-        if (nn.pool[l].flag)
+        if (pool[l].flag)
           ++c;
         ++l;
       }
@@ -85,116 +147,247 @@ namespace efanna2e
 #pragma omp parallel for
     for (unsigned n = 0; n < nd_; ++n)
     {
-      auto &nnhd = graph_[n];
-      auto &nn_new = nnhd.nn_new;
-      auto &nn_old = nnhd.nn_old;
+      std::mt19937 &rng = build_pool_[omp_get_thread_num()]->rng;
+      NNDescentGraph::Counts &nnhd = graph_.count(n);
+      Neighbor *pool = graph_.Pool(n);
+      unsigned *nn_new = graph_.New(n);
+      unsigned *nn_old = graph_.Old(n);
       for (unsigned l = 0; l < nnhd.M; ++l)
       {
-        auto &nn = nnhd.pool[l];
-        auto &nhood_o = graph_[nn.id]; // nn on the other side of the edge
+        auto &nn = pool[l];
+        // nn on the other side of the edge
+        NNDescentGraph::Counts &nhood_o = graph_.count(nn.id);
+        const Neighbor &worst_o = graph_.Pool(nn.id)[nhood_o.pool - 1];
         if (nn.flag)
         {
-          nn_new.push_back(nn.id);
-          if (nn.distance > nhood_o.pool.back().distance)
+          nn_new[nnhd.n_new++] = nn.id;
+          if (nn.distance > worst_o.distance)
           {
-            LockGuard guard(nhood_o.lock);
-            if (nhood_o.rnn_new.size() < R)
-              nhood_o.rnn_new.push_back(n);
+            NNDescentGraph::Guard guard(graph_, nn.id);
+            if (nhood_o.r_new < R)
+              graph_.RevNew(nn.id)[nhood_o.r_new++] = n;
             else
             {
-              unsigned int pos = rand() % R;
-              nhood_o.rnn_new[pos] = n;
+              unsigned int pos = rng() % R;
+              graph_.RevNew(nn.id)[pos] = n;
             }
           }
           nn.flag = false;
         }
         else
         {
-          nn_old.push_back(nn.id);
-          if (nn.distance > nhood_o.pool.back().distance)
+          nn_old[nnhd.n_old++] = nn.id;
+          if (nn.distance > worst_o.distance)
           {
-            LockGuard guard(nhood_o.lock);
-            if (nhood_o.rnn_old.size() < R)
-              nhood_o.rnn_old.push_back(n);
+            NNDescentGraph::Guard guard(graph_, nn.id);
+            if (nhood_o.r_old < R)
+              graph_.RevOld(nn.id)[nhood_o.r_old++] = n;
             else
             {
-              unsigned int pos = rand() % R;
-              nhood_o.rnn_old[pos] = n;
+              unsigned int pos = rng() % R;
+              graph_.RevOld(nn.id)[pos] = n;
             }
           }
         }
       }
-      // std::make_heap(nnhd.pool.begin(), nnhd.pool.end());
     }
 #pragma omp parallel for
     for (unsigned i = 0; i < nd_; ++i)
     {
-      auto &nn_new = graph_[i].nn_new;
-      auto &nn_old = graph_[i].nn_old;
-      auto &rnn_new = graph_[i].rnn_new;
-      auto &rnn_old = graph_[i].rnn_old;
-      if (R && rnn_new.size() > R)
-      {
-        std::random_shuffle(rnn_new.begin(), rnn_new.end());
-        rnn_new.resize(R);
-      }
-      nn_new.insert(nn_new.end(), rnn_new.begin(), rnn_new.end());
-      if (R && rnn_old.size() > R)
-      {
-        std::random_shuffle(rnn_old.begin(), rnn_old.end());
-        rnn_old.resize(R);
-      }
-      nn_old.insert(nn_old.end(), rnn_old.begin(), rnn_old.end());
-      if (nn_old.size() > R * 2)
-      {
-        nn_old.resize(R * 2);
-        nn_old.reserve(R * 2);
-      }
-      std::vector<unsigned>().swap(graph_[i].rnn_new);
-      std::vector<unsigned>().swap(graph_[i].rnn_old);
+      graph_.MergeReverse(i);
     }
   } //update
 
   void IndexGraph::NNDescent(const Parameters &parameters)
   {
     unsigned iter = parameters.Get<unsigned>("iter");
+    // "join_blas": score each node's local join as one matrix product. It
+    // only pays once the joins are wide (S around 40 and up); below that,
+    // gathering the rows costs more than the product saves.
+    bool blas = parameters.Get<unsigned>("join_blas", 0) != 0;
+    std::vector<float> norms;
+    int blas_threads = 0;
+    if (blas)
+    {
+      norms.resize(nd_);
+#pragma omp parallel for
+      for (unsigned i = 0; i < nd_; i++)
+      {
+        const float *x = data_ + (size_t)i * dimension_;
+        norms[i] = distance_kernels->inner_product(x, x, (unsigned)dimension_);
+        if (metric_ == COSINE)
+          norms[i] = std::sqrt(norms[i]);
+      }
+      // the blocks are tiny and every OpenMP thread runs its own
+      blas_threads = openblas_get_num_threads();
+      openblas_set_num_threads(1);
+    }
+    unsigned L = parameters.Get<unsigned>("L");
+    NNDescentStopRule stop;
+    stop.recall = parameters.Get<float>("stop_recall", stop.recall);
+    stop.delta = parameters.Get<float>("stop_delta", stop.delta);
+    stop.seconds = parameters.Get<float>("stop_seconds", stop.seconds);
+    auto start = std::chrono::steady_clock::now();
+
+    // The recall estimate compares the pools of the control points with
+    // their nearest neighbours in a random sample of "recall_sample" points
+    // (0: a tenth of the data, at least 1000). Of the sample, only the top
+    // fraction that stands for the whole data's top _CONTROL_NUM counts.
     std::mt19937 rng(rand());
     std::vector<unsigned> control_points(_CONTROL_NUM);
     std::vector<std::vector<unsigned>> acc_eval_set(_CONTROL_NUM);
-    GenRandom(rng, &control_points[0], control_points.size(), nd_);
-    generate_control_set(control_points, acc_eval_set, nd_);
+    if (stop.recall > 0)
+    {
+      size_t n_sample = parameters.Get<unsigned>("recall_sample", 0);
+      if (n_sample == 0)
+        n_sample = std::max<size_t>(nd_ / 10, 1000);
+      std::vector<unsigned> sample(std::min(n_sample, nd_));
+      if (sample.size() == nd_)
+        std::iota(sample.begin(), sample.end(), 0);
+      else
+        GenRandom(rng, sample.data(), (unsigned)sample.size(), (unsigned)nd_);
+      unsigned k = (unsigned)std::max<size_t>(1, _CONTROL_NUM * sample.size() / nd_);
+      GenRandom(rng, &control_points[0], control_points.size(), nd_);
+      generate_control_set(control_points, acc_eval_set, sample, k);
+    }
+
+    nndescent_stats_.clear();
     for (unsigned it = 0; it < iter; it++)
     {
-      join();
+      NNDescentStats stats;
+      stats.iter = it;
+      stats.updates = blas ? join_blas(norms) : join();
+      stats.update_rate = (float)stats.updates / ((float)nd_ * L);
       update(parameters);
       //checkDup();
-      float acc = eval_recall(control_points, acc_eval_set);
-      std::cout << "iter: " << it << std::endl;
-      if (acc >= 0.8)
+      if (stop.recall > 0)
+        stats.recall = eval_recall(control_points, acc_eval_set);
+      stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      nndescent_stats_.push_back(stats);
+      std::cout << "iter: " << it << " updates: " << stats.updates << " (" << stats.update_rate << ")";
+      if (stats.recall >= 0)
+        std::cout << " recall: " << stats.recall;
+      std::cout << " " << stats.seconds << "s" << std::endl;
+      if (stop.Stop(stats))
         break;
     }
+    if (blas)
+      openblas_set_num_threads(blas_threads);
   }
 
   void IndexGraph::Cut_Link(const Parameters &parameters, SimpleNeighbor *cut_graph_)
   {
     unsigned range = parameters.Get<unsigned>("RANGE");
     float m = parameters.Get<float>("M");
-    std::vector<std::mutex> locks(nd_);
+    PrepareBuildPool(nd_);
+    // Reverse edges bucketed by target: in a pass over the target range
+    // [lo, hi), those into node t are reverse[offsets[t], offsets[t + 1]).
+    // A bucket entry costs as much as a cut_graph_ slot, so bucketing every
+    // edge at once would hold a second copy of the graph (RANGE * 8 bytes a
+    // node); the targets are split into ranges of about an eighth of the
+    // edges instead, and the buffer stays near RANGE bytes a node on top of
+    // the nd_ + 1 offsets. Rows of earlier ranges are merged by the time a
+    // later range is bucketed, so an edge one of them dropped is not
+    // reversed any more, much as with the old per-node locks.
+    std::vector<size_t> offsets(nd_ + 1, 0);
+    std::vector<unsigned> bounds;
+    std::vector<SimpleNeighbor> reverse;
 
     // std::cout << "test1\n";
 #pragma omp parallel
     {
-      std::vector<Neighbor> pool;
+      BuildContext &bc = *build_pool_[omp_get_thread_num()];
 #pragma omp for schedule(dynamic, 100)
       for (unsigned n = 0; n < nd_; ++n)
       {
-        pool.clear();
-        sync_prune(n, pool, m, parameters, cut_graph_); //cut edge
+        sync_prune(n, bc, m, parameters, cut_graph_); //cut edge
       }
-#pragma omp for schedule(dynamic, 100)
+#pragma omp for schedule(static)
       for (unsigned n = 0; n < nd_; ++n)
       {
-        InterInsert(n, range, m, locks, cut_graph_); //reverse connection
+        const SimpleNeighbor *src_pool = cut_graph_ + (size_t)n * (size_t)range;
+        for (unsigned i = 0; i < range && src_pool[i].distance != -1; i++)
+        {
+          size_t &count = offsets[src_pool[i].id];
+#pragma omp atomic
+          count++;
+        }
+      }
+#pragma omp single
+      {
+        size_t total = 0;
+        for (unsigned t = 0; t < nd_; t++)
+          total += offsets[t];
+        size_t budget = std::max(total / 8, (size_t)1 << 22);
+        size_t edges = 0;
+        bounds.push_back(0);
+        for (unsigned t = 0; t < nd_; t++)
+        {
+          edges += offsets[t];
+          if (edges >= budget && t + 1 < nd_)
+          {
+            bounds.push_back(t + 1);
+            edges = 0;
+          }
+        }
+        bounds.push_back(nd_);
+      }
+      for (size_t r = 0; r + 1 < bounds.size(); r++)
+      {
+        unsigned lo = bounds[r], hi = bounds[r + 1];
+        // the first range is counted above, later ones see the merged rows
+        if (r > 0)
+        {
+#pragma omp for schedule(static)
+          for (unsigned t = lo; t < hi; t++)
+            offsets[t] = 0;
+#pragma omp for schedule(static)
+          for (unsigned n = 0; n < nd_; ++n)
+          {
+            const SimpleNeighbor *src_pool = cut_graph_ + (size_t)n * (size_t)range;
+            for (unsigned i = 0; i < range && src_pool[i].distance != -1; i++)
+            {
+              unsigned t = src_pool[i].id;
+              if (t < lo || t >= hi)
+                continue;
+              size_t &count = offsets[t];
+#pragma omp atomic
+              count++;
+            }
+          }
+        }
+        // counting sort of the edges n -> t by t: sum up to the bucket ends,
+        // then fill every bucket from its end down to its start
+#pragma omp single
+        {
+          for (unsigned t = lo + 1; t < hi; t++)
+            offsets[t] += offsets[t - 1];
+          offsets[hi] = offsets[hi - 1];
+          reverse.resize(offsets[hi]);
+        }
+#pragma omp for schedule(static)
+        for (unsigned n = 0; n < nd_; ++n)
+        {
+          const SimpleNeighbor *src_pool = cut_graph_ + (size_t)n * (size_t)range;
+          for (unsigned i = 0; i < range && src_pool[i].distance != -1; i++)
+          {
+            unsigned t = src_pool[i].id;
+            if (t < lo || t >= hi)
+              continue;
+            size_t &end = offsets[t];
+            size_t pos;
+#pragma omp atomic capture
+            pos = --end;
+            reverse[pos] = SimpleNeighbor(n, src_pool[i].distance);
+          }
+        }
+        // every target merges its bucket on its own, so no locks are needed
+#pragma omp for schedule(dynamic, 100)
+        for (unsigned n = lo; n < hi; ++n)
+        {
+          InterInsert(n, range, reverse.data() + offsets[n], offsets[n + 1] - offsets[n],
+                      bc, cut_graph_); //reverse connection
+        }
       }
     }
   }
@@ -226,7 +419,8 @@ namespace efanna2e
       float cnt = 0;
       for (int k = 0; k < attribute_number_; k++)
       {
-        cnt += (float)(attributes_code[k].size() - 1) / (float)(attributes_code[k].size());
+        cnt += (fusion_policy_ == FUSION_WEIGHTED ? fusion_weights_[k] : 1.0f) *
+               (float)(attribute_dict_.Size(k) - 1) / (float)(attribute_dict_.Size(k));
       }
       fusion_distance(dist, cnt);
 
@@ -259,7 +453,8 @@ namespace efanna2e
           float cnt = 0;
           for (int k = 0; k < attribute_number_; k++)
           {
-            cnt += (float)(attributes_code[k].size() - 1) / (float)(attributes_code[k].size());
+            cnt += (fusion_policy_ == FUSION_WEIGHTED ? fusion_weights_[k] : 1.0f) *
+                   (float)(attribute_dict_.Size(k) - 1) / (float)(attribute_dict_.Size(k));
           }
           fusion_distance(dist, cnt);
 
@@ -283,40 +478,31 @@ namespace efanna2e
   }
 
   void IndexGraph::get_neighbors(const unsigned q, const Parameters &parameter,
-                                 std::vector<Neighbor> &pool, boost::dynamic_bitset<> &flagss)
+                                 std::vector<Neighbor> &pool, VisitedBits &visited)
   {
-    boost::dynamic_bitset<> flags{nd_, 0};
     unsigned PL = parameter.Get<unsigned>("PL");
     unsigned K = parameter.Get<unsigned>("K");
     unsigned b = parameter.Get<float>("B");
     unsigned ML = PL + pool.size();
     float bK = (float)K * b;
-    flags[q] = true;
-    for (unsigned i = 0; i < graph_[q].pool.size() && i < bK; i++)
+    visited.Visit(q);
+    const Neighbor *q_pool = graph_.Pool(q);
+    for (unsigned i = 0; i < graph_.count(q).pool && i < bK; i++)
     {
-      unsigned nid = graph_[q].pool[i].id;
-      for (unsigned nn = 0; nn < graph_[nid].pool.size() && i < bK; nn++)
+      unsigned nid = q_pool[i].id;
+      const Neighbor *nid_pool = graph_.Pool(nid);
+      for (unsigned nn = 0; nn < graph_.count(nid).pool && i < bK; nn++)
       {
-        unsigned nnid = graph_[nid].pool[nn].id;
-        if (flags[nnid] || flagss[nnid])
+        unsigned nnid = nid_pool[nn].id;
+        if (visited.TestAndVisit(nnid))
           continue;
-        flags[nnid] = true;
-        float d1 = graph_[q].pool[i].distance;
-        float d2 = graph_[nid].pool[nn].distance;
+        float d1 = q_pool[i].distance;
+        float d2 = nid_pool[nn].distance;
         if (d1 < d2 && d2 - d1 > d1)
           continue;
-        float dist = distance_->compare(data_ + dimension_ * q,
-                                        data_ + dimension_ * nnid, dimension_);
+        float dist = PairDistance(q, nnid);
 
-        float cnt = 0;
-        for (int k = 0; k < attribute_number_; k++)
-        {
-          if (attributes_[q][k] != attributes_[nnid][k])
-          {
-            cnt++;
-          }
-        }
-        fusion_distance(dist, cnt);
+        fusion_distance(dist, q, nnid);
 
         pool.push_back(Neighbor(nnid, dist, true));
         if (pool.size() >= ML)
@@ -393,26 +579,27 @@ namespace efanna2e
     }
   }
 
-  void IndexGraph::sync_prune(unsigned q, std::vector<Neighbor> &pool, float m,
+  void IndexGraph::sync_prune(unsigned q, BuildContext &bc, float m,
                               const Parameters &parameters, SimpleNeighbor *cut_graph_)
   {
     unsigned range = parameters.Get<unsigned>("RANGE");
     width = range;
     unsigned start = 0;
 
-    boost::dynamic_bitset<> flags{nd_, 0};
-    for (unsigned nn = 0; nn < graph_[q].pool.size(); nn++)
+    std::vector<Neighbor> &pool = bc.pool;
+    pool.clear();
+    bc.visited.Reset();
+    const Neighbor *q_pool = graph_.Pool(q);
+    for (unsigned nn = 0; nn < graph_.count(q).pool; nn++)
     {
-      unsigned id = graph_[q].pool[nn].id;
-      flags[id] = 1;
-      float dist = graph_[q].pool[nn].distance;
-      bool f = graph_[q].pool[nn].flag;
-      pool.push_back(Neighbor(id, dist, f));
+      bc.visited.Visit(q_pool[nn].id);
+      pool.push_back(q_pool[nn]);
     }
-    get_neighbors(q, parameters, pool, flags);
+    get_neighbors(q, parameters, pool, bc.visited);
     std::sort(pool.begin(), pool.end());
 
-    std::vector<Neighbor> result;
+    std::vector<Neighbor> &result = bc.result;
+    result.clear();
     if (pool[start].id == q)
       start++;
     result.push_back(pool[start]);
@@ -428,19 +615,9 @@ namespace efanna2e
           occlude = true;
           break;
         }
-        float djk = distance_->compare(data_ + dimension_ * (size_t)result[t].id,
-                                       data_ + dimension_ * (size_t)p.id,
-                                       (unsigned)dimension_);
+        float djk = PairDistance(result[t].id, p.id);
 
-        float cnt = 0;
-        for (int k = 0; k < attribute_number_; k++)
-        {
-          if (attributes_[result[t].id][k] != attributes_[p.id][k])
-          {
-            cnt++;
-          }
-        }
-        fusion_distance(djk, cnt);
+        fusion_distance(djk, result[t].id, p.id);
 
         // float cos_ij = (p.distance + result[t].distance - djk) / 2 /
         //                sqrt(p.distance * result[t].distance);
@@ -469,107 +646,80 @@ namespace efanna2e
     }
   }
 
-  void IndexGraph::InterInsert(unsigned n, unsigned range, float m,
-                               std::vector<std::mutex> &locks,
-                               SimpleNeighbor *cut_graph_)
+  void IndexGraph::InterInsert(unsigned n, unsigned range, const SimpleNeighbor *reverse,
+                               size_t n_reverse, BuildContext &bc, SimpleNeighbor *cut_graph_)
   {
-    SimpleNeighbor *src_pool = cut_graph_ + (size_t)n * (size_t)range;
-    for (size_t i = 0; i < range; i++)
+    SimpleNeighbor *des_pool = cut_graph_ + (size_t)n * (size_t)range;
+    std::vector<SimpleNeighbor> &temp_pool = bc.links;
+    temp_pool.clear();
+    bc.visited.Reset();
+    for (size_t j = 0; j < range; j++)
     {
-      if (src_pool[i].distance == -1)
+      if (des_pool[j].distance == -1)
         break;
+      bc.visited.Visit(des_pool[j].id);
+      temp_pool.push_back(des_pool[j]);
+    }
+    size_t own = temp_pool.size();
+    for (size_t i = 0; i < n_reverse; i++)
+    {
+      if (!bc.visited.TestAndVisit(reverse[i].id))
+        temp_pool.push_back(reverse[i]);
+    }
+    if (temp_pool.size() == own)
+      return;
+    // the bucket order depends on the thread schedule
+    std::sort(temp_pool.begin() + own, temp_pool.end(),
+              [](const SimpleNeighbor &a, const SimpleNeighbor &b)
+              { return a.distance < b.distance || (a.distance == b.distance && a.id < b.id); });
 
-      SimpleNeighbor sn(n, src_pool[i].distance);
-      size_t des = src_pool[i].id;
-      SimpleNeighbor *des_pool = cut_graph_ + des * (size_t)range;
-
-      std::vector<SimpleNeighbor> temp_pool;
-      int dup = 0;
+    if (temp_pool.size() > range)
+    {
+      std::vector<SimpleNeighbor> &result = bc.pruned;
+      result.clear();
+      unsigned start = 0;
+      std::sort(temp_pool.begin(), temp_pool.end());
+      result.push_back(temp_pool[start]);
+      while (result.size() < range && (++start) < temp_pool.size())
       {
-        LockGuard guard(locks[des]);
-        for (size_t j = 0; j < range; j++)
+        auto &p = temp_pool[start];
+        bool occlude = false;
+        for (unsigned t = 0; t < result.size(); t++)
         {
-          if (des_pool[j].distance == -1)
-            break;
-          if (n == des_pool[j].id)
+          if (p.id == result[t].id)
           {
-            dup = 1;
+            occlude = true;
             break;
           }
-          temp_pool.push_back(des_pool[j]);
-        }
-      }
-      if (dup)
-        continue;
-
-      temp_pool.push_back(sn);
-      if (temp_pool.size() > range)
-      {
-        std::vector<SimpleNeighbor> result;
-        unsigned start = 0;
-        std::sort(temp_pool.begin(), temp_pool.end());
-        result.push_back(temp_pool[start]);
-        while (result.size() < range && (++start) < temp_pool.size())
-        {
-          auto &p = temp_pool[start];
-          bool occlude = false;
-          for (unsigned t = 0; t < result.size(); t++)
-          {
-            if (p.id == result[t].id)
-            {
-              occlude = true;
-              break;
-            }
-            float djk = distance_->compare(
-                data_ + dimension_ * (size_t)result[t].id,
-                data_ + dimension_ * (size_t)p.id, (unsigned)dimension_);
+          float djk = PairDistance(result[t].id, p.id);
 
-            float cnt = 0;
-            for (int k = 0; k < attribute_number_; k++)
-            {
-              if (attributes_[result[t].id][k] != attributes_[p.id][k])
-              {
-                cnt++;
-              }
-            }
-            fusion_distance(djk, cnt);
+          fusion_distance(djk, result[t].id, p.id);
 
-            if (djk < p.distance)
-            {
-              occlude = true;
-              break;
-            }
-          }
-          if (!occlude)
-            result.push_back(p);
-        }
-        {
-          LockGuard guard(locks[des]);
-          for (unsigned t = 0; t < result.size(); t++)
+          if (djk < p.distance)
           {
-            des_pool[t] = result[t];
-          }
-          if (result.size() < range)
-          {
-            des_pool[result.size()].distance = -1;
+            occlude = true;
+            break;
           }
         }
+        if (!occlude)
+          result.push_back(p);
       }
-      else
+      for (unsigned t = 0; t < result.size(); t++)
       {
-        LockGuard guard(locks[des]);
-        for (unsigned t = 0; t < range; t++)
-        {
-          if (des_pool[t].distance == -1)
-          {
-            des_pool[t] = sn;
-            if (t + 1 < range)
-              des_pool[t + 1].distance = -1;
-            break;
-          }
-        }
+        des_pool[t] = result[t];
+      }
+      if (result.size() < range)
+      {
+        des_pool[result.size()].distance = -1;
       }
     }
+    else
+    {
+      for (size_t t = own; t < temp_pool.size(); t++)
+        des_pool[t] = temp_pool[t];
+      if (temp_pool.size() < range)
+        des_pool[temp_pool.size()].distance = -1;
+    }
   }
 
   void IndexGraph::get_cluster_center(const Parameters &parameter, boost::dynamic_bitset<> cflags, unsigned &cc)
@@ -658,32 +808,142 @@ namespace efanna2e
     std::cout << "navigation_points: " << eps_.size() << "\n";
   }
 
+  void IndexGraph::BuildEntryPoints(const Parameters &parameters)
+  { // per attribute combination: the medoid, then farthest-point samples so
+    // that the entries cover the whole group; the same over all nodes in eps_
+    unsigned n_entry = parameters.Get<unsigned>("n_entry", 16);
+    unsigned n_sample = parameters.Get<unsigned>("n_entry_sample", 20000);
+    std::unordered_map<std::string, unsigned> group_of;
+    std::vector<std::vector<unsigned>> groups;
+    for (unsigned i = 0; i < nd_; i++)
+    {
+      std::string key(NodeAttributes(i), attribute_number_);
+      auto it = group_of.find(key);
+      if (it == group_of.end())
+      {
+        it = group_of.emplace(key, (unsigned)groups.size()).first;
+        groups.emplace_back();
+      }
+      groups[it->second].push_back(i);
+    }
+    std::vector<unsigned> all(nd_);
+    for (unsigned i = 0; i < nd_; i++)
+      all[i] = i;
+    groups.push_back(all);
+
+    // entries are spread in L2 whatever the index metric: the medoid and the
+    // farthest-point stop need a distance that is zero only between equal
+    // points, which -<a, b> is not
+    std::vector<std::vector<unsigned>> entries(groups.size());
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned g = 0; g < groups.size(); g++)
+    {
+      std::vector<unsigned> &members = groups[g];
+      if (members.size() > n_sample)
+      {
+        std::mt19937 rng(g);
+        std::shuffle(members.begin(), members.end(), rng);
+        members.resize(n_sample);
+      }
+      std::vector<float> center(dimension_, 0);
+      for (unsigned id : members)
+      {
+        const float *x = data_ + (size_t)id * dimension_;
+        for (unsigned j = 0; j < dimension_; j++)
+          center[j] += x[j];
+      }
+      for (unsigned j = 0; j < dimension_; j++)
+        center[j] /= members.size();
+      unsigned best = 0;
+      float best_dist = std::numeric_limits<float>::max();
+      for (unsigned i = 0; i < members.size(); i++)
+      {
+        float dist = distance_kernels->l2(center.data(), data_ + (size_t)members[i] * dimension_,
+                                          (unsigned)dimension_);
+        if (dist < best_dist)
+        {
+          best_dist = dist;
+          best = i;
+        }
+      }
+
+      std::vector<float> min_dist(members.size(), std::numeric_limits<float>::max());
+      while (entries[g].size() < n_entry && entries[g].size() < members.size())
+      {
+        unsigned ep = members[best];
+        entries[g].push_back(ep);
+        const float *x = data_ + (size_t)ep * dimension_;
+        best_dist = -1;
+        for (unsigned i = 0; i < members.size(); i++)
+        {
+          float dist = distance_kernels->l2(x, data_ + (size_t)members[i] * dimension_,
+                                            (unsigned)dimension_);
+          if (dist < min_dist[i])
+            min_dist[i] = dist;
+          if (min_dist[i] > best_dist)
+          {
+            best_dist = min_dist[i];
+            best = i;
+          }
+        }
+        if (best_dist <= 0)
+          break;
+      }
+    }
+
+    entry_points_.clear();
+    for (auto &it : group_of)
+      entry_points_[it.first].swap(entries[it.second]);
+    eps_.swap(entries.back());
+    std::cout << "entry points: " << entry_points_.size() << " attribute combinations, "
+              << eps_.size() << " global" << std::endl;
+  }
+
+  unsigned IndexGraph::InitEntryPoints(SearchContext &ctx, const char *attribute, unsigned L)
+  { // entries of the query's combination, global entries, then random nodes
+    unsigned *init_ids = ctx.init_ids.data();
+    VisitedList &flags = ctx.visited;
+    unsigned n = 0;
+    if (L > nd_)
+      L = nd_;
+    auto push = [&](unsigned id)
+    {
+      if (n < L && id < nd_ && !flags.TestAndVisit(id))
+        init_ids[n++] = id;
+    };
+    auto it = entry_points_.find(std::string(attribute, attribute_number_));
+    if (it != entry_points_.end())
+    {
+      for (unsigned i = 0; i < it->second.size(); i++)
+        push(it->second[i]);
+    }
+    for (unsigned i = 0; i < eps_.size(); i++)
+      push(eps_[i]);
+    while (n < L)
+      push(ctx.rng() % nd_);
+    return n;
+  }
+
   void IndexGraph::generate_control_set(std::vector<unsigned> &c,
                                         std::vector<std::vector<unsigned>> &v,
-                                        unsigned N)
+                                        const std::vector<unsigned> &sample, unsigned k)
   {
+    k = std::min(k, (unsigned)sample.size());
 #pragma omp parallel for
     for (unsigned i = 0; i < c.size(); i++)
     {
       std::vector<Neighbor> tmp;
-      for (unsigned j = 0; j < N; j++)
+      tmp.reserve(sample.size());
+      for (unsigned j : sample)
       {
-        float dist = distance_->compare(data_ + c[i] * dimension_, data_ + j * dimension_, dimension_);
+        float dist = PairDistance(c[i], j);
 
-        float cnt = 0;
-        for (int k = 0; k < attribute_number_; k++)
-        {
-          if (attributes_[c[i]][k] != attributes_[j][k])
-          {
-            cnt++;
-          }
-        }
-        fusion_distance(dist, cnt);
+        fusion_distance(dist, c[i], j);
 
         tmp.push_back(Neighbor(j, dist, true));
       }
-      std::partial_sort(tmp.begin(), tmp.begin() + _CONTROL_NUM, tmp.end());
-      for (unsigned j = 0; j < _CONTROL_NUM; j++)
+      std::partial_sort(tmp.begin(), tmp.begin() + k, tmp.end());
+      for (unsigned j = 0; j < k; j++)
       {
         v[i].push_back(tmp[j].id);
       }
@@ -696,9 +956,9 @@ namespace efanna2e
     for (unsigned i = 0; i < ctrl_points.size(); i++)
     {
       float acc = 0;
-      auto &g = graph_[ctrl_points[i]].pool;
+      const Neighbor *g = graph_.Pool(ctrl_points[i]);
       auto &v = acc_eval_set[i];
-      for (unsigned j = 0; j < g.size(); j++)
+      for (unsigned j = 0; j < graph_.count(ctrl_points[i]).pool; j++)
       {
         for (unsigned k = 0; k < v.size(); k++)
         {
@@ -711,9 +971,7 @@ namespace efanna2e
       }
       mean_acc += acc / v.size();
     }
-    float ret_recall = mean_acc / ctrl_points.size();
-    std::cout << "recall : " << ret_recall << std::endl;
-    return ret_recall;
+    return mean_acc / ctrl_points.size();
   }
 
   void IndexGraph::InitializeGraph(const Parameters &parameters)
@@ -722,17 +980,23 @@ namespace efanna2e
     const unsigned L = parameters.Get<unsigned>("L");
     const unsigned S = parameters.Get<unsigned>("S");
 
-    graph_.reserve(nd_);
+    const unsigned R = parameters.Get<unsigned>("R");
+
+    graph_.Init(nd_, L, S, R);
     std::mt19937 rng(rand());
     for (unsigned i = 0; i < nd_; i++)
     {
-      graph_.push_back(nhood(L, S, rng, (unsigned)nd_));
+      graph_.count(i).M = S;
+      graph_.count(i).n_new = S * 2;
+      GenRandom(rng, graph_.New(i), S * 2, (unsigned)nd_);
     }
+    PrepareBuildPool(nd_);
 #pragma omp parallel for
     for (unsigned i = 0; i < nd_; i++)
     {
       //const float *query = data_ + i * dimension_;
-      std::vector<unsigned> tmp(S + 1);
+      std::vector<unsigned> &tmp = build_pool_[omp_get_thread_num()]->ids;
+      tmp.resize(S + 1);
       initializer_->Search(i, data_, S + 1, parameters, tmp.data());
 
       for (unsigned j = 0; j < S; j++)
@@ -740,22 +1004,13 @@ namespace efanna2e
         unsigned id = tmp[j];
         if (id == i)
           continue;
-        float dist = distance_->compare(data_ + i * dimension_, data_ + id * dimension_, (unsigned)dimension_);
+        float dist = PairDistance(i, id);
 
-        float cnt = 0;
-        for (int k = 0; k < attribute_number_; k++)
-        {
-          if (attributes_[i][k] != attributes_[id][k])
-          {
-            cnt++;
-          }
-        }
-        fusion_distance(dist, cnt);
+        fusion_distance(dist, i, id);
 
-        graph_[i].pool.push_back(Neighbor(id, dist, true));
+        graph_.Pool(i)[graph_.count(i).pool++] = Neighbor(id, dist, true);
       }
-      std::sort(graph_[i].pool.begin(), graph_[i].pool.end());
-      graph_[i].pool.reserve(L + 1);
+      std::sort(graph_.Pool(i), graph_.Pool(i) + graph_.count(i).pool);
     }
   }
 
@@ -766,11 +1021,15 @@ namespace efanna2e
     const unsigned L = parameters.Get<unsigned>("L");
     const unsigned S = parameters.Get<unsigned>("S");
 
-    graph_.reserve(nd_);
+    const unsigned R = parameters.Get<unsigned>("R");
+
+    graph_.Init(nd_, L, S, R);
     std::mt19937 rng(rand());
     for (unsigned i = 0; i < nd_; i++)
     {
-      graph_.push_back(nhood(L, S, rng, (unsigned)nd_));
+      graph_.count(i).M = S;
+      graph_.count(i).n_new = S * 2;
+      GenRandom(rng, graph_.New(i), S * 2, (unsigned)nd_);
     }
 #pragma omp parallel for
     for (unsigned i = 0; i < nd_; i++)
@@ -780,27 +1039,20 @@ namespace efanna2e
 
       size_t K = ids.size();
 
-      for (unsigned j = 0; j < K; j++)
+      Neighbor *pool = graph_.Pool(i);
+      unsigned &pool_size = graph_.count(i).pool;
+      for (unsigned j = 0; j < K && pool_size < graph_.PoolCapacity(); j++)
       {
         unsigned id = ids[j];
         if (id == i || (j > 0 && id == ids[j - 1]))
           continue;
-        float dist = distance_->compare(data_ + i * dimension_, data_ + id * dimension_, (unsigned)dimension_);
+        float dist = PairDistance(i, id);
 
-        float cnt = 0;
-        for (int k = 0; k < attribute_number_; k++)
-        {
-          if (attributes_[i][k] != attributes_[id][k])
-          {
-            cnt++;
-          }
-        }
-        fusion_distance(dist, cnt);
+        fusion_distance(dist, i, id);
 
-        graph_[i].pool.push_back(Neighbor(id, dist, true));
+        pool[pool_size++] = Neighbor(id, dist, true);
       }
-      std::make_heap(graph_[i].pool.begin(), graph_[i].pool.end());
-      graph_[i].pool.reserve(L);
+      std::make_heap(pool, pool + pool_size);
       std::vector<unsigned>().swap(ids);
     }
     CompactGraph().swap(final_graph_);
@@ -810,6 +1062,7 @@ namespace efanna2e
   {
     data_ = data;
     assert(initializer_->HasBuilt());
+    SetFusion(parameters);
 
     InitializeGraph_Refine(parameters);
     NNDescent(parameters);
@@ -820,20 +1073,17 @@ namespace efanna2e
     for (unsigned i = 0; i < nd_; i++)
     {
       std::vector<unsigned> tmp;
-      std::sort(graph_[i].pool.begin(), graph_[i].pool.end());
+      Neighbor *pool = graph_.Pool(i);
+      std::sort(pool, pool + graph_.count(i).pool);
       for (unsigned j = 0; j < K; j++)
       {
-        tmp.push_back(graph_[i].pool[j].id);
+        tmp.push_back(pool[j].id);
       }
       tmp.reserve(K);
       final_graph_.push_back(tmp);
-      std::vector<Neighbor>().swap(graph_[i].pool);
-      std::vector<unsigned>().swap(graph_[i].nn_new);
-      std::vector<unsigned>().swap(graph_[i].nn_old);
-      std::vector<unsigned>().swap(graph_[i].rnn_new);
-      std::vector<unsigned>().swap(graph_[i].rnn_new);
     }
-    std::vector<nhood>().swap(graph_);
+    graph_.Clear();
+    build_pool_.clear();
     has_built = true;
   }
 
@@ -844,6 +1094,18 @@ namespace efanna2e
     data_ = data;
     assert(initializer_->HasBuilt());
     unsigned range = parameters.Get<unsigned>("RANGE");
+    SetFusion(parameters);
+    if (metric_ == COSINE)
+    {
+      inv_norms_.resize(nd_);
+#pragma omp parallel for
+      for (unsigned i = 0; i < nd_; i++)
+      {
+        const float *x = data_ + (size_t)i * dimension_;
+        float norm = std::sqrt(distance_kernels->inner_product(x, x, (unsigned)dimension_));
+        inv_norms_[i] = norm > 0 ? 1 / norm : 0;
+      }
+    }
     InitializeGraph(parameters);
     NNDescent(parameters);
     SimpleNeighbor *cut_graph_ = new SimpleNeighbor[nd_ * (size_t)range];
@@ -866,13 +1128,10 @@ namespace efanna2e
       {
         final_graph_[i][j] = pool[j].id;
       }
-      std::vector<Neighbor>().swap(graph_[i].pool);
-      std::vector<unsigned>().swap(graph_[i].nn_new);
-      std::vector<unsigned>().swap(graph_[i].nn_old);
-      std::vector<unsigned>().swap(graph_[i].rnn_new);
-      std::vector<unsigned>().swap(graph_[i].rnn_new);
     }
-    std::vector<nhood>().swap(graph_);
+    graph_.Clear();
+    build_pool_.clear();
+    std::vector<float>().swap(inv_norms_);
     //RefineGraph(parameters);
 
     //DFS_expand(parameters);
@@ -890,6 +1149,7 @@ namespace efanna2e
     avg /= 1.0 * nd_;
     printf("Degree Statistics: Max = %d, Min = %d, Avg = %d\n",
            max, min, avg);
+    BuildEntryPoints(parameters);
 
     //std::cout << "connect..." << std::endl;
     //strong_connect(parameters);
@@ -1088,15 +1348,7 @@ namespace efanna2e
       unsigned id = init_ids[i];
       float dist = distance_->compare(data_ + dimension_ * id, data_ + dimension_ * query_id, (unsigned)dimension_);
 
-      float cnt = 0;
-      for (int k = 0; k < attribute_number_; k++)
-      {
-        if (attributes_[query_id][k] != attributes_[id][k])
-        {
-          cnt++;
-        }
-      }
-      fusion_distance(dist, cnt);
+      fusion_distance(dist, query_id, id);
 
       retset[i] = Neighbor(id, dist, true);
     }
@@ -1120,15 +1372,7 @@ namespace efanna2e
           flags[id] = 1;
           float dist = distance_->compare(data_ + dimension_ * query_id, data_ + dimension_ * id, (unsigned)dimension_);
 
-          float cnt = 0;
-          for (int k = 0; k < attribute_number_; k++)
-          {
-            if (attributes_[query_id][k] != attributes_[id][k])
-            {
-              cnt++;
-            }
-          }
-          fusion_distance(dist, cnt);
+          fusion_distance(dist, query_id, id);
 
           if (dist >= retset[L - 1].distance)
             continue;
@@ -1171,8 +1415,15 @@ namespace efanna2e
     out.write((char *)&attribute_number_, sizeof(int));
     for (unsigned i = 0; i < nd_; i++)
     {
-      out.write((char *)attributes_[i].data(), attribute_number_ * sizeof(char));
+      out.write(NodeAttributes(i), attribute_number_ * sizeof(char));
     }
+
+    unsigned magic = _TRAILER_MAGIC;
+    unsigned version = _TRAILER_VERSION;
+    out.write((char *)&magic, sizeof(unsigned));
+    out.write((char *)&version, sizeof(unsigned));
+    SaveEntryPoints(out);
+    SaveFusion(out);
     out.close();
   }
 
@@ -1198,142 +1449,1330 @@ namespace efanna2e
     }
 
     in.read((char *)&attribute_number_, sizeof(int));
-    while (!in.eof())
+    ReleaseAttributes();
+    ReserveAttributes(nd_, AttributeStride(attribute_number_));
+    for (unsigned i = 0; i < nd_; i++)
     {
-      std::vector<char> tmp(attribute_number_);
-      in.read((char *)tmp.data(), attribute_number_ * sizeof(char));
-      if (in.eof())
+      if (!in.read(NodeAttributes(i), attribute_number_ * sizeof(char)))
         break;
-      attributes_.push_back(tmp);
+      attribute_rows_++;
     }
     std::cout << "attribute dim:" << attribute_number_ << std::endl;
-    std::cout << "attribute number:" << attributes_.size() << std::endl;
+    std::cout << "attribute number:" << attribute_rows_ << std::endl;
+
+    // indexes written before the trailer existed simply end here
+    unsigned magic = 0, version = 0;
+    entry_points_.clear();
+    if (in.read((char *)&magic, sizeof(unsigned)) && magic == _TRAILER_MAGIC &&
+        in.read((char *)&version, sizeof(unsigned)))
+    {
+      LoadEntryPoints(in);
+      std::cout << "entry points: " << entry_points_.size() << std::endl;
+    }
+    // version 1 indexes were all built with the default fusion
+    fusion_policy_ = FUSION_MULTIPLICATIVE;
+    fusion_weight_ = 1;
+    fusion_weights_.clear();
+    if (version >= 2)
+      LoadFusion(in);
+    UpdateFusion();
     cc /= nd_;
     std::cerr << "Average Degree = " << cc << std::endl;
     // statistic();
   }
 
-  void IndexGraph::SearchWithOptGraph(std::vector<char> attribute,
-                                      const float *query, size_t K,
-                                      const Parameters &parameters,
-                                      unsigned *indices)
+  // header of a SaveOptimized file; every section starts on a cache line
+  struct OptimizedHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout; // 0 packed, 1 split
+    uint64_t nd;
+    uint64_t dimension;
+    uint32_t width;
+    uint32_t attribute_number;
+    uint32_t attribute_stride;
+    uint32_t quantization; // 0 none, 1 sq8, 2 pq
+    uint32_t metric;       // L2, INNER_PRODUCT or COSINE
+    float max_norm;
+    uint64_t data_len;
+    uint64_t attribute_len;
+    uint64_t neighbor_len;
+    uint64_t node_size;
+    uint64_t link_size;
+    uint64_t cold_size;
+    // offset and size of: packed nodes or split attribute rows, split
+    // neighbour rows, split vector rows, entry points, attribute dictionary,
+    // quantizer parameters, full-precision vectors for re-ranking, fusion
+    uint64_t sections[8][2];
+  };
+  static const char kOptimizedMagic[8] = {'N', 'H', 'Q', 'O', 'P', 'T', 'G', 0};
+
+  void IndexGraph::SaveEntryPoints(std::ostream &out) const
   {
-    unsigned L = parameters.Get<unsigned>("L_search");
-    float weight_search = parameters.Get<float>("weight_search");
-    DistanceFastL2 *dist_fast = (DistanceFastL2 *)distance_;
+    unsigned n_entry = entry_points_.size();
+    out.write((char *)&n_entry, sizeof(unsigned));
+    for (auto &it : entry_points_)
+    {
+      unsigned n_ep = it.second.size();
+      out.write(it.first.data(), attribute_number_ * sizeof(char));
+      out.write((char *)&n_ep, sizeof(unsigned));
+      out.write((char *)it.second.data(), n_ep * sizeof(unsigned));
+    }
+  }
 
-    std::vector<Neighbor> retset(L + 1);
-    std::vector<unsigned> init_ids(L);
-    std::mt19937 rng(rand());
-    GenRandom(rng, init_ids.data(), L, (unsigned)nd_);
-    // assert(eps_.size() < L);
+  void IndexGraph::SaveFusion(std::ostream &out) const
+  {
+    uint32_t policy = fusion_policy_;
+    uint32_t n_attr = attribute_number_;
+    out.write((char *)&policy, sizeof(policy));
+    out.write((char *)&fusion_weight_, sizeof(float));
+    out.write((char *)&n_attr, sizeof(n_attr));
+    out.write((char *)fusion_weights_.data(), n_attr * sizeof(float));
+  }
 
-    //for (unsigned i = 0; i < eps_.size() && i < L; i++)
-    //{
-    //  init_ids[i] = eps_[i];
-    //}
+  void IndexGraph::LoadFusion(std::istream &in)
+  {
+    uint32_t policy = 0, n_attr = 0;
+    float weight = 1;
+    in.read((char *)&policy, sizeof(policy));
+    in.read((char *)&weight, sizeof(float));
+    in.read((char *)&n_attr, sizeof(n_attr));
+    if (!in || policy > FUSION_MASK || n_attr != (uint32_t)attribute_number_)
+      return;
+    std::vector<float> weights(n_attr);
+    if (!in.read((char *)weights.data(), n_attr * sizeof(float)))
+      return;
+    fusion_policy_ = (FusionPolicy)policy;
+    fusion_weight_ = weight;
+    fusion_weights_.assign(attribute_stride_, 0);
+    std::copy(weights.begin(), weights.end(), fusion_weights_.begin());
+  }
 
-    boost::dynamic_bitset<> flags{nd_, 0};
-    for (unsigned i = 0; i < init_ids.size(); i++)
+  void IndexGraph::LoadEntryPoints(std::istream &in)
+  {
+    entry_points_.clear();
+    unsigned n_entry = 0;
+    in.read((char *)&n_entry, sizeof(unsigned));
+    std::string key(attribute_number_, 0);
+    for (unsigned i = 0; i < n_entry && in; i++)
     {
-      unsigned id = init_ids[i];
-      if (id >= nd_)
-        continue;
-      _mm_prefetch(opt_graph_ + node_size * id, _MM_HINT_T0);
+      unsigned n_ep = 0;
+      in.read(&key[0], attribute_number_ * sizeof(char));
+      in.read((char *)&n_ep, sizeof(unsigned));
+      std::vector<unsigned> &entries = entry_points_[key];
+      entries.resize(n_ep);
+      in.read((char *)entries.data(), n_ep * sizeof(unsigned));
     }
-    L = 0;
-    for (unsigned i = 0; i < init_ids.size(); i++)
+  }
+
+  void IndexGraph::SaveOptimized(const char *filename) const
+  {
+    if (split_layout_ ? cold_graph_ == nullptr : opt_graph_ == nullptr)
+      throw std::runtime_error("[Error] SaveOptimized needs OptimizeGraph or LoadOptimized first");
+    std::ofstream out(filename, std::ios::binary | std::ios::out);
+    if (!out)
+      throw std::runtime_error(std::string("[Error] Failed to save optimized index: ") + filename);
+
+    OptimizedHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kOptimizedMagic, sizeof(header.magic));
+    header.version = _OPTIMIZED_VERSION;
+    header.layout = split_layout_ ? 1 : 0;
+    header.nd = nd_;
+    header.dimension = dimension_;
+    header.width = width;
+    header.attribute_number = attribute_number_;
+    header.attribute_stride = attribute_stride_;
+    header.quantization = quantize_;
+    header.metric = opt_metric_;
+    header.max_norm = max_norm_;
+    header.data_len = data_len;
+    header.attribute_len = attribute_len;
+    header.neighbor_len = neighbor_len;
+    header.node_size = node_size;
+    header.link_size = link_size_;
+    header.cold_size = cold_size_;
+    out.write((char *)&header, sizeof(header));
+
+    const char zeros[_CACHE_LINE] = {0};
+    auto section = [&](int s, const char *data, size_t size)
     {
-      unsigned id = init_ids[i];
-      if (id >= nd_)
-        continue;
-      float *x = (float *)(opt_graph_ + node_size * id);
-      float norm_x = *x;
-      x++;
-      float dist = dist_fast->compare(x, query, norm_x, (unsigned)dimension_);
+      uint64_t pos = out.tellp();
+      uint64_t aligned = (pos + _CACHE_LINE - 1) / _CACHE_LINE * _CACHE_LINE;
+      out.write(zeros, aligned - pos);
+      header.sections[s][0] = aligned;
+      header.sections[s][1] = size;
+      if (data != nullptr)
+        out.write(data, size);
+    };
+    if (split_layout_)
+    {
+      section(0, hot_attributes_, attribute_len * nd_);
+      section(1, hot_links_, link_size_ * nd_);
+      section(2, cold_graph_, cold_size_ * nd_);
+    }
+    else
+    {
+      section(0, opt_graph_, node_size * nd_);
+    }
 
-      float cnt = 0;
-      char *id_attribute = (char *)(opt_graph_ + node_size * id + data_len);
-      for (int k = 0; k < attribute_number_; k++)
-      {
-        if (id_attribute[k] != attribute[k])
-        {
-          cnt++;
-        }
-      }
-      //dist += dist * cnt / (float)attribute_number_;
-      dist += cnt * weight_search;
+    section(3, nullptr, 0);
+    unsigned n_ep = eps_.size();
+    out.write((char *)&n_ep, sizeof(unsigned));
+    out.write((char *)eps_.data(), n_ep * sizeof(unsigned));
+    SaveEntryPoints(out);
+    header.sections[3][1] = (uint64_t)out.tellp() - header.sections[3][0];
 
-      // float d = distance_ -> compare(x, query, (unsigned)dimension_);
-      // std::cout << d << std::endl;
-      dist_cout++;
-      retset[i] = Neighbor(id, dist, true);
-      flags[id] = true;
-      L++;
-    }
-    // std::cout<<L<<std::endl;
+    section(4, nullptr, 0);
+    attribute_dict_.Save(out);
+    header.sections[4][1] = (uint64_t)out.tellp() - header.sections[4][0];
 
-    std::sort(retset.begin(), retset.begin() + L);
-    int k = 0;
-    while (k < (int)L)
-    {
-      int nk = L;
+    section(7, nullptr, 0);
+    SaveFusion(out);
+    header.sections[7][1] = (uint64_t)out.tellp() - header.sections[7][0];
 
-      if (retset[k].flag)
+    // the vectors go last, so a mapped image can leave them on disk until
+    // re-ranking touches them
+    if (quantize_ != OPT_FLOAT)
+    {
+      // SQ8: [min|scale]; PQ: [pq_m|codebook]
+      section(5, nullptr, 0);
+      if (quantize_ == OPT_SQ8)
       {
-        retset[k].flag = false;
-        unsigned n = retset[k].id;
-
-        _mm_prefetch(opt_graph_ + node_size * n + data_len + attribute_len, _MM_HINT_T0);
-        unsigned *neighbors = (unsigned *)(opt_graph_ + node_size * n + data_len + attribute_len);
-        neighbors++;
+        out.write((char *)sq_min_.data(), dimension_ * sizeof(float));
+        out.write((char *)sq_scale_.data(), dimension_ * sizeof(float));
+      }
+      else
+      {
+        uint32_t m = pq_m_;
+        out.write((char *)&m, sizeof(m));
+        out.write((char *)pq_codebook_.data(), pq_codebook_.size() * sizeof(float));
+      }
+      header.sections[5][1] = (uint64_t)out.tellp() - header.sections[5][0];
+      if (rerank_data_ != nullptr)
+        section(6, (const char *)rerank_data_, nd_ * dimension_ * sizeof(float));
+    }
+
+    out.seekp(0);
+    out.write((char *)&header, sizeof(header));
+    if (!out.good())
+      throw std::runtime_error(std::string("[Error] Failed to save optimized index: ") + filename);
+  }
+
+  void IndexGraph::LoadOptimized(const char *filename, bool use_mmap, bool populate)
+  {
+    ReleaseOptimized();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error(std::string("[Error] Failed to load optimized index: ") + filename + " not found!");
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    if (use_mmap)
+    {
+      // re-ranking vectors at the end of a quantized image are left to be paged
+      // in on use, so populating only prefaults what precedes them
+      OptimizedHeader head;
+      size_t hot = size;
+      if (pread(fd, &head, sizeof(head), 0) == (ssize_t)sizeof(head) &&
+          head.sections[6][1] > 0 && head.sections[6][0] < size)
+        hot = head.sections[6][0];
+      int flags = MAP_PRIVATE | (populate && hot == size ? MAP_POPULATE : 0);
+      void *p = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+      if (p == MAP_FAILED)
+      {
+        close(fd);
+        throw std::runtime_error(std::string("[Error] Failed to map optimized index: ") + filename);
+      }
+      opt_map_ = (char *)p;
+      opt_map_mapped_ = true;
+      if (populate && hot < size)
+      {
+        volatile char sink = 0;
+        for (size_t off = 0; off < hot; off += 4096)
+          sink = opt_map_[off];
+        (void)sink;
+      }
+    }
+    else
+    {
+      opt_map_ = (char *)memalign(_CACHE_LINE, size);
+      opt_map_mapped_ = false;
+      size_t done = 0;
+      while (done < size)
+      {
+        ssize_t r = read(fd, opt_map_ + done, size - done);
+        if (r <= 0)
+          break;
+        done += r;
+      }
+      if (done != size)
+      {
+        close(fd);
+        ReleaseOptimized();
+        throw std::runtime_error(std::string("[Error] Failed to read optimized index: ") + filename);
+      }
+    }
+    close(fd);
+    opt_map_size_ = size;
+
+    const OptimizedHeader *header = (const OptimizedHeader *)opt_map_;
+    bool valid = size >= sizeof(OptimizedHeader) &&
+                 std::memcmp(header->magic, kOptimizedMagic, sizeof(header->magic)) == 0 &&
+                 header->version == _OPTIMIZED_VERSION;
+    for (int s = 0; valid && s < 8; s++)
+      valid = header->sections[s][0] + header->sections[s][1] <= size;
+    if (valid && header->quantization == OPT_SQ8)
+      valid = header->sections[5][1] == 2 * header->dimension * sizeof(float);
+    if (valid && header->quantization == OPT_PQ)
+      valid = header->sections[5][1] == sizeof(uint32_t) + 256 * header->dimension * sizeof(float);
+    if (valid)
+      valid = header->quantization <= OPT_PQ &&
+              (header->metric == L2 || header->metric == INNER_PRODUCT || header->metric == COSINE);
+    if (!valid)
+    {
+      ReleaseOptimized();
+      throw std::runtime_error(std::string("[Error] Unsupported or corrupted optimized index: ") + filename);
+    }
+    if (header->dimension != dimension_)
+    {
+      ReleaseOptimized();
+      throw std::runtime_error(std::string("[Error] Dimension mismatch in optimized index: ") + filename);
+    }
+
+    nd_ = header->nd;
+    width = header->width;
+    attribute_number_ = header->attribute_number;
+    attribute_stride_ = header->attribute_stride;
+    data_len = header->data_len;
+    attribute_len = header->attribute_len;
+    neighbor_len = header->neighbor_len;
+    node_size = header->node_size;
+    link_size_ = header->link_size;
+    cold_size_ = header->cold_size;
+    split_layout_ = header->layout == 1;
+    if (split_layout_)
+    {
+      hot_attributes_ = opt_map_ + header->sections[0][0];
+      hot_links_ = opt_map_ + header->sections[1][0];
+      cold_graph_ = opt_map_ + header->sections[2][0];
+    }
+    else
+    {
+      opt_graph_ = opt_map_ + header->sections[0][0];
+    }
+
+    std::istringstream entries(std::string(opt_map_ + header->sections[3][0], header->sections[3][1]));
+    unsigned n_ep = 0;
+    entries.read((char *)&n_ep, sizeof(unsigned));
+    eps_.resize(n_ep);
+    entries.read((char *)eps_.data(), n_ep * sizeof(unsigned));
+    LoadEntryPoints(entries);
+    attribute_dict_.Attach(opt_map_ + header->sections[4][0], header->sections[4][1]);
+    std::istringstream fusion(std::string(opt_map_ + header->sections[7][0], header->sections[7][1]));
+    fusion_policy_ = FUSION_MULTIPLICATIVE;
+    fusion_weight_ = 1;
+    fusion_weights_.clear();
+    LoadFusion(fusion);
+    UpdateFusion();
+    quantize_ = (OptQuantization)header->quantization;
+    opt_metric_ = (Metric)header->metric;
+    max_norm_ = header->max_norm;
+    if (quantize_ == OPT_SQ8)
+    {
+      const float *q = (const float *)(opt_map_ + header->sections[5][0]);
+      sq_min_.assign(q, q + dimension_);
+      sq_scale_.assign(q + dimension_, q + 2 * dimension_);
+    }
+    else if (quantize_ == OPT_PQ)
+    {
+      const char *q = opt_map_ + header->sections[5][0];
+      pq_m_ = *(const uint32_t *)q;
+      const float *codebook = (const float *)(q + sizeof(uint32_t));
+      pq_codebook_.assign(codebook, codebook + 256 * dimension_);
+    }
+    if (quantize_ != OPT_FLOAT)
+    {
+      if (header->sections[6][1] == nd_ * dimension_ * sizeof(float))
+        rerank_data_ = (const float *)(opt_map_ + header->sections[6][0]);
+    }
+
+    CompactGraph().swap(final_graph_);
+    ReleaseAttributes();
+    data_ = nullptr;
+    search_pool_.clear();
+    OptKernels kernels = SelectKernels((unsigned)dimension_, attribute_stride_);
+    search_kernel_ = kernels.search;
+    interleave_kernel_ = kernels.interleave;
+    group_kernel_ = SelectGroupKernel();
+    has_built = true;
+    std::cout << "optimized index: " << nd_ << " nodes, " << (split_layout_ ? "split" : "packed")
+              << " layout" << (quantize_ == OPT_SQ8 ? ", sq8 codes" : quantize_ == OPT_PQ ? ", pq codes" : "")
+              << (opt_metric_ == INNER_PRODUCT ? ", inner product" : opt_metric_ == COSINE ? ", cosine" : "")
+              << ", " << entry_points_.size()
+              << " entry groups" << std::endl;
+    attribute_dict_.PrintSummary();
+  }
+
+  void IndexGraph::ReleaseOptimized()
+  {
+    if (opt_map_ != nullptr)
+    {
+      // every layout pointer and the dictionary point into the file image
+      attribute_dict_.Clear();
+      if (opt_map_mapped_)
+        munmap(opt_map_, opt_map_size_);
+      else
+        free(opt_map_);
+      opt_map_ = nullptr;
+      opt_map_size_ = 0;
+    }
+    else
+    {
+      free(opt_graph_);
+      free(hot_attributes_);
+      free(hot_links_);
+      free(cold_graph_);
+    }
+    opt_graph_ = nullptr;
+    hot_attributes_ = nullptr;
+    hot_links_ = nullptr;
+    cold_graph_ = nullptr;
+    quantize_ = OPT_FLOAT;
+    std::vector<float>().swap(sq_min_);
+    std::vector<float>().swap(sq_scale_);
+    pq_m_ = 0;
+    std::vector<float>().swap(pq_codebook_);
+    rerank_data_ = nullptr;
+  }
+
+  void IndexGraph::PrepareSearchPool(size_t n_threads)
+  {
+    // the visited marks are sized for the graph the pool was made for; their
+    // distance counts are kept when it has changed size since
+    if (!search_pool_.empty() && search_pool_[0]->visited.Size() != nd_)
+    {
+      for (const auto &ctx : search_pool_)
+        dist_cout += ctx->dist_count;
+      search_pool_.clear();
+    }
+    while (search_pool_.size() < n_threads)
+      search_pool_.push_back(std::make_shared<SearchContext>(nd_));
+  }
+
+  void IndexGraph::PrepareBuildPool(size_t n_nodes)
+  {
+    if (!build_pool_.empty() && build_pool_[0]->visited.Size() != n_nodes)
+      build_pool_.clear();
+    while (build_pool_.size() < (size_t)omp_get_max_threads())
+      build_pool_.push_back(std::make_shared<BuildContext>(n_nodes, (unsigned)rand()));
+  }
+
+  HybridQueryPlan IndexGraph::MakeQueryPlan(const std::vector<std::string> &attributes,
+                                             size_t K, const Parameters &parameters) const
+  {
+    HybridQueryPlan plan;
+    plan.L = parameters.Get<unsigned>("L_search");
+    float weight_search = parameters.Get<float>("weight_search", NAN);
+    std::string fusion = parameters.Get<std::string>("search_fusion", "");
+    if (!fusion.empty())
+      plan.fusion = MakeFusion(ParseFusionPolicy(fusion), std::isnan(weight_search) ? fusion_weight_ : weight_search);
+    else if (!std::isnan(weight_search))
+      plan.fusion = MakeFusion(FUSION_ADDITIVE, weight_search);
+    else
+      plan.fusion = MakeFusion(fusion_policy_, fusion_weight_);
+    plan.K = K;
+    plan.stop.patience = parameters.Get<unsigned>("search_patience", 0);
+    plan.stop.slack = parameters.Get<float>("search_slack", -1);
+    plan.strict = parameters.Get<unsigned>("search_strict", 0) != 0;
+    plan.strict_budget = parameters.Get<size_t>("strict_budget", 0);
+    plan.rerank = parameters.Get<unsigned>("rerank_depth", 0);
+    plan.group = std::min(parameters.Get<unsigned>("search_group", 0), kMaxSearchGroup);
+    plan.interleave = std::min(parameters.Get<unsigned>("search_interleave", 0), kMaxSearchInterleave);
+    plan.kernel = search_kernel_;
+    SetPlanAttributes(plan, attributes);
+    return plan;
+  }
+
+  bool IndexGraph::SetPlanAttributes(HybridQueryPlan &plan,
+                                     const std::vector<std::string> &attributes) const
+  {
+    plan.attribute = Attribute2int(attributes);
+    if (plan.attribute.size() != (size_t)attribute_number_)
+    {
+      plan.attribute.clear();
+      return false;
+    }
+    plan.attribute.resize(attribute_stride_, 0);
+    return true;
+  }
+
+  void IndexGraph::SearchWithOptGraph(const HybridQueryPlan &plan, const float *query,
+                                      unsigned *indices, float *distances)
+  {
+    if (plan.attribute.empty())
+    {
+      std::cout << "wrong attributes";
+      return;
+    }
+    PrepareSearchPool(1);
+    SearchContext &ctx = *search_pool_[0];
+    ctx.rng.seed(rand());
+    RunQueryPlan(ctx, plan, query, indices, distances);
+  }
+
+  void IndexGraph::RunQueryPlan(SearchContext &ctx, const HybridQueryPlan &plan,
+                                const float *query, unsigned *indices, float *distances)
+  {
+    ctx.stop = plan.stop;
+    if (plan.strict)
+    {
+      StrictSearch_(ctx, plan.attribute.data(), query, plan.K, plan.L, plan.fusion,
+                    plan.strict_budget, indices, distances);
+      return;
+    }
+    (this->*plan.kernel)(ctx, plan.attribute.data(), query, plan.K, plan.L,
+                         plan.fusion, indices);
+    if (quantize_ != OPT_FLOAT && rerank_data_ != nullptr)
+    {
+      size_t depth = plan.rerank == 0 ? plan.L : std::min(plan.rerank, plan.L);
+      depth = std::min(std::max(depth, plan.K), std::min((size_t)plan.L, nd_));
+      RerankPool(ctx, plan.attribute.data(), query, (unsigned)depth, plan.fusion);
+      for (size_t i = 0; i < plan.K; i++)
+        indices[i] = ctx.retset[i].id;
+    }
+    if (distances != nullptr)
+    {
+      // the pool holds the distance less the query's offset, plus the penalty
+      for (size_t i = 0; i < plan.K; i++)
+        distances[i] = ctx.retset[i].distance + ctx.query_offset;
+    }
+  }
+
+  void IndexGraph::RunQueryGroup(SearchContext &ctx, const HybridQueryPlan &plan,
+                                 const float *const *queries, unsigned n,
+                                 unsigned *const *indices)
+  {
+    (this->*group_kernel_)(ctx, plan.attribute.data(), queries, n, plan.L, plan.fusion);
+    for (unsigned j = 0; j < n; j++)
+    {
+      SearchContext &member = *ctx.group[j];
+      if (quantize_ != OPT_FLOAT && rerank_data_ != nullptr)
+      {
+        size_t depth = plan.rerank == 0 ? plan.L : std::min(plan.rerank, plan.L);
+        depth = std::min(std::max(depth, plan.K), std::min((size_t)plan.L, nd_));
+        RerankPool(member, plan.attribute.data(), queries[j], (unsigned)depth, plan.fusion);
+      }
+      for (size_t i = 0; i < plan.K; i++)
+        indices[j][i] = member.retset[i].id;
+    }
+  }
+
+  // Pool distance of a vector x given ip = <q, x> and its row norm slot:
+  // |x|^2 - 2<q, x> for L2 (norm = |x|^2), -<q, x> for the inner product and
+  // -<q, x> / (|q| |x|) for cosine (norm = 1 / |x|, scale = 1 / |q|).
+  template <unsigned METRIC>
+  static inline float MetricDistance(float ip, float norm, float scale)
+  {
+    if (METRIC == INNER_PRODUCT)
+      return -ip;
+    if (METRIC == COSINE)
+      return -ip * norm * scale;
+    return norm - 2 * ip;
+  }
+
+  static inline float MetricDistance(Metric metric, float ip, float norm, float scale)
+  {
+    if (metric == INNER_PRODUCT)
+      return MetricDistance<INNER_PRODUCT>(ip, norm, scale);
+    if (metric == COSINE)
+      return MetricDistance<COSINE>(ip, norm, scale);
+    return MetricDistance<L2>(ip, norm, scale);
+  }
+
+  void IndexGraph::PrepareQuery(SearchContext &ctx, const float *query) const
+  {
+    float query_norm = 0;
+    for (size_t i = 0; i < dimension_; i++)
+      query_norm += query[i] * query[i];
+    // -<q, x> >= -|q| |x| and -cos >= -1, next to |x|^2 - 2<q, x> >= -|q|^2
+    if (opt_metric_ == INNER_PRODUCT)
+    {
+      ctx.query_offset = 0;
+      ctx.query_floor = -std::sqrt(query_norm) * max_norm_;
+    }
+    else if (opt_metric_ == COSINE)
+    {
+      ctx.query_offset = 1;
+      ctx.query_floor = -1;
+      ctx.query_scale = query_norm > 0 ? 1 / std::sqrt(query_norm) : 0;
+    }
+    else
+    {
+      ctx.query_offset = query_norm;
+      ctx.query_floor = -query_norm;
+    }
+    if (quantize_ == OPT_FLOAT)
+      return;
+
+    std::vector<float> &table = ctx.query_table;
+    if (quantize_ == OPT_PQ)
+    {
+      // |c|^2 - 2<q_j, c>, or -<q_j, c>, for every centroid c of every subspace j
+      bool ip = opt_metric_ == INNER_PRODUCT;
+      size_t sub = dimension_ / pq_m_;
+      table.resize(256 * pq_m_);
+      for (size_t j = 0; j < pq_m_; j++)
+      {
+        const float *q = query + j * sub;
+        for (size_t c = 0; c < 256; c++)
+        {
+          const float *centroid = pq_codebook_.data() + (j * 256 + c) * sub;
+          float dist = 0;
+          if (ip)
+          {
+            for (size_t d = 0; d < sub; d++)
+              dist -= centroid[d] * q[d];
+          }
+          else
+          {
+            for (size_t d = 0; d < sub; d++)
+              dist += centroid[d] * (centroid[d] - 2 * q[d]);
+          }
+          table[j * 256 + c] = dist;
+        }
+      }
+      return;
+    }
+    // <q, min + scale * code> = <q, min> + <q * scale, code>
+    table.resize(dimension_);
+    float bias = 0;
+    for (size_t i = 0; i < dimension_; i++)
+    {
+      table[i] = query[i] * sq_scale_[i];
+      bias += query[i] * sq_min_[i];
+    }
+    ctx.query_bias = bias;
+  }
+
+  float IndexGraph::OptDistanceTo(const SearchContext &ctx, const float *query, unsigned id) const
+  {
+    const float *x = OptVector(id);
+    if (quantize_ == OPT_PQ)
+      return opt_distance_.compare_pq(ctx.query_table.data(), (const uint8_t *)x, pq_m_);
+    float ip;
+    if (quantize_ == OPT_SQ8)
+      ip = ctx.query_bias + distance_kernels->sq8_dot(ctx.query_table.data(), (const uint8_t *)(x + 1),
+                                                      (unsigned)dimension_);
+    else
+      ip = opt_distance_.DistanceInnerProduct::compare(query, x + 1, (unsigned)dimension_);
+    return MetricDistance(opt_metric_, ip, *x, ctx.query_scale);
+  }
+
+  float IndexGraph::ExactDistance(const SearchContext &ctx, const float *query, unsigned id) const
+  {
+    const float *x = rerank_data_ + (size_t)id * dimension_;
+    float ip = opt_distance_.DistanceInnerProduct::compare(query, x, (unsigned)dimension_);
+    float norm = 0;
+    if (opt_metric_ != INNER_PRODUCT)
+      norm = opt_distance_.norm(x, (unsigned)dimension_);
+    if (opt_metric_ == COSINE)
+      norm = norm > 0 ? 1 / std::sqrt(norm) : 0;
+    return MetricDistance(opt_metric_, ip, norm, ctx.query_scale);
+  }
+
+  void IndexGraph::RerankPool(SearchContext &ctx, const char *attribute, const float *query,
+                              unsigned n, const AttributeFusion &fusion) const
+  {
+    std::vector<Neighbor> &retset = ctx.retset;
+    for (unsigned i = 0; i < n; i++)
+      _mm_prefetch((const char *)(rerank_data_ + (size_t)retset[i].id * dimension_), _MM_HINT_T0);
+    for (unsigned i = 0; i < n; i++)
+    {
+      unsigned id = retset[i].id;
+      retset[i].distance = fusion.Apply(ExactDistance(ctx, query, id),
+                                        fusion.Mismatch(OptAttributes(id), attribute, attribute_stride_),
+                                        ctx.query_offset);
+    }
+    std::sort(retset.begin(), retset.begin() + n);
+  }
+
+  void IndexGraph::SearchWithOptGraph(std::vector<char> attribute,
+                                      const float *query, size_t K,
+                                      const Parameters &parameters,
+                                      unsigned *indices)
+  {
+    HybridQueryPlan plan = MakeQueryPlan(std::vector<std::string>(), K, parameters);
+    attribute.resize(attribute_stride_, 0);
+    plan.attribute.swap(attribute);
+    SearchWithOptGraph(plan, query, indices);
+  }
+
+  void IndexGraph::SearchWithOptGraph(std::vector<std::string> attributes,
+                                      const float *query, size_t K,
+                                      const Parameters &parameters,
+                                      unsigned *indices)
+  {
+    SearchWithOptGraph(MakeQueryPlan(attributes, K, parameters), query, indices);
+  }
+
+  void IndexGraph::BatchSearchWithOptGraph(const float *queries,
+                                           const std::vector<std::vector<std::string>> &attributes,
+                                           size_t K,
+                                           const Parameters &parameters,
+                                           std::vector<std::vector<unsigned>> &results,
+                                           int n_threads)
+  {
+    HybridQueryPlan base = MakeQueryPlan(std::vector<std::string>(), K, parameters);
+    std::vector<HybridQueryPlan> plans(attributes.size(), base);
+    for (size_t i = 0; i < attributes.size(); i++)
+      SetPlanAttributes(plans[i], attributes[i]);
+    BatchSearchWithOptGraph(queries, plans, results, n_threads);
+  }
+
+  void IndexGraph::BatchSearchWithOptGraph(const float *queries,
+                                           const std::vector<HybridQueryPlan> &plans,
+                                           std::vector<std::vector<unsigned>> &results,
+                                           int n_threads,
+                                           std::vector<SearchStats> *stats)
+  {
+    if (n_threads <= 0)
+      n_threads = omp_get_max_threads();
+    PrepareSearchPool(n_threads);
+
+    size_t n_queries = plans.size();
+    results.resize(n_queries);
+    if (stats != nullptr)
+      stats->assign(n_queries, SearchStats());
+
+    // Queries that may walk together are ordered next to each other (same
+    // attributes and plan) and cut into runs of at most plan.group. Queries
+    // to interleave form runs of a few lanes' worth, so that the threads
+    // still balance; every other query forms a run of its own.
+    auto groupable = [&](const HybridQueryPlan &plan)
+    {
+      return plan.group > 1 && !plan.strict && !plan.stop.Enabled() && !plan.attribute.empty() &&
+             plan.kernel == search_kernel_ && group_kernel_ != nullptr;
+    };
+    auto interleavable = [&](const HybridQueryPlan &plan)
+    {
+      return plan.interleave > 1 && !plan.strict && !plan.attribute.empty() &&
+             plan.kernel == search_kernel_ && interleave_kernel_ != nullptr && !groupable(plan);
+    };
+    auto same_group = [&](const HybridQueryPlan &a, const HybridQueryPlan &b)
+    {
+      return a.attribute == b.attribute && a.L == b.L && a.K == b.K &&
+             a.fusion.policy == b.fusion.policy && a.fusion.weight == b.fusion.weight &&
+             a.rerank == b.rerank && a.group == b.group;
+    };
+    std::vector<size_t> order(n_queries);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                     {
+                       const HybridQueryPlan &x = plans[a], &y = plans[b];
+                       bool gx = groupable(x), gy = groupable(y);
+                       if (gx != gy || !gx)
+                         return gx > gy;
+                       if (x.attribute != y.attribute)
+                         return x.attribute < y.attribute;
+                       return std::make_tuple(x.L, x.K, (unsigned)x.fusion.policy, x.fusion.weight, x.rerank, x.group) <
+                              std::make_tuple(y.L, y.K, (unsigned)y.fusion.policy, y.fusion.weight, y.rerank, y.group);
+                     });
+    std::vector<size_t> runs;
+    for (size_t i = 0; i < n_queries;)
+    {
+      runs.push_back(i);
+      const HybridQueryPlan &plan = plans[order[i]];
+      size_t end = i + 1;
+      if (groupable(plan))
+      {
+        while (end < n_queries && end - i < std::min(plan.group, kMaxSearchGroup) &&
+               groupable(plans[order[end]]) &&
+               same_group(plan, plans[order[end]]))
+          end++;
+      }
+      else if (interleavable(plan))
+      {
+        while (end < n_queries && end - i < 4 * (size_t)plan.interleave &&
+               interleavable(plans[order[end]]) &&
+               plans[order[end]].interleave == plan.interleave)
+          end++;
+      }
+      i = end;
+    }
+    size_t n_runs = runs.size();
+    runs.push_back(n_queries);
+
+    // per-query seeds keep the result independent of the thread schedule
+    unsigned seed = rand();
+#pragma omp parallel num_threads(n_threads)
+    {
+      SearchContext &ctx = *search_pool_[omp_get_thread_num()];
+      const float *group_queries[kMaxSearchGroup];
+      unsigned *group_indices[kMaxSearchGroup];
+      std::vector<const HybridQueryPlan *> run_plans;
+      std::vector<const float *> run_queries;
+      std::vector<unsigned> run_seeds;
+      std::vector<unsigned *> run_indices;
+      std::vector<SearchStats *> run_stats;
+#pragma omp for schedule(dynamic, 4)
+      for (size_t r = 0; r < n_runs; r++)
+      {
+        size_t first = order[runs[r]];
+        unsigned n = (unsigned)(runs[r + 1] - runs[r]);
+        const HybridQueryPlan &plan = plans[first];
+        ctx.rng.seed(seed + (unsigned)first);
+        if (interleavable(plan))
+        {
+          run_plans.resize(n);
+          run_queries.resize(n);
+          run_seeds.resize(n);
+          run_indices.resize(n);
+          run_stats.resize(n);
+          for (unsigned j = 0; j < n; j++)
+          {
+            size_t i = order[runs[r] + j];
+            results[i].resize(plans[i].K);
+            run_plans[j] = &plans[i];
+            run_queries[j] = queries + i * dimension_;
+            run_seeds[j] = seed + (unsigned)i;
+            run_indices[j] = results[i].data();
+            run_stats[j] = stats != nullptr ? &(*stats)[i] : nullptr;
+          }
+          (this->*interleave_kernel_)(ctx, run_plans.data(), run_queries.data(), run_seeds.data(), n,
+                                      plan.interleave, run_indices.data(), run_stats.data());
+          continue;
+        }
+        if (n > 1)
+        {
+          for (unsigned j = 0; j < n; j++)
+          {
+            size_t i = order[runs[r] + j];
+            results[i].resize(plan.K);
+            group_queries[j] = queries + i * dimension_;
+            group_indices[j] = results[i].data();
+          }
+          RunQueryGroup(ctx, plan, group_queries, n, group_indices);
+          if (stats != nullptr)
+          {
+            for (unsigned j = 0; j < n; j++)
+              (*stats)[order[runs[r] + j]] = ctx.group[j]->stats;
+          }
+          continue;
+        }
+        results[first].resize(plan.K);
+        if (plan.attribute.empty())
+        {
+          std::cout << "wrong attributes";
+          continue;
+        }
+        RunQueryPlan(ctx, plan, queries + first * dimension_, results[first].data(), nullptr);
+        if (stats != nullptr)
+          (*stats)[first] = ctx.stats;
+      }
+    }
+  }
+
+  void IndexGraph::RangeSearchWithOptGraph(const float *query,
+                                           const std::vector<std::string> &attributes,
+                                           float radius, const Parameters &parameters,
+                                           std::vector<std::pair<unsigned, float>> &results)
+  {
+    RangeSearchWithOptGraph(MakeQueryPlan(attributes, 0, parameters), query, radius, results);
+  }
+
+  void IndexGraph::RangeSearchWithOptGraph(const HybridQueryPlan &plan, const float *query,
+                                           float radius,
+                                           std::vector<std::pair<unsigned, float>> &results)
+  {
+    results.clear();
+    if (plan.attribute.empty())
+    {
+      std::cout << "wrong attributes";
+      return;
+    }
+    PrepareSearchPool(1);
+    SearchContext &ctx = *search_pool_[0];
+    ctx.rng.seed(rand());
+    RangeSearch_(ctx, plan.attribute.data(), query, radius, plan.L, plan.fusion, results);
+  }
+
+  void IndexGraph::RangeSearch_(SearchContext &ctx, const char *attribute, const float *query,
+                                float radius, unsigned L, const AttributeFusion &fusion,
+                                std::vector<std::pair<unsigned, float>> &results)
+  {
+    ctx.Prepare(L);
+    unsigned *init_ids = ctx.init_ids.data();
+    VisitedList &flags = ctx.visited;
+    SearchStats &stats = ctx.stats;
+    stats = SearchStats();
+    size_t dist_start = ctx.dist_count;
+
+    // the optimized graph leaves out the query's offset (|q|^2 for L2);
+    // adding it back makes the radius a plain metric distance plus the
+    // attribute penalty
+    PrepareQuery(ctx, query);
+    const float query_offset = ctx.query_offset;
+
+    unsigned n_init = InitEntryPoints(ctx, attribute, L);
+    // the pool grows with the nodes found inside the radius, so it is the
+    // query's own rather than the context's, which would keep it at its
+    // largest size for good
+    std::vector<Neighbor> retset(2 * n_init + 2);
+    unsigned inside = 0;
+    for (unsigned i = 0; i < n_init; i++)
+    {
+      unsigned id = init_ids[i];
+      float dist = fusion.Apply(OptDistanceTo(ctx, query, id) + query_offset,
+                                fusion.Mismatch(OptAttributes(id), attribute, attribute_stride_));
+      ctx.dist_count++;
+      inside += dist <= radius;
+      retset[i] = Neighbor(id, dist, true);
+    }
+    // seeds inside the radius take slots of their own, which start empty,
+    // so n_init slots are left for the candidates beyond it
+    L = n_init + inside;
+    for (unsigned i = n_init; i < L; i++)
+      retset[i] = Neighbor((unsigned)nd_, std::numeric_limits<float>::max(), false);
+    std::sort(retset.begin(), retset.begin() + L);
+
+    // Best-first search whose pool grows by one slot for every node found
+    // inside the radius, so such nodes are never evicted and the pool always
+    // keeps L_search candidates beyond the radius to route through. It ends
+    // once every pool entry is expanded.
+    int k = 0;
+    while (k < (int)L)
+    {
+      int nk = L;
+
+      if (retset[k].flag)
+      {
+        retset[k].flag = false;
+        stats.expansions++;
+        unsigned *neighbors = OptLinks(retset[k].id);
         unsigned MaxM = *neighbors;
-        neighbors++;
+        neighbors += 2;
         for (unsigned m = 0; m < MaxM; ++m)
-          _mm_prefetch(opt_graph_ + node_size * neighbors[m], _MM_HINT_T0);
+          _mm_prefetch((char *)OptVector(neighbors[m]), _MM_HINT_T0);
         for (unsigned m = 0; m < MaxM; ++m)
         {
           unsigned id = neighbors[m];
-          if (flags[id])
+          if (flags.TestAndVisit(id))
             continue;
-          flags[id] = 1;
-          float *data = (float *)(opt_graph_ + node_size * id);
-          float norm = *data;
-          data++;
-          float dist =
-              dist_fast->compare(query, data, norm, (unsigned)dimension_);
+          float dist = fusion.Apply(OptDistanceTo(ctx, query, id) + query_offset,
+                                    fusion.Mismatch(OptAttributes(id), attribute, attribute_stride_));
+          ctx.dist_count++;
+          bool inside = dist <= radius;
+          if (!inside && dist >= retset[L - 1].distance)
+            continue;
+          if (retset.size() < L + 2)
+            retset.resize(2 * L + 2);
+          int r = InsertIntoPool(retset.data(), L, Neighbor(id, dist, true));
+          if (inside && r <= (int)L)
+            L++;
+          if (r < nk)
+            nk = r;
+        }
+      }
+      if (nk <= k)
+        k = nk;
+      else
+        ++k;
+    }
 
-          float cnt = 0;
-          char *id_attribute = (char *)(opt_graph_ + node_size * id + data_len);
-          for (int k = 0; k < attribute_number_; k++)
+    // codes only decide what is traversed; with the full vectors at hand,
+    // members are confirmed on their exact distance
+    bool rerank = quantize_ != OPT_FLOAT && rerank_data_ != nullptr;
+    results.clear();
+    for (unsigned i = 0; i < L && retset[i].distance <= radius; i++)
+    {
+      unsigned id = retset[i].id;
+      if (id >= nd_)
+        continue;
+      float dist = retset[i].distance;
+      if (rerank)
+        dist = fusion.Apply(ExactDistance(ctx, query, id) + query_offset,
+                            fusion.Mismatch(OptAttributes(id), attribute, attribute_stride_));
+      if (dist <= radius)
+        results.push_back(std::make_pair(id, dist));
+    }
+    if (rerank)
+    {
+      std::sort(results.begin(), results.end(),
+                [](const std::pair<unsigned, float> &a, const std::pair<unsigned, float> &b)
+                { return a.second < b.second; });
+    }
+    stats.dist_count = ctx.dist_count - dist_start;
+  }
+
+  void IndexGraph::StrictSearch_(SearchContext &ctx, const char *attribute, const float *query,
+                                 size_t K, unsigned L, const AttributeFusion &fusion, size_t budget,
+                                 unsigned *indices, float *distances)
+  {
+    ctx.Prepare(L);
+    std::vector<Neighbor> &retset = ctx.retset;
+    unsigned *init_ids = ctx.init_ids.data();
+    VisitedList &flags = ctx.visited;
+    SearchStats &stats = ctx.stats;
+    stats = SearchStats();
+    size_t dist_start = ctx.dist_count;
+    if (budget == 0)
+      budget = nd_;
+    unsigned depth = L;
+
+    PrepareQuery(ctx, query);
+    const float query_offset = ctx.query_offset;
+    // metric distance to node id; cnt receives its attribute mismatches
+    auto evaluate = [&](unsigned id, float &cnt)
+    {
+      cnt = fusion.Mismatch(OptAttributes(id), attribute, attribute_stride_);
+      ctx.dist_count++;
+      return OptDistanceTo(ctx, query, id) + query_offset;
+    };
+    // every exact match seen, and the unexpanded nodes that fell out of the
+    // pool, which are where the traversal resumes after the penalty is raised
+    std::vector<Neighbor> matches, spill;
+    AttributeFusion penalty = fusion;
+    // only matches are returned anyway; the traversal needs a finite penalty
+    if (penalty.policy == FUSION_MASK)
+      penalty.policy = FUSION_ADDITIVE;
+
+    unsigned n_init = InitEntryPoints(ctx, attribute, L);
+    L = 0;
+    for (unsigned i = 0; i < n_init; i++)
+    {
+      float cnt;
+      float dist = evaluate(init_ids[i], cnt);
+      if (cnt == 0)
+        matches.push_back(Neighbor(init_ids[i], dist, false));
+      retset[L++] = Neighbor(init_ids[i], penalty.Apply(dist, cnt), true);
+    }
+    std::sort(retset.begin(), retset.begin() + L);
+
+    bool exhausted = false;
+    while (true)
+    {
+      int k = 0;
+      while (k < (int)L && !exhausted)
+      {
+        int nk = L;
+
+        if (retset[k].flag)
+        {
+          retset[k].flag = false;
+          stats.expansions++;
+          unsigned *neighbors = OptLinks(retset[k].id);
+          unsigned MaxM = *neighbors;
+          neighbors += 2;
+          for (unsigned m = 0; m < MaxM; ++m)
+            _mm_prefetch((char *)OptVector(neighbors[m]), _MM_HINT_T0);
+          for (unsigned m = 0; m < MaxM; ++m)
           {
-            if (id_attribute[k] != attribute[k])
+            unsigned id = neighbors[m];
+            if (flags.TestAndVisit(id))
+              continue;
+            float cnt;
+            float dist = evaluate(id, cnt);
+            if (cnt == 0)
+              matches.push_back(Neighbor(id, dist, false));
+            dist = penalty.Apply(dist, cnt);
+            if (dist >= retset[L - 1].distance)
+            {
+              spill.push_back(Neighbor(id, dist, true));
+            }
+            else
             {
-              cnt++;
+              int r = InsertIntoPool(retset.data(), L, Neighbor(id, dist, true));
+              if (r < (int)L && retset[L].flag)
+                spill.push_back(retset[L]);
+              if (r < nk)
+                nk = r;
+            }
+            if (ctx.dist_count - dist_start >= budget)
+            {
+              exhausted = true;
+              break;
             }
           }
-          //dist += dist * cnt / (float)attribute_number_;
-          dist += cnt * weight_search;
-
-          dist_cout++;
-          if (dist >= retset[L - 1].distance)
-            continue;
-          Neighbor nn(id, dist, true);
-          int r = InsertIntoPool(retset.data(), L, nn);
+        }
+        if (nk <= k)
+          k = nk;
+        else
+          ++k;
+      }
+      if (matches.size() >= K || exhausted || spill.empty())
+        break;
 
-          // if(L+1 < retset.size()) ++L;
-          if (r < nk)
-            nk = r;
+      // too few matches: double the fusion weight, so non-matching nodes
+      // sink, and resume from a twice as large pool seeded with the nodes
+      // that fell out of it. An additive penalty is raised in place; the
+      // multiplicative one scales the distance, which is computed again
+      AttributeFusion raised = penalty;
+      raised.weight = std::max(2 * penalty.weight, 1.0f);
+      auto raise = [&](Neighbor &nb)
+      {
+        float cnt = fusion.Mismatch(OptAttributes(nb.id), attribute, attribute_stride_);
+        if (cnt == 0)
+          return;
+        if (penalty.policy == FUSION_MULTIPLICATIVE)
+        {
+          ctx.dist_count++;
+          nb.distance = raised.Apply(OptDistanceTo(ctx, query, nb.id) + query_offset, cnt);
         }
+        else
+          nb.distance += cnt * (raised.weight - penalty.weight);
+      };
+      for (unsigned i = 0; i < L; i++)
+        raise(retset[i]);
+      for (size_t i = 0; i < spill.size(); i++)
+        raise(spill[i]);
+      penalty = raised;
+      spill.insert(spill.end(), retset.begin(), retset.begin() + L);
+      std::sort(spill.begin(), spill.end());
+      L = (unsigned)std::min(std::min((size_t)2 * L, (size_t)nd_), spill.size());
+      if (retset.size() < L + 1)
+        retset.resize(L + 1);
+      std::copy(spill.begin(), spill.begin() + L, retset.begin());
+      size_t n_spill = 0;
+      for (size_t i = L; i < spill.size(); i++)
+      {
+        if (spill[i].flag)
+          spill[n_spill++] = spill[i];
+      }
+      spill.resize(n_spill);
+    }
+
+    if (quantize_ != OPT_FLOAT && rerank_data_ != nullptr)
+    {
+      // re-score the best matches by the codes with the full vectors
+      size_t n_rerank = std::min(std::max(K, (size_t)depth), matches.size());
+      std::partial_sort(matches.begin(), matches.begin() + n_rerank, matches.end());
+      matches.resize(n_rerank);
+      for (size_t i = 0; i < n_rerank; i++)
+        matches[i].distance = ExactDistance(ctx, query, matches[i].id) + query_offset;
+    }
+    size_t n = std::min(K, matches.size());
+    std::partial_sort(matches.begin(), matches.begin() + n, matches.end());
+    for (size_t i = 0; i < K; i++)
+    {
+      indices[i] = i < n ? matches[i].id : std::numeric_limits<unsigned>::max();
+      if (distances != nullptr)
+        distances[i] = i < n ? matches[i].distance : std::numeric_limits<float>::max();
+    }
+    stats.dist_count = ctx.dist_count - dist_start;
+  }
+
+  // Distance and attribute-mismatch terms of the search kernel. The fixed
+  // size specialisations let the compiler unroll both inner loops; 0 selects
+  // the runtime length.
+  template <unsigned DIM>
+  static inline float OptDistance(const DistanceFastL2 *dist_fast, const float *query,
+                                  const float *data, float norm, unsigned dim)
+  {
+    return dist_fast->compare_fixed<DIM>(query, data, norm);
+  }
+
+  template <>
+  inline float OptDistance<0>(const DistanceFastL2 *dist_fast, const float *query,
+                              const float *data, float norm, unsigned dim)
+  {
+    return dist_fast->compare(query, data, norm, dim);
+  }
+
+  // Pool distance to a vector row: [norm|vector], [norm|SQ8 codes] or [PQ
+  // codes], where query is the prepared table for the quantized rows.
+  template <unsigned DIM, unsigned QUANT, unsigned METRIC>
+  static inline float RowDistance(const DistanceFastL2 *dist_fast, const float *query,
+                                  const float *row, unsigned dim, unsigned pq_m, float bias,
+                                  float scale)
+  {
+    if (QUANT == OPT_PQ)
+      return dist_fast->compare_pq(query, (const uint8_t *)row, pq_m);
+    if (QUANT == OPT_SQ8) // <q, min + scale * code> = <q, min> + <q * scale, code>
+      return MetricDistance<METRIC>(bias + distance_kernels->sq8_dot(query, (const uint8_t *)(row + 1), dim),
+                                    *row, scale);
+    if (METRIC == L2)
+      return OptDistance<DIM>(dist_fast, query, row + 1, *row, dim);
+    return MetricDistance<METRIC>(dist_fast->DistanceInnerProduct::compare(query, row + 1, dim), *row, scale);
+  }
+
+  template <unsigned ATTR_WIDTH>
+  static inline float AttributeMismatch(const char *a, const char *b, unsigned width)
+  {
+    return CountMismatch(a, b, ATTR_WIDTH);
+  }
+
+  template <>
+  inline float AttributeMismatch<0>(const char *a, const char *b, unsigned width)
+  {
+    return CountMismatch(a, b, width);
+  }
+
+  // mismatch as fusion weighs it, counted on the compile-time width
+  template <unsigned ATTR_WIDTH>
+  static inline float FusedMismatch(const AttributeFusion &fusion, const char *a, const char *b,
+                                    unsigned width)
+  {
+    if (fusion.policy == FUSION_WEIGHTED)
+      return WeightedMismatch(a, b, width, fusion.weights);
+    return AttributeMismatch<ATTR_WIDTH>(a, b, width);
+  }
+
+  size_t IndexGraph::PendingExpansionCost(const Neighbor *retset, unsigned L,
+                                          VisitedList &visited) const
+  {
+    size_t cost = 0;
+    for (unsigned i = 0; i < L; i++)
+    {
+      if (retset[i].flag)
+        continue;
+      unsigned *neighbors = OptLinks(retset[i].id);
+      unsigned MaxM = *neighbors;
+      neighbors += 2;
+      for (unsigned m = 0; m < MaxM; ++m)
+        cost += !visited.TestAndVisit(neighbors[m]);
+    }
+    return cost;
+  }
+
+  template <unsigned DIM, unsigned ATTR_WIDTH, bool SPLIT, unsigned QUANT, unsigned METRIC>
+  void IndexGraph::SearchWithOptGraph_(SearchContext &ctx, const char *attribute,
+                                       const float *query, size_t K, unsigned L,
+                                       const AttributeFusion &fusion, unsigned *indices)
+  {
+    const DistanceFastL2 *dist_fast = &opt_distance_;
+
+    ctx.Prepare(L);
+    if (ctx.cand_ids.size() < width)
+    {
+      ctx.cand_ids.resize(width);
+      ctx.cand_cnt.resize(width);
+    }
+    std::vector<Neighbor> &retset = ctx.retset;
+    unsigned *init_ids = ctx.init_ids.data();
+    unsigned *cand_ids = ctx.cand_ids.data();
+    float *cand_cnt = ctx.cand_cnt.data();
+    VisitedList &flags = ctx.visited;
+    size_t &dist_count = ctx.dist_count;
+    const SearchStopRule &stop = ctx.stop;
+    SearchStats &stats = ctx.stats;
+    stats = SearchStats();
+    size_t dist_start = dist_count;
+
+    // pool distances are never below query_floor, so a node whose penalty
+    // alone reaches past the pool can be dropped on its attributes, without
+    // its vector
+    PrepareQuery(ctx, query);
+    const float *qv = QUANT != OPT_FLOAT ? ctx.query_table.data() : query;
+    const float query_floor = ctx.query_floor;
+    const float query_offset = ctx.query_offset;
+    const float query_bias = ctx.query_bias;
+    const float query_scale = ctx.query_scale;
+
+    unsigned n_init = InitEntryPoints(ctx, attribute, L);
+    for (unsigned i = 0; i < n_init; i++)
+    {
+      unsigned id = init_ids[i];
+      if (id >= nd_)
+        continue;
+      _mm_prefetch((char *)OptVector<SPLIT>(id), _MM_HINT_T0);
+      _mm_prefetch(OptAttributes<SPLIT>(id), _MM_HINT_T0);
+    }
+    L = 0;
+    for (unsigned i = 0; i < n_init; i++)
+    {
+      unsigned id = init_ids[i];
+      if (id >= nd_)
+        continue;
+      float dist = RowDistance<DIM, QUANT, METRIC>(dist_fast, qv, OptVector<SPLIT>(id), (unsigned)dimension_,
+                                                   pq_m_, query_bias, query_scale);
+
+      float cnt = FusedMismatch<ATTR_WIDTH>(fusion, OptAttributes<SPLIT>(id), attribute, attribute_stride_);
+      dist = fusion.Apply(dist, cnt, query_offset);
+
+      dist_count++;
+      retset[L] = Neighbor(id, dist, true);
+      L++;
+    }
+
+    // Scores the unvisited neighbours of n (field 0 = k, 1 = kk of its list)
+    // and returns the best pool position it inserted at. Attributes are
+    // checked first so pruned nodes never have their vector read.
+    auto expand = [&](unsigned n, unsigned field, bool flag)
+    {
+      int nk = L;
+      unsigned *neighbors = OptLinks<SPLIT>(n);
+      unsigned MaxM = neighbors[field];
+      neighbors += 2;
+      for (unsigned m = 0; m < MaxM; ++m)
+        _mm_prefetch(OptAttributes<SPLIT>(neighbors[m]), _MM_HINT_T0);
+      unsigned n_cand = 0;
+      for (unsigned m = 0; m < MaxM; ++m)
+      {
+        unsigned id = neighbors[m];
+        if (flags.TestAndVisit(id))
+          continue;
+        float cnt = FusedMismatch<ATTR_WIDTH>(fusion, OptAttributes<SPLIT>(id), attribute, attribute_stride_);
+        if (cnt > 0 && fusion.LowerBound(query_floor, cnt, query_offset) >= retset[L - 1].distance)
+          continue;
+        _mm_prefetch((char *)OptVector<SPLIT>(id), _MM_HINT_T0);
+        cand_ids[n_cand] = id;
+        cand_cnt[n_cand++] = cnt;
+      }
+      for (unsigned c = 0; c < n_cand; ++c)
+      {
+        unsigned id = cand_ids[c];
+        float dist = RowDistance<DIM, QUANT, METRIC>(dist_fast, qv, OptVector<SPLIT>(id), (unsigned)dimension_,
+                                                     pq_m_, query_bias, query_scale);
+        dist = fusion.Apply(dist, cand_cnt[c], query_offset);
+
+        dist_count++;
+        if (dist >= retset[L - 1].distance)
+          continue;
+        Neighbor nn(id, dist, flag);
+        int r = InsertIntoPool(retset.data(), L, nn);
+
+        // if(L+1 < retset.size()) ++L;
+        if (r < nk)
+          nk = r;
+      }
+      return nk;
+    };
+
+    std::sort(retset.begin(), retset.begin() + L);
+    size_t top = std::min(K, (size_t)L);
+    unsigned stale = 0;
+    int k = 0;
+    while (k < (int)L)
+    {
+      int nk = L;
+
+      if (retset[k].flag)
+      {
+        retset[k].flag = false;
+        stats.expansions++;
+        nk = expand(retset[k].id, 1, true);
+        stale = nk < (int)top ? 0 : stale + 1;
       }
       if (nk <= k)
         k = nk;
       else
         ++k;
+      if (stop.Enabled() && stop.Stop(retset.data(), L, top, k, stale))
+      {
+        // the half-degree pass is only a warm-up: hand what it left over to
+        // the full-degree pass instead of dropping it
+        stats.early_stopped = true;
+        for (unsigned i = 0; i < L; i++)
+          retset[i].flag = false;
+        break;
+      }
     }
     // for (size_t i = 0; i < L; i++) {  
     //   retset[i].flag = true;
     // }
+    stale = 0;
     k = 0;
     while (k < (int)L)
     {
@@ -1342,283 +2781,856 @@ namespace efanna2e
       if (!retset[k].flag)
       {
         retset[k].flag = true;
-        unsigned n = retset[k].id;
+        stats.expansions++;
+        nk = expand(retset[k].id, 0, false);
+        stale = nk < (int)top ? 0 : stale + 1;
+      }
+      if (nk <= k)
+        k = nk;
+      else
+        ++k;
+      if (stop.Enabled() && stop.Stop(retset.data(), L, top, k, stale))
+      {
+        stats.dist_saved = PendingExpansionCost(retset.data(), L, flags);
+        stats.early_stopped = true;
+        break;
+      }
+    }
+    stats.dist_count = dist_count - dist_start;
+    for (size_t i = 0; i < K; i++)
+    {
+      indices[i] = retset[i].id;
+    }
+  }
 
-        _mm_prefetch(opt_graph_ + node_size * n + data_len + attribute_len, _MM_HINT_T0);
-        unsigned *neighbors = (unsigned *)(opt_graph_ + node_size * n + data_len + attribute_len);
-        unsigned MaxM = *neighbors;
+  // prefetches every cache line of [p, p + len)
+  static inline void PrefetchLines(const char *p, size_t len)
+  {
+    for (size_t off = 0; off < len; off += 64)
+      _mm_prefetch(p + off, _MM_HINT_T0);
+  }
+
+  // The search of SearchWithOptGraph_, cut into stages at the points where it
+  // waits on memory: picking the next node (its link row), visiting its
+  // neighbours (their attribute rows), pruning them (their vector rows) and
+  // scoring them. A stage issues the prefetches the next one needs and the
+  // lanes take turns, so every load has the other lanes' work to hide behind.
+  // Each lane replays the single-query search step for step.
+  template <unsigned DIM, unsigned ATTR_WIDTH, bool SPLIT, unsigned QUANT, unsigned METRIC>
+  void IndexGraph::InterleavedSearch_(SearchContext &ctx, const HybridQueryPlan *const *plans,
+                                      const float *const *queries, const unsigned *seeds,
+                                      unsigned n, unsigned lanes, unsigned *const *indices,
+                                      SearchStats *const *stats)
+  {
+    const DistanceFastL2 *dist_fast = &opt_distance_;
+    lanes = std::max(1u, std::min(lanes, n));
+    while (ctx.lanes.size() < lanes)
+      ctx.lanes.push_back(std::make_shared<SearchContext>(nd_));
+
+    enum Stage
+    {
+      NEXT_NODE,
+      VISIT,
+      PRUNE,
+      SCORE
+    };
+    struct Lane
+    {
+      SearchContext *ctx;
+      unsigned query;
+      const float *qv;
+      unsigned L;
+      size_t top;
+      int k;
+      unsigned field;
+      unsigned stale;
+      Stage stage;
+      unsigned node;
+      unsigned n_cand;
+      size_t dist_start;
+    };
+    Lane lane_state[kMaxSearchInterleave];
+
+    // scores the entry points of the lane's next query, as the single-query
+    // kernel does
+    auto start = [&](Lane &lane, unsigned q)
+    {
+      SearchContext &c = *lane.ctx;
+      const HybridQueryPlan &plan = *plans[q];
+      const char *attribute = plan.attribute.data();
+      c.rng.seed(seeds[q]);
+      c.stop = plan.stop;
+      c.Prepare(plan.L);
+      if (c.cand_ids.size() < width)
+      {
+        c.cand_ids.resize(width);
+        c.cand_cnt.resize(width);
+      }
+      c.stats = SearchStats();
+      PrepareQuery(c, queries[q]);
+      lane.query = q;
+      lane.qv = QUANT != OPT_FLOAT ? c.query_table.data() : queries[q];
+      lane.dist_start = c.dist_count;
+
+      unsigned *init_ids = c.init_ids.data();
+      unsigned n_init = InitEntryPoints(c, attribute, plan.L);
+      for (unsigned i = 0; i < n_init; i++)
+      {
+        unsigned id = init_ids[i];
+        if (id >= nd_)
+          continue;
+        _mm_prefetch((char *)OptVector<SPLIT>(id), _MM_HINT_T0);
+        _mm_prefetch(OptAttributes<SPLIT>(id), _MM_HINT_T0);
+      }
+      unsigned L = 0;
+      for (unsigned i = 0; i < n_init; i++)
+      {
+        unsigned id = init_ids[i];
+        if (id >= nd_)
+          continue;
+        float dist = RowDistance<DIM, QUANT, METRIC>(dist_fast, lane.qv, OptVector<SPLIT>(id), (unsigned)dimension_,
+                                                     pq_m_, c.query_bias, c.query_scale);
+        float cnt = FusedMismatch<ATTR_WIDTH>(plan.fusion, OptAttributes<SPLIT>(id), attribute, attribute_stride_);
+        dist = plan.fusion.Apply(dist, cnt, c.query_offset);
+        c.dist_count++;
+        c.retset[L] = Neighbor(id, dist, true);
+        L++;
+      }
+      std::sort(c.retset.begin(), c.retset.begin() + L);
+      lane.L = L;
+      lane.top = std::min(plan.K, (size_t)L);
+      lane.k = 0;
+      lane.field = 1;
+      lane.stale = 0;
+      lane.stage = NEXT_NODE;
+    };
+
+    // applies the stop rule after a step of the lane's pass; returns false
+    // once the query is done
+    auto check_stop = [&](Lane &lane)
+    {
+      SearchContext &c = *lane.ctx;
+      if (!c.stop.Enabled() || !c.stop.Stop(c.retset.data(), lane.L, lane.top, lane.k, lane.stale))
+        return true;
+      c.stats.early_stopped = true;
+      if (lane.field == 0)
+      {
+        c.stats.dist_saved = PendingExpansionCost(c.retset.data(), lane.L, c.visited);
+        return false;
+      }
+      // the half-degree pass hands what it left over to the full-degree pass
+      for (unsigned i = 0; i < lane.L; i++)
+        c.retset[i].flag = false;
+      lane.field = 0;
+      lane.stale = 0;
+      lane.k = 0;
+      return true;
+    };
+
+    // runs one stage of the lane; returns false once the query is done
+    auto step = [&](Lane &lane)
+    {
+      SearchContext &c = *lane.ctx;
+      const HybridQueryPlan &plan = *plans[lane.query];
+      const char *attribute = plan.attribute.data();
+      Neighbor *retset = c.retset.data();
+      // entries the current pass has yet to expand carry this flag
+      const bool pending = lane.field == 1;
+      switch (lane.stage)
+      {
+      case NEXT_NODE:
+        for (;;)
+        {
+          if (lane.k >= (int)lane.L)
+          {
+            if (lane.field == 0)
+              return false;
+            lane.field = 0;
+            lane.stale = 0;
+            lane.k = 0;
+            return true;
+          }
+          if (retset[lane.k].flag == pending)
+            break;
+          ++lane.k;
+          if (!check_stop(lane))
+            return false;
+          if (lane.field == 0 && pending)
+            return true;
+        }
+        retset[lane.k].flag = !pending;
+        c.stats.expansions++;
+        lane.node = retset[lane.k].id;
+        PrefetchLines((const char *)OptLinks<SPLIT>(lane.node), neighbor_len);
+        lane.stage = VISIT;
+        return true;
+      case VISIT:
+      {
+        unsigned *neighbors = OptLinks<SPLIT>(lane.node);
+        unsigned MaxM = neighbors[lane.field];
         neighbors += 2;
-        for (unsigned m = 0; m < MaxM; ++m)
-          _mm_prefetch(opt_graph_ + node_size * neighbors[m], _MM_HINT_T0);
+        unsigned n_cand = 0;
         for (unsigned m = 0; m < MaxM; ++m)
         {
           unsigned id = neighbors[m];
-          if (flags[id])
+          if (c.visited.TestAndVisit(id))
             continue;
-          flags[id] = 1;
-          float *data = (float *)(opt_graph_ + node_size * id);
-          float norm = *data;
-          data++;
-          float dist =
-              dist_fast->compare(query, data, norm, (unsigned)dimension_);
-
-          float cnt = 0;
-          char *id_attribute = (char *)(opt_graph_ + node_size * id + data_len);
-          for (int k = 0; k < attribute_number_; k++)
-          {
-            if (id_attribute[k] != attribute[k])
-            {
-              cnt++;
-            }
-          }
-          //dist += dist * cnt / (float)attribute_number_;
-          dist += cnt * weight_search;
-
-          dist_cout++;
-          if (dist >= retset[L - 1].distance)
+          _mm_prefetch(OptAttributes<SPLIT>(id), _MM_HINT_T0);
+          c.cand_ids[n_cand++] = id;
+        }
+        lane.n_cand = n_cand;
+        lane.stage = PRUNE;
+        return true;
+      }
+      case PRUNE:
+      {
+        unsigned kept = 0;
+        for (unsigned i = 0; i < lane.n_cand; ++i)
+        {
+          unsigned id = c.cand_ids[i];
+          float cnt = FusedMismatch<ATTR_WIDTH>(plan.fusion, OptAttributes<SPLIT>(id), attribute, attribute_stride_);
+          if (cnt > 0 && plan.fusion.LowerBound(c.query_floor, cnt, c.query_offset) >= retset[lane.L - 1].distance)
             continue;
-          Neighbor nn(id, dist, false);
-          int r = InsertIntoPool(retset.data(), L, nn);
-
-          // if(L+1 < retset.size()) ++L;
+          PrefetchLines((const char *)OptVector<SPLIT>(id), data_len);
+          c.cand_ids[kept] = id;
+          c.cand_cnt[kept++] = cnt;
+        }
+        lane.n_cand = kept;
+        lane.stage = SCORE;
+        return true;
+      }
+      case SCORE:
+      {
+        int nk = lane.L;
+        for (unsigned i = 0; i < lane.n_cand; ++i)
+        {
+          unsigned id = c.cand_ids[i];
+          float dist = RowDistance<DIM, QUANT, METRIC>(dist_fast, lane.qv, OptVector<SPLIT>(id), (unsigned)dimension_,
+                                                       pq_m_, c.query_bias, c.query_scale);
+          dist = plan.fusion.Apply(dist, c.cand_cnt[i], c.query_offset);
+          c.dist_count++;
+          if (dist >= retset[lane.L - 1].distance)
+            continue;
+          int r = InsertIntoPool(retset, lane.L, Neighbor(id, dist, pending));
           if (r < nk)
             nk = r;
         }
+        lane.stale = nk < (int)lane.top ? 0 : lane.stale + 1;
+        if (nk <= lane.k)
+          lane.k = nk;
+        else
+          ++lane.k;
+        lane.stage = NEXT_NODE;
+        return check_stop(lane);
       }
-      if (nk <= k)
-        k = nk;
-      else
-        ++k;
+      }
+      return true;
+    };
+
+    auto finish = [&](Lane &lane)
+    {
+      SearchContext &c = *lane.ctx;
+      const HybridQueryPlan &plan = *plans[lane.query];
+      const float *query = queries[lane.query];
+      c.stats.dist_count = c.dist_count - lane.dist_start;
+      ctx.dist_count += c.stats.dist_count;
+      if (quantize_ != OPT_FLOAT && rerank_data_ != nullptr)
+      {
+        size_t depth = plan.rerank == 0 ? plan.L : std::min(plan.rerank, plan.L);
+        depth = std::min(std::max(depth, plan.K), std::min((size_t)plan.L, nd_));
+        RerankPool(c, plan.attribute.data(), query, (unsigned)depth, plan.fusion);
+      }
+      for (size_t i = 0; i < plan.K; i++)
+        indices[lane.query][i] = c.retset[i].id;
+      if (stats[lane.query] != nullptr)
+        *stats[lane.query] = c.stats;
+    };
+
+    unsigned next = 0, live = 0;
+    for (unsigned l = 0; l < lanes; l++)
+    {
+      lane_state[l].ctx = ctx.lanes[l].get();
+      start(lane_state[l], next++);
+      live++;
     }
-    for (size_t i = 0; i < K; i++)
+    while (live > 0)
     {
-      indices[i] = retset[i].id;
+      for (unsigned l = 0; l < lanes; l++)
+      {
+        Lane &lane = lane_state[l];
+        if (lane.ctx == nullptr || step(lane))
+          continue;
+        finish(lane);
+        if (next < n)
+          start(lane, next++);
+        else
+        {
+          lane.ctx = nullptr;
+          live--;
+        }
+      }
     }
   }
 
-  void IndexGraph::SearchWithOptGraph(std::vector<std::string> attributes,
-                                      const float *query, size_t K,
-                                      const Parameters &parameters,
-                                      unsigned *indices)
+  template <bool SPLIT, unsigned QUANT, unsigned METRIC>
+  void IndexGraph::GroupSearchWithOptGraph_(SearchContext &ctx, const char *attribute,
+                                            const float *const *queries, unsigned n,
+                                            unsigned L, const AttributeFusion &fusion)
   {
-    std::vector<char> attribute = Attribute2int(attributes);
-    if (attribute.size() != attribute_number_)
+    const DistanceFastL2 *dist_fast = &opt_distance_;
+    const unsigned dim = (unsigned)dimension_;
+
+    ctx.Prepare(L);
+    if (ctx.cand_ids.size() < (size_t)width * kMaxSearchGroup)
     {
-      std::cout << "wrong attributes";
-      return;
+      ctx.cand_ids.resize((size_t)width * kMaxSearchGroup);
+      ctx.cand_cnt.resize((size_t)width * kMaxSearchGroup);
+    }
+    while (ctx.group.size() < n)
+      ctx.group.push_back(std::make_shared<SearchContext>(0));
+    unsigned *init_ids = ctx.init_ids.data();
+    unsigned *cand_ids = ctx.cand_ids.data();
+    float *cand_cnt = ctx.cand_cnt.data();
+    GroupMasks &masks = ctx.group_masks;
+    masks.Reset();
+
+    // the rows the many-query kernels read: the queries themselves, or
+    // their SQ8 tables; PQ sums each member's own table
+    SearchContext *members[kMaxSearchGroup];
+    const float *rows[kMaxSearchGroup];
+    const float *picked[kMaxSearchGroup];
+    unsigned slot[kMaxSearchGroup];
+    float dist[kMaxSearchGroup];
+    unsigned pos[kMaxSearchGroup];
+    for (unsigned j = 0; j < n; j++)
+    {
+      SearchContext &member = *ctx.group[j];
+      members[j] = &member;
+      member.Prepare(L);
+      member.stats = SearchStats();
+      PrepareQuery(member, queries[j]);
+      rows[j] = QUANT == OPT_SQ8 ? member.query_table.data() : queries[j];
     }
-    unsigned L = parameters.Get<unsigned>("L_search");
-    float weight_search = parameters.Get<float>("weight_search");
-    DistanceFastL2 *dist_fast = (DistanceFastL2 *)distance_;
-
-    std::vector<Neighbor> retset(L + 1);
-    std::vector<unsigned> init_ids(L);
-    std::mt19937 rng(rand());
-    GenRandom(rng, init_ids.data(), L, (unsigned)nd_);
-    // assert(eps_.size() < L);
 
-    //for (unsigned i = 0; i < eps_.size() && i < L; i++)
-    //{
-    //  init_ids[i] = eps_[i];
-    //}
+    // pool distances of one row to the members of mask, into dist[j]
+    size_t scores = 0;
+    auto score = [&](unsigned id, unsigned mask)
+    {
+      const float *row = OptVector<SPLIT>(id);
+      unsigned m = 0;
+      for (unsigned j = 0; j < n; j++)
+      {
+        if (mask >> j & 1)
+        {
+          slot[m] = j;
+          picked[m++] = rows[j];
+          members[j]->stats.dist_count++;
+        }
+      }
+      scores += m;
+      if (QUANT == OPT_PQ)
+      {
+        for (unsigned c = 0; c < m; c++)
+          dist[slot[c]] = dist_fast->compare_pq(picked[c], (const uint8_t *)row, pq_m_);
+        return;
+      }
+      float ip[kMaxSearchGroup];
+      if (QUANT == OPT_SQ8)
+        distance_kernels->sq8_dot_many(picked, m, (const uint8_t *)(row + 1), dim, ip);
+      else
+        distance_kernels->inner_product_many(picked, m, row + 1, dim, ip);
+      for (unsigned c = 0; c < m; c++)
+      {
+        SearchContext &member = *members[slot[c]];
+        float dot = QUANT == OPT_SQ8 ? member.query_bias + ip[c] : ip[c];
+        dist[slot[c]] = MetricDistance<METRIC>(dot, *row, member.query_scale);
+      }
+    };
 
-    boost::dynamic_bitset<> flags{nd_, 0};
-    for (unsigned i = 0; i < init_ids.size(); i++)
+    const unsigned all = (1u << n) - 1;
+    unsigned n_init = InitEntryPoints(ctx, attribute, L);
+    for (unsigned i = 0; i < n_init; i++)
     {
       unsigned id = init_ids[i];
       if (id >= nd_)
         continue;
-      _mm_prefetch(opt_graph_ + node_size * id, _MM_HINT_T0);
+      _mm_prefetch((char *)OptVector<SPLIT>(id), _MM_HINT_T0);
+      _mm_prefetch(OptAttributes<SPLIT>(id), _MM_HINT_T0);
     }
     L = 0;
-    for (unsigned i = 0; i < init_ids.size(); i++)
+    for (unsigned i = 0; i < n_init; i++)
     {
       unsigned id = init_ids[i];
       if (id >= nd_)
         continue;
-      float *x = (float *)(opt_graph_ + node_size * id);
-      float norm_x = *x;
-      x++;
-      float dist = dist_fast->compare(x, query, norm_x, (unsigned)dimension_);
-
-      float cnt = 0;
-      char *id_attribute = (char *)(opt_graph_ + node_size * id + data_len);
-      for (int k = 0; k < attribute_number_; k++)
-      {
-        if (id_attribute[k] != attribute[k])
-        {
-          cnt++;
-        }
-      }
-      //dist += dist * cnt / (float)attribute_number_;
-      dist += cnt * weight_search;
-
-      // float d = distance_ -> compare(x, query, (unsigned)dimension_);
-      // std::cout << d << std::endl;
-      dist_cout++;
-      retset[i] = Neighbor(id, dist, true);
-      flags[id] = true;
+      score(id, all);
+      masks.Get(id).scored = all;
+      float cnt = fusion.Mismatch(OptAttributes<SPLIT>(id), attribute, attribute_stride_);
+      for (unsigned j = 0; j < n; j++)
+        members[j]->retset[L] = Neighbor(id, fusion.Apply(dist[j], cnt, members[j]->query_offset), true);
       L++;
     }
-    // std::cout<<L<<std::endl;
-
-    std::sort(retset.begin(), retset.begin() + L);
-    int k = 0;
-    while (k < (int)L)
+    for (unsigned j = 0; j < n; j++)
+      std::sort(members[j]->retset.begin(), members[j]->retset.begin() + L);
+
+    // Every round each member expands its next pool entry as the
+    // single-query kernel would, but only collects the neighbours it has not
+    // scored yet and that pass its attribute check. The round's rows are
+    // then fetched once each and scored for all members that want them, so
+    // each member's search is unchanged while overlapping neighbourhoods
+    // share their loads and the loads of all members are in flight together.
+    // The wanted mask of id marks the members that want id in the current
+    // round.
+    for (unsigned field = 1, pass = 0; pass < 2; pass++, field = 0)
     {
-      int nk = L;
-
-      if (retset[k].flag)
+      // the half-degree pass expands the entries flagged true, the
+      // full-degree pass those flagged false
+      bool pending = pass == 0;
+      for (unsigned j = 0; j < n; j++)
+        pos[j] = 0;
+      while (true)
       {
-        retset[k].flag = false;
-        unsigned n = retset[k].id;
-
-        _mm_prefetch(opt_graph_ + node_size * n + data_len + attribute_len, _MM_HINT_T0);
-        unsigned *neighbors = (unsigned *)(opt_graph_ + node_size * n + data_len + attribute_len);
-        neighbors++;
-        unsigned MaxM = *neighbors;
-        neighbors++;
-        for (unsigned m = 0; m < MaxM; ++m)
-          _mm_prefetch(opt_graph_ + node_size * neighbors[m], _MM_HINT_T0);
-        for (unsigned m = 0; m < MaxM; ++m)
+        unsigned n_cand = 0;
+        bool active = false;
+        for (unsigned j = 0; j < n; j++)
         {
-          unsigned id = neighbors[m];
-          if (flags[id])
+          Neighbor *retset = members[j]->retset.data();
+          while (pos[j] < L && retset[pos[j]].flag != pending)
+            pos[j]++;
+          if (pos[j] >= L)
             continue;
-          flags[id] = 1;
-          float *data = (float *)(opt_graph_ + node_size * id);
-          float norm = *data;
-          data++;
-          float dist =
-              dist_fast->compare(query, data, norm, (unsigned)dimension_);
-
-          float cnt = 0;
-          char *id_attribute = (char *)(opt_graph_ + node_size * id + data_len);
-          for (int k = 0; k < attribute_number_; k++)
+          active = true;
+          retset[pos[j]].flag = !pending;
+          members[j]->stats.expansions++;
+          unsigned *neighbors = OptLinks<SPLIT>(retset[pos[j]].id);
+          unsigned MaxM = neighbors[field];
+          neighbors += 2;
+          for (unsigned m = 0; m < MaxM; ++m)
+            _mm_prefetch(OptAttributes<SPLIT>(neighbors[m]), _MM_HINT_T0);
+          for (unsigned m = 0; m < MaxM; ++m)
           {
-            if (id_attribute[k] != attribute[k])
+            unsigned id = neighbors[m];
+            GroupMasks::Entry &entry = masks.Get(id);
+            if (entry.scored >> j & 1)
+              continue;
+            entry.scored |= 1u << j;
+            float cnt = fusion.Mismatch(OptAttributes<SPLIT>(id), attribute, attribute_stride_);
+            if (cnt > 0 &&
+                fusion.LowerBound(members[j]->query_floor, cnt, members[j]->query_offset) >= retset[L - 1].distance)
+              continue;
+            if (entry.wanted == 0)
             {
-              cnt++;
+              _mm_prefetch((char *)OptVector<SPLIT>(id), _MM_HINT_T0);
+              cand_ids[n_cand] = id;
+              cand_cnt[n_cand++] = cnt;
             }
+            entry.wanted |= 1u << j;
+          }
+        }
+        if (!active)
+          break;
+        for (unsigned c = 0; c < n_cand; ++c)
+        {
+          unsigned id = cand_ids[c];
+          GroupMasks::Entry &entry = masks.Get(id);
+          unsigned mask = entry.wanted;
+          entry.wanted = 0;
+          score(id, mask);
+          for (unsigned j = 0; j < n; j++)
+          {
+            if (!(mask >> j & 1))
+              continue;
+            Neighbor *retset = members[j]->retset.data();
+            float d = fusion.Apply(dist[j], cand_cnt[c], members[j]->query_offset);
+            if (d >= retset[L - 1].distance)
+              continue;
+            unsigned r = InsertIntoPool(retset, L, Neighbor(id, d, pending));
+            if (r < pos[j])
+              pos[j] = r;
           }
-          //dist += dist * cnt / (float)attribute_number_;
-          dist += cnt * weight_search;
-
-          dist_cout++;
-          if (dist >= retset[L - 1].distance)
-            continue;
-          Neighbor nn(id, dist, true);
-          int r = InsertIntoPool(retset.data(), L, nn);
-
-          // if(L+1 < retset.size()) ++L;
-          if (r < nk)
-            nk = r;
         }
       }
-      if (nk <= k)
-        k = nk;
-      else
-        ++k;
     }
-    // for (size_t i = 0; i < L; i++) {  
-    //   retset[i].flag = true;
-    // }
-    k = 0;
-    while (k < (int)L)
+    ctx.dist_count += scores;
+  }
+
+  template <unsigned QUANT, unsigned METRIC>
+  IndexGraph::GroupKernel IndexGraph::SelectGroupKernel() const
+  {
+    return split_layout_ ? &IndexGraph::GroupSearchWithOptGraph_<true, QUANT, METRIC>
+                         : &IndexGraph::GroupSearchWithOptGraph_<false, QUANT, METRIC>;
+  }
+
+  IndexGraph::GroupKernel IndexGraph::SelectGroupKernel() const
+  {
+    if (opt_metric_ == INNER_PRODUCT)
     {
-      int nk = L;
+      if (quantize_ == OPT_SQ8)
+        return SelectGroupKernel<OPT_SQ8, INNER_PRODUCT>();
+      if (quantize_ == OPT_PQ)
+        return SelectGroupKernel<OPT_PQ, INNER_PRODUCT>();
+      return SelectGroupKernel<OPT_FLOAT, INNER_PRODUCT>();
+    }
+    if (opt_metric_ == COSINE)
+    {
+      if (quantize_ == OPT_SQ8)
+        return SelectGroupKernel<OPT_SQ8, COSINE>();
+      return SelectGroupKernel<OPT_FLOAT, COSINE>();
+    }
+    if (quantize_ == OPT_SQ8)
+      return SelectGroupKernel<OPT_SQ8, L2>();
+    if (quantize_ == OPT_PQ)
+      return SelectGroupKernel<OPT_PQ, L2>();
+    return SelectGroupKernel<OPT_FLOAT, L2>();
+  }
 
-      if (!retset[k].flag)
-      {
-        retset[k].flag = true;
-        unsigned n = retset[k].id;
+  template <unsigned DIM, unsigned ATTR_WIDTH, bool SPLIT, unsigned QUANT, unsigned METRIC>
+  IndexGraph::OptKernels IndexGraph::MakeKernels()
+  {
+    OptKernels kernels;
+    kernels.search = &IndexGraph::SearchWithOptGraph_<DIM, ATTR_WIDTH, SPLIT, QUANT, METRIC>;
+    kernels.interleave = &IndexGraph::InterleavedSearch_<DIM, ATTR_WIDTH, SPLIT, QUANT, METRIC>;
+    return kernels;
+  }
 
-        _mm_prefetch(opt_graph_ + node_size * n + data_len + attribute_len, _MM_HINT_T0);
-        unsigned *neighbors = (unsigned *)(opt_graph_ + node_size * n + data_len + attribute_len);
-        unsigned MaxM = *neighbors;
-        neighbors += 2;
-        for (unsigned m = 0; m < MaxM; ++m)
-          _mm_prefetch(opt_graph_ + node_size * neighbors[m], _MM_HINT_T0);
-        for (unsigned m = 0; m < MaxM; ++m)
+  template <unsigned DIM, unsigned QUANT, unsigned METRIC>
+  IndexGraph::OptKernels IndexGraph::SelectKernels(unsigned attr_width)
+  {
+    switch (attr_width)
+    {
+    case 16:
+      return split_layout_ ? MakeKernels<DIM, 16, true, QUANT, METRIC>()
+                           : MakeKernels<DIM, 16, false, QUANT, METRIC>();
+    case 32:
+      return split_layout_ ? MakeKernels<DIM, 32, true, QUANT, METRIC>()
+                           : MakeKernels<DIM, 32, false, QUANT, METRIC>();
+    case 64:
+      return split_layout_ ? MakeKernels<DIM, 64, true, QUANT, METRIC>()
+                           : MakeKernels<DIM, 64, false, QUANT, METRIC>();
+    default:
+      return split_layout_ ? MakeKernels<DIM, 0, true, QUANT, METRIC>()
+                           : MakeKernels<DIM, 0, false, QUANT, METRIC>();
+    }
+  }
+
+  IndexGraph::OptKernels IndexGraph::SelectKernels(unsigned dim, unsigned attr_width)
+  {
+    // the quantized and the inner-product and cosine kernels only run on
+    // the runtime dimension
+    if (opt_metric_ == INNER_PRODUCT)
+    {
+      if (quantize_ == OPT_SQ8)
+        return SelectKernels<0, OPT_SQ8, INNER_PRODUCT>(attr_width);
+      if (quantize_ == OPT_PQ)
+        return SelectKernels<0, OPT_PQ, INNER_PRODUCT>(attr_width);
+      return SelectKernels<0, OPT_FLOAT, INNER_PRODUCT>(attr_width);
+    }
+    if (opt_metric_ == COSINE)
+    {
+      if (quantize_ == OPT_SQ8)
+        return SelectKernels<0, OPT_SQ8, COSINE>(attr_width);
+      return SelectKernels<0, OPT_FLOAT, COSINE>(attr_width);
+    }
+    if (quantize_ == OPT_SQ8)
+      return SelectKernels<0, OPT_SQ8, L2>(attr_width);
+    if (quantize_ == OPT_PQ)
+      return SelectKernels<0, OPT_PQ, L2>(attr_width);
+    // served dimensions, both raw and padded by data_align
+    switch (dim)
+    {
+    case 100:
+      return SelectKernels<100, OPT_FLOAT, L2>(attr_width);
+    case 104:
+      return SelectKernels<104, OPT_FLOAT, L2>(attr_width);
+    case 128:
+      return SelectKernels<128, OPT_FLOAT, L2>(attr_width);
+    case 200:
+      return SelectKernels<200, OPT_FLOAT, L2>(attr_width);
+    case 256:
+      return SelectKernels<256, OPT_FLOAT, L2>(attr_width);
+    case 300:
+      return SelectKernels<300, OPT_FLOAT, L2>(attr_width);
+    case 304:
+      return SelectKernels<304, OPT_FLOAT, L2>(attr_width);
+    case 420:
+      return SelectKernels<420, OPT_FLOAT, L2>(attr_width);
+    case 424:
+      return SelectKernels<424, OPT_FLOAT, L2>(attr_width);
+    case 960:
+      return SelectKernels<960, OPT_FLOAT, L2>(attr_width);
+    default:
+      return SelectKernels<0, OPT_FLOAT, L2>(attr_width);
+    }
+  }
+
+  void IndexGraph::TrainScalarQuantizer(const float *data)
+  {
+    std::vector<float> lo(dimension_, std::numeric_limits<float>::max());
+    std::vector<float> hi(dimension_, std::numeric_limits<float>::lowest());
+#pragma omp parallel
+    {
+      std::vector<float> t_lo(lo), t_hi(hi);
+#pragma omp for schedule(static)
+      for (size_t i = 0; i < nd_; i++)
+      {
+        const float *v = data + i * dimension_;
+        for (size_t d = 0; d < dimension_; d++)
         {
-          unsigned id = neighbors[m];
-          if (flags[id])
-            continue;
-          flags[id] = 1;
-          float *data = (float *)(opt_graph_ + node_size * id);
-          float norm = *data;
-          data++;
-          float dist =
-              dist_fast->compare(query, data, norm, (unsigned)dimension_);
+          t_lo[d] = std::min(t_lo[d], v[d]);
+          t_hi[d] = std::max(t_hi[d], v[d]);
+        }
+      }
+#pragma omp critical
+      {
+        for (size_t d = 0; d < dimension_; d++)
+        {
+          lo[d] = std::min(lo[d], t_lo[d]);
+          hi[d] = std::max(hi[d], t_hi[d]);
+        }
+      }
+    }
+    sq_min_ = lo;
+    sq_scale_.resize(dimension_);
+    for (size_t d = 0; d < dimension_; d++)
+      sq_scale_[d] = (hi[d] - lo[d]) / 255.0f;
+  }
 
-          float cnt = 0;
-          char *id_attribute = (char *)(opt_graph_ + node_size * id + data_len);
-          for (int k = 0; k < attribute_number_; k++)
+  void IndexGraph::TrainProductQuantizer(const float *data, const Parameters &parameters)
+  {
+    // default to 4-dimensional subspaces, or the nearest count that divides
+    unsigned m = dimension_ >= 4 ? (unsigned)dimension_ / 4 : 1;
+    while (dimension_ % m != 0)
+      m--;
+    pq_m_ = parameters.Get<unsigned>("pq_m", m);
+    if (pq_m_ == 0 || dimension_ % pq_m_ != 0)
+      throw std::runtime_error("[Error] pq_m must divide the dimension");
+    size_t sub = dimension_ / pq_m_;
+    unsigned iter = parameters.Get<unsigned>("pq_iter", 10);
+    unsigned n_train = (unsigned)std::min(nd_, (size_t)parameters.Get<unsigned>("pq_train", 65536));
+    std::vector<unsigned> sample(n_train);
+    std::mt19937 rng(rand());
+    if (n_train < nd_)
+      GenRandom(rng, sample.data(), n_train, (unsigned)nd_);
+    else
+      std::iota(sample.begin(), sample.end(), 0);
+    std::cout << "pq: " << pq_m_ << " subspaces of " << sub << " dims, " << n_train
+              << " training vectors" << std::endl;
+
+    pq_codebook_.assign(256 * dimension_, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t j = 0; j < pq_m_; j++)
+    {
+      std::vector<float> x(n_train * sub);
+      for (size_t i = 0; i < n_train; i++)
+        std::memcpy(&x[i * sub], data + sample[i] * dimension_ + j * sub, sub * sizeof(float));
+      float *centroids = pq_codebook_.data() + j * 256 * sub;
+      for (size_t c = 0; c < 256; c++)
+        std::memcpy(centroids + c * sub, &x[(c * n_train / 256) * sub], sub * sizeof(float));
+
+      std::vector<unsigned> assign(n_train);
+      std::vector<float> sum(256 * sub);
+      std::vector<unsigned> count(256);
+      std::mt19937 sub_rng(j);
+      for (unsigned it = 0; it < iter; it++)
+      {
+        std::fill(sum.begin(), sum.end(), 0.0f);
+        std::fill(count.begin(), count.end(), 0);
+        for (size_t i = 0; i < n_train; i++)
+        {
+          const float *v = &x[i * sub];
+          float best = std::numeric_limits<float>::max();
+          for (unsigned c = 0; c < 256; c++)
           {
-            if (id_attribute[k] != attribute[k])
+            const float *centroid = centroids + c * sub;
+            float dist = 0;
+            for (size_t d = 0; d < sub; d++)
+              dist += (v[d] - centroid[d]) * (v[d] - centroid[d]);
+            if (dist < best)
             {
-              cnt++;
+              best = dist;
+              assign[i] = c;
             }
           }
-          //dist += dist * cnt / (float)attribute_number_;
-          dist += cnt * weight_search;
-
-          dist_cout++;
-          if (dist >= retset[L - 1].distance)
+          count[assign[i]]++;
+          for (size_t d = 0; d < sub; d++)
+            sum[assign[i] * sub + d] += v[d];
+        }
+        for (unsigned c = 0; c < 256; c++)
+        {
+          // an empty cluster restarts from a random training vector
+          if (count[c] == 0)
+          {
+            std::memcpy(centroids + c * sub, &x[(sub_rng() % n_train) * sub], sub * sizeof(float));
             continue;
-          Neighbor nn(id, dist, false);
-          int r = InsertIntoPool(retset.data(), L, nn);
-
-          // if(L+1 < retset.size()) ++L;
-          if (r < nk)
-            nk = r;
+          }
+          for (size_t d = 0; d < sub; d++)
+            centroids[c * sub + d] = sum[c * sub + d] / count[c];
         }
       }
-      if (nk <= k)
-        k = nk;
-      else
-        ++k;
     }
-    for (size_t i = 0; i < K; i++)
+  }
+
+  void IndexGraph::EncodeProductQuantized(const float *v, uint8_t *code) const
+  {
+    size_t sub = dimension_ / pq_m_;
+    for (size_t j = 0; j < pq_m_; j++)
     {
-      indices[i] = retset[i].id;
+      const float *x = v + j * sub;
+      const float *centroids = pq_codebook_.data() + j * 256 * sub;
+      float best = std::numeric_limits<float>::max();
+      for (unsigned c = 0; c < 256; c++)
+      {
+        float dist = 0;
+        for (size_t d = 0; d < sub; d++)
+          dist += (x[d] - centroids[c * sub + d]) * (x[d] - centroids[c * sub + d]);
+        if (dist < best)
+        {
+          best = dist;
+          code[j] = (uint8_t)c;
+        }
+      }
     }
   }
 
   void IndexGraph::OptimizeGraph(float *data)
+  {
+    OptimizeGraph(data, Parameters());
+  }
+
+  void IndexGraph::OptimizeGraph(float *data, const Parameters &parameters)
   { // use after build or load
 
+    ReleaseOptimized();
     data_ = data;
-    data_len = (dimension_ + 1) * sizeof(float);
-    attribute_len = attribute_number_ * sizeof(char);
+    std::string quantize = parameters.Get<std::string>("opt_quantize", metric_ == PQ ? "pq" : "none");
+    opt_metric_ = metric_ == INNER_PRODUCT || metric_ == COSINE ? metric_ : L2;
+    if (quantize == "pq" && opt_metric_ == COSINE)
+      throw std::runtime_error("[Error] PQ codes support the L2 and inner-product metrics only");
+    // code rows are padded so the rows after them stay 4-byte aligned
+    if (quantize == "sq8")
+    { // [norm|codes]
+      quantize_ = OPT_SQ8;
+      data_len = sizeof(float) + ((dimension_ + 3) & ~(size_t)3);
+      TrainScalarQuantizer(data_);
+      rerank_data_ = data_;
+    }
+    else if (quantize == "pq")
+    { // [codes]
+      quantize_ = OPT_PQ;
+      TrainProductQuantizer(data_, parameters);
+      data_len = (pq_m_ + 3) & ~(size_t)3;
+      rerank_data_ = data_;
+    }
+    else
+    {
+      data_len = (dimension_ + 1) * sizeof(float);
+    }
+    attribute_len = attribute_stride_ * sizeof(char);
     neighbor_len = (width + 2) * sizeof(unsigned);
     node_size = data_len + attribute_len + neighbor_len;
-    opt_graph_ = (char *)malloc(node_size * nd_);
-    DistanceFastL2 *dist_fast = (DistanceFastL2 *)distance_;
-    for (unsigned i = 0; i < nd_; i++)
+    split_layout_ = parameters.Get<std::string>("opt_layout", "packed") == "split";
+    OptKernels kernels = SelectKernels((unsigned)dimension_, attribute_stride_);
+    search_kernel_ = kernels.search;
+    interleave_kernel_ = kernels.interleave;
+    group_kernel_ = SelectGroupKernel();
+    if (split_layout_)
     {
-      char *cur_node_offset = opt_graph_ + i * node_size;
-      float cur_norm = dist_fast->norm(data_ + i * dimension_, dimension_);
-      std::memcpy(cur_node_offset, &cur_norm, sizeof(float));
-      std::memcpy(cur_node_offset + sizeof(float), data_ + i * dimension_,
-                  data_len - sizeof(float));
-
-      cur_node_offset += data_len;
-      std::memcpy(cur_node_offset, attributes_[i].data(), attribute_len);
-      cur_node_offset += attribute_len;
-      unsigned k = final_graph_[i].size();
-      std::memcpy(cur_node_offset, &k, sizeof(unsigned));
-      unsigned kk = k / 2;
-      std::memcpy(cur_node_offset + sizeof(unsigned), &kk, sizeof(unsigned));
-      std::memcpy(cur_node_offset + 2 * sizeof(unsigned), final_graph_[i].data(),
-                  k * sizeof(unsigned));
-      std::vector<char>().swap(attributes_[i]);
-      std::vector<unsigned>().swap(final_graph_[i]);
+      // hot: attribute rows and 64-byte aligned neighbour lists;
+      // cold: 64-byte aligned [norm|vector] rows
+      cold_size_ = (data_len + _CACHE_LINE - 1) / _CACHE_LINE * _CACHE_LINE;
+      link_size_ = (neighbor_len + _CACHE_LINE - 1) / _CACHE_LINE * _CACHE_LINE;
+      hot_attributes_ = (char *)memalign(_CACHE_LINE, (attribute_len * nd_ + _CACHE_LINE - 1) / _CACHE_LINE * _CACHE_LINE);
+      hot_links_ = (char *)memalign(_CACHE_LINE, link_size_ * nd_);
+      cold_graph_ = (char *)memalign(_CACHE_LINE, cold_size_ * nd_);
+    }
+    else
+    {
+      opt_graph_ = (char *)malloc(node_size * nd_);
+    }
+    float max_norm = 0;
+    // Every record has a fixed offset, so nodes are filled in parallel. Rows
+    // of final_graph_ are released as soon as they are copied, and they and
+    // the pages of the copied attribute rows are handed back to the system
+    // after every chunk, so the peak stays near the size of the optimized
+    // graph instead of twice it. The attribute block itself is freed at the
+    // end.
+    const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    for (size_t begin = 0; begin < nd_; begin += _OPTIMIZE_CHUNK)
+    {
+      size_t end = std::min(begin + _OPTIMIZE_CHUNK, nd_);
+#pragma omp parallel for schedule(static) reduction(max : max_norm)
+      for (size_t i = begin; i < end; i++)
+      {
+        float *cur_vector = OptVector(i);
+        float cur_norm = 0; // |x|^2 of the stored or decoded vector
+        if (split_layout_)
+        { // zero the row padding; pages are only touched as they are filled
+          std::memset(cur_vector, 0, cold_size_);
+          std::memset(OptLinks(i), 0, link_size_);
+        }
+        if (quantize_ == OPT_SQ8)
+        {
+          // the stored norm is that of the decoded vector, so the fused
+          // distance stays consistent with the codes
+          const float *v = data_ + i * dimension_;
+          uint8_t *code = (uint8_t *)(cur_vector + 1);
+          for (size_t d = 0; d < dimension_; d++)
+          {
+            float c = sq_scale_[d] > 0 ? std::round((v[d] - sq_min_[d]) / sq_scale_[d]) : 0;
+            c = std::min(std::max(c, 0.0f), 255.0f);
+            code[d] = (uint8_t)c;
+            float x = sq_min_[d] + sq_scale_[d] * c;
+            cur_norm += x * x;
+          }
+          std::memset(code + dimension_, 0, data_len - sizeof(float) - dimension_);
+        }
+        else if (quantize_ == OPT_PQ)
+        {
+          uint8_t *code = (uint8_t *)cur_vector;
+          EncodeProductQuantized(data_ + i * dimension_, code);
+          std::memset(code + pq_m_, 0, data_len - pq_m_);
+          // PQ rows keep no norm; the decoded one only bounds the inner product
+          size_t sub = dimension_ / pq_m_;
+          for (size_t j = 0; opt_metric_ == INNER_PRODUCT && j < pq_m_; j++)
+          {
+            const float *centroid = pq_codebook_.data() + (j * 256 + code[j]) * sub;
+            cur_norm += opt_distance_.norm(centroid, sub);
+          }
+        }
+        else
+        {
+          cur_norm = opt_distance_.norm(data_ + i * dimension_, dimension_);
+          std::memcpy(cur_vector + 1, data_ + i * dimension_, data_len - sizeof(float));
+        }
+        max_norm = std::max(max_norm, cur_norm);
+        if (quantize_ != OPT_PQ)
+        {
+          float slot = cur_norm;
+          if (opt_metric_ == COSINE)
+            slot = cur_norm > 0 ? 1 / std::sqrt(cur_norm) : 0;
+          std::memcpy(cur_vector, &slot, sizeof(float));
+        }
+
+        std::memcpy(OptAttributes(i), NodeAttributes(i), attribute_len);
+        unsigned *cur_links = OptLinks(i);
+        unsigned k = final_graph_[i].size();
+        cur_links[0] = k;
+        cur_links[1] = k / 2;
+        std::memcpy(cur_links + 2, final_graph_[i].data(), k * sizeof(unsigned));
+        std::vector<unsigned>().swap(final_graph_[i]);
+      }
+      malloc_trim(0);
+      uintptr_t lo = ((uintptr_t)NodeAttributes(begin) + page - 1) & ~(page - 1);
+      uintptr_t hi = (uintptr_t)NodeAttributes(end) & ~(page - 1);
+      if (hi > lo)
+        madvise((void *)lo, hi - lo, MADV_DONTNEED);
     }
+    max_norm_ = std::sqrt(max_norm);
     //free(data);
     data_ = nullptr;
-    std::vector<std::vector<char>>().swap(attributes_);
+    ReleaseAttributes();
     CompactGraph().swap(final_graph_);
+    malloc_trim(0);
   }
 
   void IndexGraph::parallel_graph_insert(unsigned id, Neighbor nn, LockGraph &g, size_t K)
@@ -1643,19 +3655,22 @@ namespace efanna2e
     data += nd_ * dimension_;
     assert(final_graph_.size() == nd_);
     assert(dim == dimension_);
+    SetFusion(parameters);
     unsigned total = n_new + (unsigned)nd_;
     LockGraph graph_tmp(total);
     size_t K = final_graph_[0].size();
     compact_to_Lockgraph(graph_tmp);
     unsigned seed = 19930808;
+    PrepareBuildPool(total);
 #pragma omp parallel
     {
-      std::mt19937 rng(seed ^ omp_get_thread_num());
+      BuildContext &bc = *build_pool_[omp_get_thread_num()];
+      bc.rng.seed(seed ^ omp_get_thread_num());
+      std::vector<Neighbor> &res = bc.result;
 #pragma omp for
       for (unsigned i = 0; i < n_new; i++)
       {
-        std::vector<Neighbor> res;
-        get_neighbor_to_add(data + i * dim, parameters, graph_tmp, rng, res, n_new);
+        get_neighbor_to_add(data + i * dim, parameters, graph_tmp, bc, res, n_new);
 
         for (unsigned j = 0; j < K; j++)
         {
@@ -1666,6 +3681,7 @@ namespace efanna2e
     };
 
     std::cout << "complete: " << std::endl;
+    build_pool_.clear();
     nd_ = total;
     final_graph_.resize(total);
     for (unsigned i = 0; i < total; i++)
@@ -1680,23 +3696,24 @@ namespace efanna2e
   void IndexGraph::get_neighbor_to_add(const float *point,
                                        const Parameters &parameters,
                                        LockGraph &g,
-                                       std::mt19937 &rng,
+                                       BuildContext &bc,
                                        std::vector<Neighbor> &retset,
                                        unsigned n_new)
   {
     const unsigned L = parameters.Get<unsigned>("L_ADD");
+    std::mt19937 &rng = bc.rng;
 
     retset.resize(L + 1);
-    std::vector<unsigned> init_ids(L);
+    std::vector<unsigned> &init_ids = bc.ids;
+    init_ids.resize(L);
     GenRandom(rng, init_ids.data(), L / 2, n_new);
     for (unsigned i = 0; i < L / 2; i++)
       init_ids[i] += nd_;
 
     GenRandom(rng, init_ids.data() + L / 2, L - L / 2, (unsigned)nd_);
 
-    unsigned n_total = (unsigned)nd_ + n_new;
-    std::vector<char> flags(n_new + n_total);
-    memset(flags.data(), 0, n_total * sizeof(char));
+    VisitedBits &flags = bc.visited;
+    flags.Reset();
     for (unsigned i = 0; i < L; i++)
     {
       unsigned id = init_ids[i];
@@ -1719,9 +3736,8 @@ namespace efanna2e
         for (unsigned m = 0; m < g[n].pool.size(); ++m)
         {
           unsigned id = g[n].pool[m].id;
-          if (flags[id])
+          if (flags.TestAndVisit(id))
             continue;
-          flags[id] = 1;
           float dist = distance_->compare(point, data_ + dimension_ * id, (unsigned)dimension_);
           if (dist >= retset[L - 1].distance)
             continue;
@@ -1759,18 +3775,17 @@ namespace efanna2e
     CompactGraph().swap(final_graph_);
   }
 
-  std::vector<char> IndexGraph::Attribute2int(std::vector<std::string> str)
+  std::vector<char> IndexGraph::Attribute2int(std::vector<std::string> str) const
   {
     std::vector<char> tmp;
     if (str.size() != attribute_number_)
       return tmp;
     for (int i = 0; i < str.size(); i++)
     {
-      for (int j = 0; j < attributes_code[i].size(); j++)
-      {
-        if (str[i] == attributes_code[i][j])
-          tmp.push_back(j);
-      }
+      int code = attribute_dict_.Find(i, str[i]);
+      if (code < 0)
+        return std::vector<char>();
+      tmp.push_back(code);
     }
     return tmp;
   }
@@ -1782,115 +3797,153 @@ namespace efanna2e
       attribute_number_ = attributes.size();
       std::cout << "attribute number changed to " << attribute_number_ << std::endl;
     }
-    if (attributes_code.size() != attribute_number_)
+    if (attribute_dict_.AttributeNumber() != (unsigned)attribute_number_)
     {
-      attributes_code.resize(attribute_number_);
+      attribute_dict_.Resize(attribute_number_);
     }
+    // the first row reserves room for all nd_ nodes, later ones double
+    size_t rows = attribute_rows_ + 1;
+    if (rows > attribute_capacity_ || AttributeStride(attribute_number_) != attribute_stride_)
+      ReserveAttributes(std::max(rows, attribute_rows_ ? attribute_capacity_ * 2 : nd_),
+                        AttributeStride(attribute_number_));
 
-    //int s = attributes_.size();
-    std::vector<char> tmp;
-
+    char *row = NodeAttributes(attribute_rows_);
     for (int i = 0; i < attributes.size(); i++)
     {
-      int flag = 1;
-      for (int j = 0; j < attributes_code[i].size(); j++)
+      int code = attribute_dict_.Insert(i, attributes[i]);
+      // codes are stored as one byte per attribute
+      if (code == 256)
+        std::cout << "warning: attribute " << i << " has more than 256 values, codes collide" << std::endl;
+      row[i] = (char)code;
+    }
+    attribute_rows_ = rows;
+  }
+
+  void IndexGraph::AddAllNodeAttributes(const std::vector<std::vector<std::string>> &attributes)
+  {
+    if (attributes.empty())
+      return;
+    unsigned n_attr = attributes[0].size();
+    for (size_t n = 1; n < attributes.size(); n++)
+    {
+      if (attributes[n].size() != n_attr)
+        throw std::runtime_error("[Error] Node " + std::to_string(n) + " has " +
+                                 std::to_string(attributes[n].size()) + " attributes, expected " +
+                                 std::to_string(n_attr));
+    }
+    if (attribute_number_ != (int)n_attr)
+    {
+      attribute_number_ = n_attr;
+      std::cout << "attribute number changed to " << attribute_number_ << std::endl;
+    }
+    // also copies a mapped table out here, so that the threads below only
+    // insert into their own attribute's list
+    attribute_dict_.Resize(attribute_number_);
+    size_t first = attribute_rows_;
+    ReserveAttributes(std::max(first + attributes.size(), attribute_capacity_),
+                      AttributeStride(attribute_number_));
+    attribute_rows_ = first + attributes.size();
+
+    // every attribute has its own table, so columns are coded in parallel
+    // and each one still sees the nodes in order: codes match the per-node
+    // calls
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned i = 0; i < n_attr; i++)
+    {
+      bool collide = false;
+      for (size_t n = 0; n < attributes.size(); n++)
       {
-        if (attributes[i] == attributes_code[i][j])
-        {
-          tmp.push_back(j);
-          flag--;
-          break;
-        }
+        int code = attribute_dict_.Insert(i, attributes[n][i]);
+        collide |= code == 256;
+        NodeAttributes(first + n)[i] = (char)code;
       }
-      if (flag)
+      if (collide)
       {
-        tmp.push_back(attributes_code[i].size());
-        attributes_code[i].push_back(attributes[i]);
+#pragma omp critical
+        std::cout << "warning: attribute " << i << " has more than 256 values, codes collide" << std::endl;
       }
     }
-    //attributes_[s] = tmp;
-    attributes_.push_back(tmp);
   }
 
-  bool IndexGraph::SaveAttributeTable(const std::string &fname) const
+  void IndexGraph::ReserveAttributes(size_t rows, unsigned stride)
   {
-    std::ofstream b_stream(fname.c_str());
-    if (b_stream)
-    {
-      for (int i = 0; i < attribute_number_; i++)
-      {
-        for (int j = 0; j < attributes_code[i].size(); j++)
-        {
-          b_stream << attributes_code[i][j] << " ";
-        }
-        b_stream << std::endl;
-      }
+    if (rows <= attribute_capacity_ && stride == attribute_stride_)
+      return;
+    size_t capacity = std::max(rows, attribute_capacity_);
+    size_t size = (capacity * stride + _CACHE_LINE - 1) / _CACHE_LINE * _CACHE_LINE;
+    char *block = (char *)memalign(_CACHE_LINE, size);
+    std::memset(block, 0, size);
+    unsigned keep = std::min(stride, attribute_stride_);
+    for (size_t i = 0; i < attribute_rows_; i++)
+      std::memcpy(block + i * stride, NodeAttributes(i), keep);
+    free(attributes_);
+    attributes_ = block;
+    attribute_capacity_ = capacity;
+    attribute_stride_ = stride;
+  }
 
-      return (b_stream.good());
-    }
-    else
+  void IndexGraph::ReleaseAttributes()
+  {
+    free(attributes_);
+    attributes_ = nullptr;
+    attribute_rows_ = attribute_capacity_ = 0;
+  }
+
+  bool IndexGraph::SaveAttributeTable(const std::string &fname) const
+  {
+    if (!attribute_dict_.Save(fname))
     {
       throw std::runtime_error("[Error] Failed to save table to file: " + fname);
     }
-    return false;
+    return true;
   }
 
-  bool IndexGraph::LoadAttributeTable(const std::string &fname)
+  bool IndexGraph::LoadAttributeTable(const std::string &fname, bool use_mmap)
   {
-    std::ifstream in;
-    in.open(fname);
-    if (in.is_open())
-    {
-      std::vector<std::vector<std::string>> v(attribute_number_);
-      std::string s;
-      const std::string c = " ";
-      int query_attributes_count = 0;
-      while (getline(in, s))
-      {
-        //const char *a = s.c_str();
-        std::string::size_type pos1, pos2;
-        pos2 = s.find(c);
-        pos1 = 0;
-        while (std::string::npos != pos2)
-        {
-          v[query_attributes_count].emplace_back(s.substr(pos1, pos2 - pos1));
-          pos1 = pos2 + c.size();
-          pos2 = s.find(c, pos1);
-        }
-        if (pos1 != s.length())
-          v[query_attributes_count].emplace_back(s.substr(pos1));
-        query_attributes_count++;
-      }
-      for (int i = 0; i < attribute_number_; i++)
-      {
-        attributes_code.emplace_back(v[i]);
-      }
-      in.close();
-    }
-    else
+    if (!attribute_dict_.Load(fname, use_mmap))
     {
       throw std::runtime_error("[Error] Failed to load table to file: " + fname + " not found!");
     }
-
-    for (int i = 0; i < attributes_code.size(); i++)
+    if (attribute_dict_.AttributeNumber() != (unsigned)attribute_number_)
     {
-      for (int j = 0; j < attributes_code[i].size(); j++)
-      {
-        std::cout << attributes_code[i][j] << "|";
-      }
-      std::cout << std::endl;
+      std::cout << "attribute table has " << attribute_dict_.AttributeNumber()
+                << " attributes, index has " << attribute_number_ << std::endl;
     }
+    attribute_dict_.PrintSummary();
     return true;
   }
 
-  void IndexGraph::fusion_distance(float &dist, float &cnt)
+  void IndexGraph::SetFusion(const Parameters &parameters)
   {
-    // dist = cnt * dist * 2 / (cnt + dist); //w_x=cnt/(dist + cnt), w_y=dist/(dist + cnt)
-    // cnt *= 100; // w_x=cnt*/(dist + cnt*), w_y=dist/(dist + cnt*)
-    // if(cnt == 0) cnt = 1;
-    // dist = cnt * dist * 2/(cnt + dist);
-    // dist = dist / 521675 + float(cnt) / 3.0;  // w_x=1/dist_max, w_y=1/cnt_max
-    dist += dist * cnt / (float)attribute_number_;  //w_x=1, w_y=dist/cnt_max
-    // dist += 10000 * cnt; //w_x/w_y=c, and c is a constant
+    fusion_policy_ = ParseFusionPolicy(parameters.Get<std::string>("fusion", "multiplicative"));
+    fusion_weight_ = parameters.Get<float>("fusion_weight", 1);
+    fusion_weights_.assign(attribute_stride_, 0);
+    std::fill(fusion_weights_.begin(), fusion_weights_.begin() + attribute_number_, 1.0f);
+    std::stringstream weights(parameters.Get<std::string>("fusion_weights", ""));
+    std::string w;
+    for (int k = 0; k < attribute_number_ && std::getline(weights, w, ','); k++)
+      fusion_weights_[k] = std::stof(w);
+    UpdateFusion();
+  }
+
+  AttributeFusion IndexGraph::MakeFusion(FusionPolicy policy, float weight) const
+  {
+    AttributeFusion fusion;
+    fusion.policy = policy;
+    fusion.weight = weight;
+    fusion.attribute_number = (float)attribute_number_;
+    fusion.weights = fusion_weights_.data();
+    return fusion;
+  }
+
+  void IndexGraph::UpdateFusion()
+  {
+    if (fusion_weights_.size() != attribute_stride_)
+    {
+      fusion_weights_.resize(attribute_stride_, 1.0f);
+      std::fill(fusion_weights_.begin() + std::min((unsigned)attribute_number_, attribute_stride_),
+                fusion_weights_.end(), 0.0f);
+    }
+    build_fusion_ = MakeFusion(fusion_policy_, fusion_weight_);
   }
 }
@@ -40,10 +40,11 @@ int main(int argc, char **argv)
 	int PL;
 	float B;
 	float M;
+	efanna2e::Metric metric = efanna2e::L2;
 
     // Parse arguments
-    if (argc != 13) {
-        fprintf(stderr, "Usage: %s <path_database_vectors> <path_database_attributes> <path_index> <K> <L> <iter> <S> <R> <Range> <PL> <B> <M>\n", argv[0]);
+    if (argc != 13 && argc != 14) {
+        fprintf(stderr, "Usage: %s <path_database_vectors> <path_database_attributes> <path_index> <K> <L> <iter> <S> <R> <Range> <PL> <B> <M> [<metric: l2|ip|cosine>]\n", argv[0]);
         exit(1);
     }
 
@@ -60,6 +61,17 @@ int main(int argc, char **argv)
 	PL = atoi(argv[10]);
 	B = atof(argv[11]);
 	M = atof(argv[12]);
+	if (argc == 14) {
+		std::string name = argv[13];
+		if (name == "ip")
+			metric = efanna2e::INNER_PRODUCT;
+		else if (name == "cosine")
+			metric = efanna2e::COSINE;
+		else if (name != "l2") {
+			fprintf(stderr, "Unknown metric: %s\n", argv[13]);
+			exit(1);
+		}
+	}
 	
 	// Use as many threads as available
 	omp_set_num_threads(nthreads);
@@ -82,7 +94,7 @@ int main(int argc, char **argv)
 
 	// Initialize and configure the NHQ-kgraph index
 	efanna2e::IndexRandom init_index(d, n_items);
-	efanna2e::IndexGraph nhq_index(d, n_items, efanna2e::L2, (efanna2e::Index *)(&init_index));
+	efanna2e::IndexGraph nhq_index(d, n_items, metric, (efanna2e::Index *)(&init_index));
 	efanna2e::Parameters paras;
 	paras.Set<unsigned>("K", K);
 	paras.Set<unsigned>("L", L);
@@ -96,9 +108,7 @@ int main(int argc, char **argv)
 
 	// Build the index (this part is timed)
 	auto start_time = std::chrono::high_resolution_clock::now();	
-	for (int i = 0; i < n_items; i++){
-		nhq_index.AddAllNodeAttributes(database_attributes_str[i]);
-	}
+	nhq_index.AddAllNodeAttributes(database_attributes_str);
 	nhq_index.Build(n_items, database_vectors, paras);
 	auto end_time = std::chrono::high_resolution_clock::now();
 
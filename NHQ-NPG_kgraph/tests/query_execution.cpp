@@ -6,6 +6,7 @@
 #include "efanna2e/util.h"
 
 #include <atomic>
+#include <unordered_map>
 #include <omp.h>
 #include "fanns_survey_helpers.cpp"
 #include "global_thread_counter.h"
@@ -16,9 +17,6 @@ using namespace std;
 std::atomic<int> peak_threads(1);
 
 int main(int argc, char **argv){
-    // Restrict number of threads to 1 for query execution
-    omp_set_num_threads(1);
-
     // Monitor thread count
     std::atomic<bool> done(false);
     std::thread monitor(monitor_thread_count, std::ref(done));
@@ -32,11 +30,15 @@ int main(int argc, char **argv){
     int k;
     int weight_search;
     int L_search;
+    int n_threads = 1;
+    unsigned search_group = 0;
+    unsigned search_interleave = 0;
+    efanna2e::Metric metric = efanna2e::FAST_L2;
 
     // Check if the number of arguments is correct
-    if (argc != 9)
+    if (argc < 9 || argc > 13)
     {
-        fprintf(stderr, "Usage: %s <path_database_vectors> <path_query_vectors> <path_query_attributes> <path_groundtruth> <path_index> <k> <weight_search> <L_search>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <path_database_vectors> <path_query_vectors> <path_query_attributes> <path_groundtruth> <path_index> <k> <weight_search> <L_search> [<n_threads> [<metric: l2|ip|cosine> [<search_group> [<search_interleave>]]]]\n", argv[0]);
         exit(1);
     }
 
@@ -49,6 +51,29 @@ int main(int argc, char **argv){
     k = atoi(argv[6]);
     weight_search = atoi(argv[7]);
 	L_search = atoi(argv[8]);
+	if (argc >= 10)
+		n_threads = atoi(argv[9]);
+	// must match the metric the index was built with
+	if (argc >= 11) {
+		std::string name = argv[10];
+		if (name == "ip")
+			metric = efanna2e::INNER_PRODUCT;
+		else if (name == "cosine")
+			metric = efanna2e::COSINE;
+		else if (name != "l2") {
+			fprintf(stderr, "Unknown metric: %s\n", argv[10]);
+			exit(1);
+		}
+	}
+	// queries sharing a filter walk the graph together in groups of this size
+	if (argc >= 12)
+		search_group = atoi(argv[11]);
+	// queries each thread interleaves to overlap their memory stalls
+	if (argc == 13)
+		search_interleave = atoi(argv[12]);
+
+	// Restrict number of threads for query execution (1 by default)
+	omp_set_num_threads(n_threads);
 
 	// Setting seed
 	unsigned seed = 161803398;
@@ -90,7 +115,7 @@ int main(int argc, char **argv){
 
 	// Load NHQ index
 	efanna2e::IndexRandom init_index(d, n_items);
-	efanna2e::IndexGraph nhq_index(d, n_items, efanna2e::FAST_L2, (efanna2e::Index *)(&init_index));
+	efanna2e::IndexGraph nhq_index(d, n_items, metric, (efanna2e::Index *)(&init_index));
     std::string index_path_model = path_index + "_model";
     std::string index_path_attribute_table = path_index + "_attribute_table";
 	nhq_index.Load(index_path_model.c_str());
@@ -105,6 +130,8 @@ int main(int argc, char **argv){
 	efanna2e::Parameters paras;
 	paras.Set<unsigned>("L_search", L_search);
 	paras.Set<float>("weight_search", weight_search);
+	paras.Set<unsigned>("search_group", search_group);
+	paras.Set<unsigned>("search_interleave", search_interleave);
 
 	// Prepare results
 	std::vector<std::vector<unsigned>> result(n_queries);
@@ -114,9 +141,26 @@ int main(int argc, char **argv){
 
 	// Perform the search (this is timed)
 	auto start_time = std::chrono::high_resolution_clock::now();
+	// Query plans are resolved once per distinct filter value
+	std::unordered_map<int, efanna2e::HybridQueryPlan> plan_cache;
+	std::vector<efanna2e::HybridQueryPlan> plans(n_queries);
 	for (unsigned i = 0; i < n_queries; i++)
 	{
-		nhq_index.SearchWithOptGraph(query_attributes_str[i], query_vectors + i * d, k, paras, result[i].data());
+		auto plan = plan_cache.find(query_attributes[i]);
+		if (plan == plan_cache.end())
+			plan = plan_cache.emplace(query_attributes[i], nhq_index.MakeQueryPlan(query_attributes_str[i], k, paras)).first;
+		plans[i] = plan->second;
+	}
+	if (n_threads == 1 && search_group <= 1 && search_interleave <= 1)
+	{
+		for (unsigned i = 0; i < n_queries; i++)
+		{
+			nhq_index.SearchWithOptGraph(plans[i], query_vectors + i * d, result[i].data());
+		}
+	}
+	else
+	{
+		nhq_index.BatchSearchWithOptGraph(query_vectors, plans, result, n_threads);
 	}
 	auto end_time = std::chrono::high_resolution_clock::now();
 
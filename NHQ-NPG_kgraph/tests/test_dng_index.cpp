@@ -111,10 +111,7 @@ int main(int argc, char **argv)
 
   efanna2e::IndexRandom init_index(dim, points_num);
   efanna2e::IndexGraph index(dim, points_num, efanna2e::L2, (efanna2e::Index *)(&init_index));
-  for (int i = 0; i < points_num; i++)
-  {
-    index.AddAllNodeAttributes(label_data[i]);
-  }
+  index.AddAllNodeAttributes(label_data);
   efanna2e::Parameters paras;
   paras.Set<unsigned>("K", atoi(argv[5]));
   paras.Set<unsigned>("L", atoi(argv[6]));
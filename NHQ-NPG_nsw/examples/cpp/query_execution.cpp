@@ -9,6 +9,7 @@
 #include <chrono>
 #include <sstream>
 #include <fstream>
+#include <unordered_map>
 
 #include <atomic>
 #include <omp.h>
@@ -92,11 +93,15 @@ int main(int argc, char **argv)
     index.SetConfigs(configs);
     vector<vector<pair<int, float>>> result(n_queries);
 
-	// Perform search query by query (timed)
+	// Perform search query by query (timed), resolving one plan per distinct filter
 	auto start_time = chrono::high_resolution_clock::now();
+	std::unordered_map<int, n2::HybridQueryPlan> plans;
     for (int i = 0; i < n_queries; i++)
 	{
-		index.SearchByVector_new(query_vectors[i], query_attributes_str[i], k, ef_search, result[i]);
+		auto plan = plans.find(query_attributes[i]);
+		if (plan == plans.end())
+			plan = plans.emplace(query_attributes[i], index.MakeQueryPlan(query_attributes_str[i], k, ef_search)).first;
+		index.SearchByVector_new(query_vectors[i], plan->second, result[i]);
 	}
 	auto end_time = chrono::high_resolution_clock::now();
 
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mmap.h"
+
+namespace n2 {
+
+// String <-> code table of every attribute. While a model is built it is a
+// list of values plus an unordered_map per attribute. Save() writes a binary
+// file with an open-addressing hash index per attribute, which Load() maps
+// in place, so query-time lookups are O(1) without any parsing. The old
+// space-separated text tables are still accepted by Load().
+class AttributeDictionary {
+public:
+    AttributeDictionary() = default;
+    AttributeDictionary(const AttributeDictionary&) = delete;
+    AttributeDictionary& operator=(const AttributeDictionary&) = delete;
+
+    void Resize(int n_attr);
+    int AttributeNumber() const;
+    // number of distinct values of attribute attr
+    size_t Size(int attr) const;
+    // code of value in attribute attr, -1 if it is unknown
+    int Find(int attr, const std::string& value) const;
+    // code of value, adding it if it is unknown
+    int Insert(int attr, const std::string& value);
+    std::string Value(int attr, int code) const;
+
+    bool Save(const std::string& fname) const;
+    bool Load(const std::string& fname, bool use_mmap = true);
+    void Clear();
+    void PrintSummary() const;
+
+private:
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t n_attr;
+        uint32_t reserved;
+    };
+    // byte offsets are relative to the start of the file
+    struct Section {
+        uint64_t offsets;  // uint32_t[n_values + 1] into the string blob
+        uint64_t strings;
+        uint64_t table;    // uint32_t[table_size], code + 1 or 0 for empty
+        uint32_t n_values;
+        uint32_t table_size;
+    };
+
+    bool LoadText(const std::string& fname);
+    void Materialize();
+    static uint64_t Hash(const char* s, size_t len);
+    inline bool IsMapped() const { return base_ != nullptr; }
+
+    std::vector<std::vector<std::string>> values_;
+    std::vector<std::unordered_map<std::string, int>> index_;
+
+    const char* base_ = nullptr;
+    const Section* sections_ = nullptr;
+    int n_mapped_ = 0;
+    std::unique_ptr<Mmap> map_;
+    std::vector<char> buffer_;
+};
+
+} // namespace n2
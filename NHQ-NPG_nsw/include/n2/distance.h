@@ -7,13 +7,50 @@
   #define PORTABLE_ALIGN32 __declspec(align(32))
 #endif
 
+#include <immintrin.h>
+
 namespace n2 {
 
+// Attribute codes are kept in zero-padded rows of AttributeStride(n) bytes,
+// so CountMismatch compares whole SIMD lanes and the padding never differs.
+inline int AttributeStride(int n) {
+    if (n <= 16) return 16;
+    if (n <= 32) return 32;
+    return (n + 63) & ~63;
+}
+
+inline int CountMismatch(const char* a, const char* b, int width) {
+    int cnt = 0;
+    int i = 0;
+#ifdef __AVX512BW__
+    for (; i + 64 <= width; i += 64) {
+        __mmask64 eq = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        cnt += 64 - __builtin_popcountll(eq);
+    }
+#endif
+#ifdef __AVX2__
+    for (; i + 32 <= width; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                       _mm256_loadu_si256((const __m256i*)(b + i)));
+        cnt += 32 - __builtin_popcount((unsigned)_mm256_movemask_epi8(eq));
+    }
+#endif
+    for (; i + 16 <= width; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                    _mm_loadu_si128((const __m128i*)(b + i)));
+        cnt += 16 - __builtin_popcount((unsigned)_mm_movemask_epi8(eq));
+    }
+    return cnt;
+}
+
 class BaseDistance {
     public:
     BaseDistance() {}
     virtual ~BaseDistance() = 0;
     virtual float Evaluate(const float* __restrict pVect1, const float*  __restrict pVect2, size_t qty, float  *  __restrict TmpRes) const = 0;
+    // out[j] = Evaluate(queries[j], pVect2) for the n queries; overrides
+    // load pVect2 once per four queries
+    virtual void EvaluateMany(const float* const* queries, size_t n, const float* __restrict pVect2, size_t qty, float* __restrict out, float* __restrict TmpRes) const;
 };
 
 class L2Distance : public BaseDistance {
@@ -21,6 +58,7 @@ class L2Distance : public BaseDistance {
    L2Distance() {}
    ~L2Distance() override {}
    float Evaluate(const float* __restrict pVect1, const float*  __restrict pVect2, size_t qty, float  *  __restrict TmpRes) const override;
+   void EvaluateMany(const float* const* queries, size_t n, const float* __restrict pVect2, size_t qty, float* __restrict out, float* __restrict TmpRes) const override;
 };
 
 class AngularDistance : public BaseDistance {
@@ -30,4 +68,13 @@ class AngularDistance : public BaseDistance {
    float Evaluate(const float* __restrict pVect1, const float*  __restrict pVect2, size_t qty, float  *  __restrict TmpRes) const override;
 };
 
+// -<a, b>, so that a larger inner product is nearer
+class InnerProductDistance : public BaseDistance {
+   public:
+   InnerProductDistance() {}
+   ~InnerProductDistance() override {}
+   float Evaluate(const float* __restrict pVect1, const float*  __restrict pVect2, size_t qty, float  *  __restrict TmpRes) const override;
+   void EvaluateMany(const float* const* queries, size_t n, const float* __restrict pVect2, size_t qty, float* __restrict out, float* __restrict TmpRes) const override;
+};
+
 } // namespace n2
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cfloat>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "distance.h"
+
+namespace n2 {
+
+// how an attribute mismatch is folded into a vector distance, chosen by the
+// "fusion" config when the graph is built and stored with the model
+enum class FusionPolicy {
+    MULTIPLICATIVE = 0,
+    ADDITIVE = 1,
+    WEIGHTED = 2,
+    MASK = 3
+};
+
+// Fused distance of a metric distance d and the attribute mismatch m:
+//   multiplicative  d + |d| * weight * m / attribute_number
+//   additive        d + weight * m
+//   weighted        d + weight * m, m summing weights[k] over mismatching k
+//   mask            d if m is 0, FLT_MAX otherwise
+// m counts the mismatching attributes except under "weighted". The default
+// adds no penalty at all.
+struct AttributeFusion {
+    FusionPolicy policy = FusionPolicy::ADDITIVE;
+    float weight = 0;
+    float attribute_number = 1;
+    // one per attribute byte, zero in the row padding; owned by the Hnsw
+    const float* weights = nullptr;
+
+    inline float Apply(float d, float m) const {
+        switch (policy) {
+        case FusionPolicy::MULTIPLICATIVE:
+            // |d|, so mismatches still push away under the signed inner-product distance
+            return d + std::fabs(d) * (weight * m) / attribute_number;
+        case FusionPolicy::MASK:
+            return m > 0 ? FLT_MAX : d;
+        default:
+            return d + weight * m;
+        }
+    }
+    bool operator==(const AttributeFusion& other) const {
+        return policy == other.policy && weight == other.weight &&
+               attribute_number == other.attribute_number && weights == other.weights;
+    }
+};
+
+// sum of weights[i] over the bytes where a and b differ; width is a
+// multiple of 16
+inline float WeightedMismatch(const char* a, const char* b, int width, const float* weights) {
+    float sum = 0;
+    for (int i = 0; i < width; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                    _mm_loadu_si128((const __m128i*)(b + i)));
+        unsigned diff = ~(unsigned)_mm_movemask_epi8(eq) & 0xffff;
+        for (; diff; diff &= diff - 1) sum += weights[i + __builtin_ctz(diff)];
+    }
+    return sum;
+}
+
+// "multiplicative", "additive", "weighted" or "mask", or their number
+inline FusionPolicy ParseFusionPolicy(const std::string& name) {
+    static const char* names[] = {"multiplicative", "additive", "weighted", "mask"};
+    for (int i = 0; i < 4; i++) {
+        if (name == names[i] || name == std::to_string(i)) return (FusionPolicy)i;
+    }
+    throw std::runtime_error("[Error] Invalid configuration value for fusion: " + name);
+}
+
+} // namespace n2
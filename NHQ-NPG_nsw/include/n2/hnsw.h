@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -13,7 +14,9 @@
 
 #include "base.h"
 #include "mmap.h"
+#include "attribute_dictionary.h"
 #include "distance.h"
+#include "fusion.h"
 #include "sort.h"
 #include "heuristic.h"
 #include <boost/heap/d_ary_heap.hpp>
@@ -52,6 +55,96 @@ namespace n2
         unsigned int mark_;
     };
 
+    // Member masks of a grouped search for the nodes it has touched, in an
+    // open-addressing table cleared in the time of the nodes touched rather
+    // than kept for every node of the model.
+    class GroupMasks
+    {
+    public:
+        struct Entry
+        {
+            int id;
+            uint16_t scored; // members that scored the node, bit j for member j
+            uint16_t wanted; // members that want it scored in the current round
+        };
+
+        void Reset()
+        {
+            for (size_t s : used_)
+                slots_[s].id = kEmpty;
+            used_.clear();
+        }
+        // entry of id, zeroed the first time id is asked for since Reset();
+        // the reference is valid until the next call
+        inline Entry &Get(int id)
+        {
+            if (2 * (used_.size() + 1) > slots_.size())
+                Grow();
+            size_t mask = slots_.size() - 1;
+            for (size_t s = ((uint32_t)id * 0x9E3779B1u) >> shift_;; s = (s + 1) & mask)
+            {
+                Entry &e = slots_[s];
+                if (e.id == id)
+                    return e;
+                if (e.id == kEmpty)
+                {
+                    e.id = id;
+                    e.scored = 0;
+                    e.wanted = 0;
+                    used_.push_back(s);
+                    return e;
+                }
+            }
+        }
+
+    private:
+        static const int kEmpty = -1;
+
+        void Grow()
+        {
+            std::vector<Entry> old;
+            std::vector<size_t> used;
+            old.swap(slots_);
+            used.swap(used_);
+            size_t capacity = old.empty() ? 1024 : 2 * old.size();
+            Entry empty = {kEmpty, 0, 0};
+            slots_.assign(capacity, empty);
+            shift_ = 32;
+            for (size_t c = capacity; c > 1; c >>= 1)
+                shift_--;
+            for (size_t s : used)
+            {
+                Entry &e = Get(old[s].id);
+                e.scored = old[s].scored;
+                e.wanted = old[s].wanted;
+            }
+        }
+
+        std::vector<Entry> slots_;
+        std::vector<size_t> used_;
+        unsigned shift_ = 32;
+    };
+
+    // queries of one Hnsw::BatchSearchByVector group, bounded by the width
+    // of its per-node member masks
+    const size_t kMaxSearchGroup = 16;
+
+    // Per-query search inputs resolved once by Hnsw::MakeQueryPlan, so the
+    // hot path neither parses configs nor looks up attribute strings.
+    struct HybridQueryPlan
+    {
+        std::vector<char> attribute; // codes padded to the model's stride; empty if unresolved
+        size_t k = 0;
+        int ef_search = -1;
+        // how attribute mismatches are folded into the distance; the default
+        // adds no penalty
+        AttributeFusion fusion;
+        // return only exact attribute matches, raising the penalty until k
+        // are found or strict_budget distances (<= 0: all nodes) are spent
+        bool strict = false;
+        int strict_budget = 0;
+    };
+
     class Hnsw
     {
     public:
@@ -75,6 +168,8 @@ namespace n2
         };
         typedef typename boost::heap::d_ary_heap<float, boost::heap::arity<4>> DistanceMaxHeap;
         Hnsw();
+        // metric: "L2" / "euclidean", "angular" / "cosine", or "dot" /
+        // "inner_product" (distance -<q, x>)
         Hnsw(int dim, std::string metric = "angular");
         Hnsw(const Hnsw &other);
         Hnsw(Hnsw &other);
@@ -114,12 +209,30 @@ namespace n2
 
         //llw
         bool SaveAttributeTable(const std::string &fname) const;
-        bool LoadAttributeTable(const std::string &fname);
+        bool LoadAttributeTable(const std::string &fname, bool use_mmap = true);
         int data_num() { return data_.size(); }
         int attributes_num() { return attributes_.size(); }
         int SearchByVector_nang(const std::vector<float> &qvec, std::vector<std::string> attributes, size_t k, int ef_search,
                                 std::vector<int> &result);
         int SearchByVector_new(const std::vector<float> &qvec, std::vector<char> attribute, size_t k, int ef_search, std::vector<std::pair<int, float>> &result);
+        HybridQueryPlan MakeQueryPlan(const std::vector<std::string> &attributes, size_t k, int ef_search) const;
+        int SearchByVector_new(const std::vector<float> &qvec, const HybridQueryPlan &plan, std::vector<std::pair<int, float>> &result);
+        // Every item whose fused distance to qvec (metric distance and
+        // attribute mismatch under the plan's fusion) is at most radius,
+        // nearest first. ef_search bounds only the candidates kept beyond the radius.
+        // Returns the number of distance computations.
+        int RangeSearchByVector(const std::vector<float> &qvec, std::vector<std::string> attributes, float radius, int ef_search,
+                                std::vector<std::pair<int, float>> &result);
+        int RangeSearchByVector(const std::vector<float> &qvec, const HybridQueryPlan &plan, float radius, std::vector<std::pair<int, float>> &result);
+        // Searches qvecs[i] with plans[i] for every i into results[i]. Up to
+        // group queries with the same attributes, k, ef_search and fusion walk
+        // the graph in lock-step: each round every query expands one node, and
+        // each node the round reaches is loaded once and scored for all the
+        // queries that reached it (group <= 1, and strict plans: one query at
+        // a time; at most kMaxSearchGroup). Returns the number of distance
+        // computations.
+        int BatchSearchByVector(const std::vector<std::vector<float>> &qvecs, const std::vector<HybridQueryPlan> &plans,
+                                size_t group, std::vector<std::vector<std::pair<int, float>>> &results);
         void statistic()
         {
             int sum = 0;
@@ -274,12 +387,31 @@ namespace n2
         void Link(HnswNode *source, HnswNode *target, bool is_naive, size_t dim);
         void SearchAtLayer(const std::vector<float> &qvec, HnswNode *enterpoint, size_t ef, std::priority_queue<FurtherFirst> &result, HnswNode *qnode);
 
+        int StrictSearchByVector_(const std::vector<float> &qvec, const HybridQueryPlan &plan, std::vector<std::pair<int, float>> &result);
+        // SearchByVector_new for n queries sharing plan, in lock-step; the
+        // results are those of searching them one by one
+        int GroupSearchByVector_(const std::vector<float> *const *qvecs, size_t n, const HybridQueryPlan &plan,
+                                 std::vector<std::pair<int, float>> *const *results);
         void SearchById_(int cur_node_id, float cur_dist, const float *query_vec,
                          size_t k, size_t ef_search,
                          std::vector<std::pair<int, float>> &result);
 
         bool SetValuesFromModel(char *model);
         void NormalizeVector(std::vector<float> &vec);
+        // Distance from a raw query to the stored vectors. ANGULAR models
+        // hold unit vectors, so 1 - cos is 1 - <q, x> / |q|: the query is
+        // scaled inside the distance instead of normalized into a copy.
+        struct QueryDistance
+        {
+            const BaseDistance *dist;
+            float scale;
+            float offset;
+            inline float Evaluate(const float *q, const float *x, size_t qty, float *TmpRes) const
+            {
+                return offset + scale * dist->Evaluate(q, x, qty, TmpRes);
+            }
+        };
+        QueryDistance MakeQueryDistance(const std::vector<float> &qvec) const;
         //void MergeEdgesOfTwoGraphs(const std::vector<HnswNode*>& another_nodes);
         size_t GetModelConfigSize();
         void SaveModelConfig(char *model);
@@ -296,12 +428,54 @@ namespace n2
             return ptr + sizeof(T);
         }
 
-        std::vector<char> Attribute2int(std::vector<std::string> str);
+        std::vector<char> Attribute2int(std::vector<std::string> str) const;
+        int ModelAttributeStride(size_t data_dim) const;
+        inline int AttributeMismatch(const char *a, const char *b) const
+        {
+            if (attribute_stride_ > 0)
+                return CountMismatch(a, b, attribute_stride_);
+            int cnt = 0;
+            for (int i = 0; i < attribute_number_; i++)
+            {
+                if (a[i] != b[i])
+                    cnt++;
+            }
+            return cnt;
+        }
+        // mismatch of two attribute rows as fusion weighs it
+        inline float FusedMismatch(const AttributeFusion &fusion, const char *a, const char *b) const
+        {
+            if (fusion.policy != FusionPolicy::WEIGHTED)
+                return AttributeMismatch(a, b);
+            if (attribute_stride_ > 0)
+                return WeightedMismatch(a, b, attribute_stride_, fusion.weights);
+            float sum = 0;
+            for (int i = 0; i < attribute_number_; i++)
+            {
+                if (a[i] != b[i])
+                    sum += fusion.weights[i];
+            }
+            return sum;
+        }
+        AttributeFusion MakeFusion(FusionPolicy policy, float weight) const;
+        // the fusion of a query plan: "search_fusion" if set, else additive
+        // with "weight_search" if set, else the one the graph was built with
+        AttributeFusion MakeSearchFusion() const;
+        // fits the fusion weights to the attribute rows and sets build_fusion_
+        void UpdateFusion();
+        // The build's fusion follows the level-0 section, so that models
+        // written before it still load (as multiplicative with weight 1,
+        // which they were built with).
+        size_t GetFusionConfigSize();
+        void SaveFusionConfig(char *ptr);
+        void LoadFusionConfig(char *ptr, long long size);
         void MakeSearchResult(size_t k, IdDistancePairMinHeap &candidates, IdDistancePairMinHeap &visited_nodes, std::vector<int> &result);
 
     private:
         std::shared_ptr<spdlog::logger> logger_;
         std::unique_ptr<VisitedList> search_list_;
+        // member masks of GroupSearchByVector_ for the nodes it touched
+        GroupMasks group_masks_;
 
         const std::string n2_signature = "TOROS_N2@N9R4";
         size_t M_ = 12;
@@ -310,6 +484,20 @@ namespace n2
         size_t efConstruction_ = 320;
         float weight_build = 1;
         float weight_search = 100;
+        bool weight_search_set_ = false;
+        // "fusion", "fusion_weight" and "fusion_weights" (comma separated,
+        // one per attribute, 1 if left out) of the build, stored with the
+        // model; "search_fusion" overrides the policy at search time
+        FusionPolicy fusion_policy_ = FusionPolicy::MULTIPLICATIVE;
+        float fusion_weight_ = 1;
+        std::vector<float> fusion_weights_;
+        bool search_fusion_set_ = false;
+        FusionPolicy search_fusion_policy_ = FusionPolicy::ADDITIVE;
+        // fusion_weights_ laid out over an attribute row, zero in the padding
+        std::vector<float> fusion_row_weights_;
+        AttributeFusion build_fusion_;
+        bool strict_filter_ = false;
+        int strict_budget_ = 0;
         float levelmult_ = 1 / log(1.0 * M_);
         int num_threads_ = 1;
         bool ensure_k_ = false;
@@ -317,6 +505,7 @@ namespace n2
         GraphPostProcessing post_ = GraphPostProcessing::SKIP;
 
         BaseDistance *dist_cls_ = nullptr;
+        InnerProductDistance dot_dist_;
         BaseNeighborSelectingPolicies *selecting_policy_cls_ = new HeuristicNeighborSelectingPolicies(false);
         BaseNeighborSelectingPolicies *post_policy_cls_ = new HeuristicNeighborSelectingPolicies(true);
         std::uniform_real_distribution<double> uniform_distribution_{0.0, 1.0};
@@ -325,11 +514,13 @@ namespace n2
 
         int maxlevel_ = 0;
         int attribute_number_ = 3;
+        // padded attribute row width, 0 for models with unpadded rows
+        int attribute_stride_ = AttributeStride(3);
         HnswNode *enterpoint_ = nullptr;
         int enterpoint_id_ = 0;
         std::vector<Data> data_;
         std::map<int, std::vector<char>> attributes_;
-        std::vector<std::vector<std::string>> attributes_code;
+        AttributeDictionary attribute_dict_;
         //int all_id_number_;
         //std::map<int,std::vector<std::string>> id_attribute_;
         //std::map<int,std::vector<std::string>> node_attributes_;
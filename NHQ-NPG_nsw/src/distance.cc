@@ -12,6 +12,11 @@ BaseDistance::~BaseDistance() {
 
 }
 
+void BaseDistance::EvaluateMany(const float* const* queries, size_t n, const float* __restrict pVect2, size_t qty, float* __restrict out, float* __restrict TmpRes) const {
+    for (size_t j = 0; j < n; ++j)
+        out[j] = Evaluate(queries[j], pVect2, qty, TmpRes);
+}
+
 float L2Distance::Evaluate(const float* __restrict pVect1, const float*  __restrict pVect2, size_t qty, float  *  __restrict TmpRes) const {
     size_t qty4  = qty/4;
     size_t qty16 = qty/16;
@@ -64,6 +69,35 @@ float L2Distance::Evaluate(const float* __restrict pVect1, const float*  __restr
     return res;
 }
 
+// Four queries at a time: each 4-float chunk of pVect2 is loaded once and
+// reused for all of them. The chunks are summed in the order Evaluate sums
+// them, so the results are the same floats.
+void L2Distance::EvaluateMany(const float* const* queries, size_t n, const float* __restrict pVect2, size_t qty, float* __restrict out, float* __restrict TmpRes) const {
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m128 sum[4] = {_mm_set1_ps(0), _mm_set1_ps(0), _mm_set1_ps(0), _mm_set1_ps(0)};
+        size_t i = 0;
+        for (; i + 4 <= qty; i += 4) {
+            __m128 v2 = _mm_loadu_ps(pVect2 + i);
+            for (int r = 0; r < 4; ++r) {
+                __m128 diff = _mm_sub_ps(_mm_loadu_ps(queries[j + r] + i), v2);
+                sum[r] = _mm_add_ps(sum[r], _mm_mul_ps(diff, diff));
+            }
+        }
+        for (int r = 0; r < 4; ++r) {
+            _mm_store_ps(TmpRes, sum[r]);
+            float res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3];
+            for (size_t t = i; t < qty; ++t) {
+                float diff = queries[j + r][t] - pVect2[t];
+                res += diff * diff;
+            }
+            out[j + r] = res;
+        }
+    }
+    for (; j < n; ++j)
+        out[j] = Evaluate(queries[j], pVect2, qty, TmpRes);
+}
+
 float AngularDistance::Evaluate(const float* __restrict pVect1, const float*  __restrict pVect2, size_t qty, float  *  __restrict TmpRes) const {
 #ifdef USE_AVX
     size_t qty16 = qty / 16;
@@ -140,4 +174,113 @@ float AngularDistance::Evaluate(const float* __restrict pVect1, const float*  __
 #endif
 }
 
+float InnerProductDistance::Evaluate(const float* __restrict pVect1, const float*  __restrict pVect2, size_t qty, float  *  __restrict TmpRes) const {
+#ifdef USE_AVX
+    size_t qty16 = qty / 16;
+    size_t qty4 = qty / 4;
+
+    const float* pEnd1 = pVect1 + 16 * qty16;
+    const float* pEnd2 = pVect1 + 4 * qty4;
+    const float* pEnd3 = pVect1 + qty;
+
+    __m256  sum256 = _mm256_set1_ps(0);
+
+    while (pVect1 < pEnd1) {
+        __m256 v1 = _mm256_loadu_ps(pVect1); pVect1 += 8;
+        __m256 v2 = _mm256_loadu_ps(pVect2); pVect2 += 8;
+        sum256 = _mm256_add_ps(sum256, _mm256_mul_ps(v1, v2));
+
+        v1 = _mm256_loadu_ps(pVect1); pVect1 += 8;
+        v2 = _mm256_loadu_ps(pVect2); pVect2 += 8;
+        sum256 = _mm256_add_ps(sum256, _mm256_mul_ps(v1, v2));
+    }
+
+    __m128  v1, v2;
+    __m128  sum_prod = _mm_add_ps(_mm256_extractf128_ps(sum256, 0), _mm256_extractf128_ps(sum256, 1));
+#else
+    size_t qty16 = qty / 16;
+    size_t qty4 = qty / 4;
+
+    const float* pEnd1 = pVect1 + 16 * qty16;
+    const float* pEnd2 = pVect1 + 4 * qty4;
+    const float* pEnd3 = pVect1 + qty;
+
+    __m128  v1, v2;
+    __m128  sum_prod = _mm_set1_ps(0);
+
+    while (pVect1 < pEnd1) {
+        v1 = _mm_loadu_ps(pVect1); pVect1 += 4;
+        v2 = _mm_loadu_ps(pVect2); pVect2 += 4;
+        sum_prod = _mm_add_ps(sum_prod, _mm_mul_ps(v1, v2));
+
+        v1 = _mm_loadu_ps(pVect1); pVect1 += 4;
+        v2 = _mm_loadu_ps(pVect2); pVect2 += 4;
+        sum_prod = _mm_add_ps(sum_prod, _mm_mul_ps(v1, v2));
+
+        v1 = _mm_loadu_ps(pVect1); pVect1 += 4;
+        v2 = _mm_loadu_ps(pVect2); pVect2 += 4;
+        sum_prod = _mm_add_ps(sum_prod, _mm_mul_ps(v1, v2));
+
+        v1 = _mm_loadu_ps(pVect1); pVect1 += 4;
+        v2 = _mm_loadu_ps(pVect2); pVect2 += 4;
+        sum_prod = _mm_add_ps(sum_prod, _mm_mul_ps(v1, v2));
+    }
+#endif
+
+    while (pVect1 < pEnd2) {
+        v1 = _mm_loadu_ps(pVect1); pVect1 += 4;
+        v2 = _mm_loadu_ps(pVect2); pVect2 += 4;
+        sum_prod = _mm_add_ps(sum_prod, _mm_mul_ps(v1, v2));
+    }
+
+    _mm_store_ps(TmpRes, sum_prod);
+    float sum = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3];
+
+    while (pVect1 < pEnd3) {
+        sum += *pVect1++ * *pVect2++;
+    }
+
+    return -sum;
+}
+
+// Four queries at a time, with the partial sums of Evaluate chunk for chunk
+// (eight-wide over the 16-float blocks under USE_AVX, then four-wide), so
+// every query gets the very float Evaluate would return.
+void InnerProductDistance::EvaluateMany(const float* const* queries, size_t n, const float* __restrict pVect2, size_t qty, float* __restrict out, float* __restrict TmpRes) const {
+    size_t qty16 = qty / 16 * 16;
+    size_t qty4 = qty / 4 * 4;
+    size_t j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m128 sum[4];
+        size_t i = 0;
+#ifdef USE_AVX
+        __m256 sum256[4] = {_mm256_set1_ps(0), _mm256_set1_ps(0), _mm256_set1_ps(0), _mm256_set1_ps(0)};
+        for (; i < qty16; i += 8) {
+            __m256 v2 = _mm256_loadu_ps(pVect2 + i);
+            for (int r = 0; r < 4; ++r)
+                sum256[r] = _mm256_add_ps(sum256[r], _mm256_mul_ps(_mm256_loadu_ps(queries[j + r] + i), v2));
+        }
+        for (int r = 0; r < 4; ++r)
+            sum[r] = _mm_add_ps(_mm256_extractf128_ps(sum256[r], 0), _mm256_extractf128_ps(sum256[r], 1));
+#else
+        for (int r = 0; r < 4; ++r)
+            sum[r] = _mm_set1_ps(0);
+#endif
+        for (; i < qty4; i += 4) {
+            __m128 v2 = _mm_loadu_ps(pVect2 + i);
+            for (int r = 0; r < 4; ++r)
+                sum[r] = _mm_add_ps(sum[r], _mm_mul_ps(_mm_loadu_ps(queries[j + r] + i), v2));
+        }
+        for (int r = 0; r < 4; ++r) {
+            _mm_store_ps(TmpRes, sum[r]);
+            float res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3];
+            for (size_t t = i; t < qty; ++t)
+                res += queries[j + r][t] * pVect2[t];
+            out[j + r] = -res;
+        }
+    }
+    for (; j < n; ++j)
+        out[j] = Evaluate(queries[j], pVect2, qty, TmpRes);
+}
+
 } // namespace n2
@@ -1,16 +1,20 @@
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
+#include <numeric>
 #include <queue>
+#include <sstream>
 #include <stdexcept>
 #include <iterator>
 #include <string>
 #include <unordered_set>
 #include <vector>
 #include <thread>
+#include <tuple>
 #include <xmmintrin.h>
 #include <random>
 
@@ -45,6 +49,21 @@ namespace n2
     
     thread_local VisitedList *visited_list_ = nullptr;
 
+    static BaseDistance *NewDistance(DistanceKind metric)
+    {
+        switch (metric)
+        {
+        case DistanceKind::ANGULAR:
+            return new AngularDistance();
+        case DistanceKind::L2:
+            return new L2Distance();
+        case DistanceKind::DOT:
+            return new InnerProductDistance();
+        default:
+            throw std::runtime_error("[Error] Unknown distance metric. ");
+        }
+    }
+
     Hnsw::Hnsw()
     {
         logger_ = spdlog::get("n2");
@@ -66,17 +85,20 @@ namespace n2
         if (metric == "L2" || metric == "euclidean")
         {
             metric_ = DistanceKind::L2;
-            dist_cls_ = new L2Distance();
         }
-        else if (metric == "angular")
+        else if (metric == "angular" || metric == "cosine")
         {
             metric_ = DistanceKind::ANGULAR;
-            dist_cls_ = new AngularDistance();
+        }
+        else if (metric == "dot" || metric == "inner_product")
+        {
+            metric_ = DistanceKind::DOT;
         }
         else
         {
             throw std::runtime_error("[Error] Invalid configuration value for DistanceMethod: " + metric);
         }
+        dist_cls_ = NewDistance(metric_);
     }
 
     Hnsw::Hnsw(const Hnsw &other)
@@ -91,14 +113,7 @@ namespace n2
         std::copy(other.model_, other.model_ + model_byte_size_, model_);
         SetValuesFromModel(model_);
         search_list_.reset(new VisitedList(num_nodes_));
-        if (metric_ == DistanceKind::ANGULAR)
-        {
-            dist_cls_ = new AngularDistance();
-        }
-        else if (metric_ == DistanceKind::L2)
-        {
-            dist_cls_ = new L2Distance();
-        }
+        dist_cls_ = NewDistance(metric_);
     }
 
     Hnsw::Hnsw(Hnsw &other)
@@ -113,14 +128,7 @@ namespace n2
         std::copy(other.model_, other.model_ + model_byte_size_, model_);
         SetValuesFromModel(model_);
         search_list_.reset(new VisitedList(num_nodes_));
-        if (metric_ == DistanceKind::ANGULAR)
-        {
-            dist_cls_ = new AngularDistance();
-        }
-        else if (metric_ == DistanceKind::L2)
-        {
-            dist_cls_ = new L2Distance();
-        }
+        dist_cls_ = NewDistance(metric_);
     }
 
     Hnsw::Hnsw(Hnsw &&other) noexcept
@@ -137,14 +145,7 @@ namespace n2
         other.model_mmap_ = nullptr;
         SetValuesFromModel(model_);
         search_list_.reset(new VisitedList(num_nodes_));
-        if (metric_ == DistanceKind::ANGULAR)
-        {
-            dist_cls_ = new AngularDistance();
-        }
-        else if (metric_ == DistanceKind::L2)
-        {
-            dist_cls_ = new L2Distance();
-        }
+        dist_cls_ = NewDistance(metric_);
     }
 
     Hnsw &Hnsw::operator=(const Hnsw &other)
@@ -172,14 +173,7 @@ namespace n2
         std::copy(other.model_, other.model_ + model_byte_size_, model_);
         SetValuesFromModel(model_);
         search_list_.reset(new VisitedList(num_nodes_));
-        if (metric_ == DistanceKind::ANGULAR)
-        {
-            dist_cls_ = new AngularDistance();
-        }
-        else if (metric_ == DistanceKind::L2)
-        {
-            dist_cls_ = new L2Distance();
-        }
+        dist_cls_ = NewDistance(metric_);
         return *this;
     }
 
@@ -214,14 +208,7 @@ namespace n2
         other.model_mmap_ = nullptr;
         SetValuesFromModel(model_);
         search_list_.reset(new VisitedList(num_nodes_));
-        if (metric_ == DistanceKind::ANGULAR)
-        {
-            dist_cls_ = new AngularDistance();
-        }
-        else if (metric_ == DistanceKind::L2)
-        {
-            dist_cls_ = new L2Distance();
-        }
+        dist_cls_ = NewDistance(metric_);
         return *this;
     }
 
@@ -349,8 +336,45 @@ namespace n2
             else if (c.first == "weight_search")
             {
                 weight_search = stof(c.second);
+                weight_search_set_ = true;
                 std::cout << "weight_search : " << weight_search << std::endl;
             }
+            else if (c.first == "fusion")
+            {
+                fusion_policy_ = ParseFusionPolicy(c.second);
+            }
+            else if (c.first == "fusion_weight")
+            {
+                fusion_weight_ = stof(c.second);
+            }
+            else if (c.first == "fusion_weights")
+            {
+                fusion_weights_.clear();
+                std::stringstream weights(c.second);
+                std::string w;
+                while (std::getline(weights, w, ','))
+                    fusion_weights_.push_back(stof(w));
+            }
+            else if (c.first == "search_fusion")
+            {
+                search_fusion_policy_ = ParseFusionPolicy(c.second);
+                search_fusion_set_ = true;
+            }
+            else if (c.first == "strict_filter")
+            {
+                if (c.second == "true")
+                {
+                    strict_filter_ = true;
+                }
+                else
+                {
+                    strict_filter_ = false;
+                }
+            }
+            else if (c.first == "strict_budget")
+            {
+                strict_budget_ = stoi(c.second);
+            }
             else
             {
                 throw std::runtime_error("[Error] Invalid configuration key: " + c.first);
@@ -410,6 +434,7 @@ namespace n2
         // if (default_rng_ == nullptr)
         //     default_rng_ = new std::default_random_engine(100);
         rng_.seed(rng_seed_);
+        UpdateFusion();
         BuildGraph(false);
         if (post_ == GraphPostProcessing::MERGE_LEVEL0)
         {
@@ -427,12 +452,12 @@ namespace n2
         enterpoint_id_ = enterpoint_->GetId();
         num_nodes_ = nodes_.size();
         long long model_config_size = GetModelConfigSize();
-        memory_per_data_ = sizeof(float) * data_dim_ + sizeof(char) * attribute_number_;
+        memory_per_data_ = sizeof(float) * data_dim_ + sizeof(char) * attribute_stride_;
         memory_per_link_level0_ = sizeof(int) * (1 + MaxM_); // 1" for saving num_links
         memory_per_node_level0_ = memory_per_link_level0_ + memory_per_data_;
         long long level0_size = memory_per_node_level0_ * data_.size();
 
-        model_byte_size_ = model_config_size + level0_size;
+        model_byte_size_ = model_config_size + level0_size + GetFusionConfigSize();
         model_ = new char[model_byte_size_];
         if (model_ == NULL)
         {
@@ -442,6 +467,7 @@ namespace n2
         model_level0_ = model_ + model_config_size;
 
         SaveModelConfig(model_);
+        SaveFusionConfig(model_level0_ + level0_size);
         int higher_offset = 0;
         for (size_t i = 0; i < nodes_.size(); ++i)
         {
@@ -546,16 +572,7 @@ namespace n2
 
         priority_queue<CloserFirst> candidates;
         float d = dist_cls_->Evaluate(qraw, (float *)&(enterpoint->GetData()[0]), data_dim_, TmpRes);
-        float d2 = 0;
-        for (int i = 0; i < attribute_number_; i++)
-        {
-            if (enterpoint->attributes_[i] != qnode->attributes_[i])
-                d2 += weight_build;
-        }
-        d += d * d2 / (weight_build * attribute_number_);
-        //if (d2 == 0)
-        //    d2++;
-        //d = d * d2 * 2 / (d + d2);
+        d = build_fusion_.Apply(d, FusedMismatch(build_fusion_, enterpoint->attributes_.data(), qnode->attributes_.data()));
 
         result.emplace(enterpoint, d);
         candidates.emplace(enterpoint, d);
@@ -587,16 +604,7 @@ namespace n2
                     _mm_prefetch((char *)&(neighbors[j]->GetData()), _MM_HINT_T0);
                     visited[fid] = mark;
                     d = dist_cls_->Evaluate(qraw, (float *)&neighbors[j]->GetData()[0], data_dim_, TmpRes);
-                    float d2 = 0;
-                    for (int k = 0; k < attribute_number_; k++)
-                    {
-                        if (qnode->attributes_[k] != neighbors[j]->attributes_[k])
-                            d2 += weight_build;
-                    }
-                    d += d * d2 / (weight_build * attribute_number_);
-                    //if (d2 == 0)
-                    //    d2++;
-                    //d = d * d2 * 2 / (d + d2);
+                    d = build_fusion_.Apply(d, FusedMismatch(build_fusion_, qnode->attributes_.data(), neighbors[j]->attributes_.data()));
                     if (result.size() < ef || result.top().GetDistance() > d)
                     {
                         result.emplace(neighbors[j], d);
@@ -643,17 +651,8 @@ namespace n2
 
             for (auto iter = neighbors.begin(); iter != neighbors.end(); ++iter)
             {
-                float d2 = 0;
-                for (int i = 0; i < attribute_number_; i++)
-                {
-                    if (source->attributes_[i] != (*iter)->attributes_[i])
-                        d2 += weight_build;
-                }
                 float d = dist_cls_->Evaluate((float *)&source->data_->GetData()[0], (float *)&(*iter)->GetData()[0], dim, TmpRes);
-                d += d * d2 / (weight_build * attribute_number_);
-                //if (d2 == 0)
-                //    d2++;
-                //d = d * d2 * 2 / (d + d2);
+                d = build_fusion_.Apply(d, FusedMismatch(build_fusion_, source->attributes_.data(), (*iter)->attributes_.data()));
                 tempres.emplace((*iter), d);
             }
             selecting_policy_cls_->Select(tempres.size() - 1, tempres, dim, dist_cls_);
@@ -668,72 +667,25 @@ namespace n2
 
     bool Hnsw::SaveAttributeTable(const std::string &fname) const
     {
-        ofstream b_stream(fname.c_str());
-        if (b_stream)
-        {
-            for (int i = 0; i < attribute_number_; i++)
-            {
-                for (int j = 0; j < attributes_code[i].size(); j++)
-                {
-                    b_stream << attributes_code[i][j] << " ";
-                }
-                b_stream << std::endl;
-            }
-
-            return (b_stream.good());
-        }
-        else
+        if (!attribute_dict_.Save(fname))
         {
             throw std::runtime_error("[Error] Failed to save table to file: " + fname);
         }
-        return false;
+        return true;
     }
 
-    bool Hnsw::LoadAttributeTable(const std::string &fname)
+    bool Hnsw::LoadAttributeTable(const std::string &fname, bool use_mmap)
     {
-        ifstream in;
-        in.open(fname);
-        if (in.is_open())
-        {
-            vector<vector<string>> v(attribute_number_);
-            string s;
-            const string c = " ";
-            int query_attributes_count = 0;
-            while (getline(in, s))
-            {
-                //const char *a = s.c_str();
-                string::size_type pos1, pos2;
-                pos2 = s.find(c);
-                pos1 = 0;
-                while (string::npos != pos2)
-                {
-                    v[query_attributes_count].emplace_back(s.substr(pos1, pos2 - pos1));
-                    pos1 = pos2 + c.size();
-                    pos2 = s.find(c, pos1);
-                }
-                if (pos1 != s.length())
-                    v[query_attributes_count].emplace_back(s.substr(pos1));
-                query_attributes_count++;
-            }
-            for (int i = 0; i < attribute_number_; i++)
-            {
-                attributes_code.emplace_back(v[i]);
-            }
-            in.close();
-        }
-        else
+        if (!attribute_dict_.Load(fname, use_mmap))
         {
             throw std::runtime_error("[Error] Failed to load table to file: " + fname + " not found!");
         }
-
-        for (int i = 0; i < attributes_code.size(); i++)
+        if (attribute_dict_.AttributeNumber() != attribute_number_)
         {
-            for (int j = 0; j < attributes_code[i].size(); j++)
-            {
-                std::cout << attributes_code[i][j] << "|";
-            }
-            std::cout << std::endl;
+            std::cout << "attribute table has " << attribute_dict_.AttributeNumber()
+                      << " attributes, model has " << attribute_number_ << std::endl;
         }
+        attribute_dict_.PrintSummary();
         return true;
     }
 
@@ -814,27 +766,19 @@ namespace n2
         std::cout << "level0_offset_:" << level0_offset_ << endl;
         ptr = GetValueAndIncPtr<int>(ptr, attribute_number_);
         std::cout << "attribute_number_:" << attribute_number_ << endl;
+        attribute_stride_ = ModelAttributeStride(data_dim_);
 
         long long level0_size = memory_per_node_level0_ * num_nodes_;
         long long model_config_size = GetModelConfigSize();
         model_level0_ = model_ + model_config_size;
+        LoadFusionConfig(model_level0_ + level0_size, model_byte_size_ - model_config_size - level0_size);
 
         search_list_.reset(new VisitedList(num_nodes_));
         if (dist_cls_)
         {
             delete dist_cls_;
         }
-        switch (metric_)
-        {
-        case DistanceKind::ANGULAR:
-            dist_cls_ = new AngularDistance();
-            break;
-        case DistanceKind::L2:
-            dist_cls_ = new L2Distance();
-            break;
-        default:
-            throw std::runtime_error("[Error] Unknown distance metric. ");
-        }
+        dist_cls_ = NewDistance(metric_);
         return true;
     }
 
@@ -867,11 +811,12 @@ namespace n2
         if (attribute_number_ != attributes.size())
         {
             attribute_number_ = attributes.size();
+            attribute_stride_ = AttributeStride(attribute_number_);
             std::cout << "attribute number changed to " << attribute_number_ << std::endl;
         }
-        if (attributes_code.size() != attribute_number_)
+        if (attribute_dict_.AttributeNumber() != attribute_number_)
         {
-            attributes_code.resize(attribute_number_);
+            attribute_dict_.Resize(attribute_number_);
         }
 
         int s = attributes_.size();
@@ -879,22 +824,13 @@ namespace n2
 
         for (int i = 0; i < attributes.size(); i++)
         {
-            int flag = 1;
-            for (int j = 0; j < attributes_code[i].size(); j++)
-            {
-                if (attributes[i] == attributes_code[i][j])
-                {
-                    tmp.push_back(j);
-                    flag--;
-                    break;
-                }
-            }
-            if (flag)
-            {
-                tmp.push_back(attributes_code[i].size());
-                attributes_code[i].push_back(attributes[i]);
-            }
+            int code = attribute_dict_.Insert(i, attributes[i]);
+            // codes are stored as one byte per attribute
+            if (code == 256)
+                logger_->warn("attribute {} has more than 256 values, codes collide", i);
+            tmp.push_back(code);
         }
+        tmp.resize(attribute_stride_, 0);
         attributes_[s] = tmp;
     }
 
@@ -932,6 +868,14 @@ namespace n2
         }
     }
 
+    Hnsw::QueryDistance Hnsw::MakeQueryDistance(const std::vector<float> &qvec) const
+    {
+        if (metric_ != DistanceKind::ANGULAR)
+            return QueryDistance{dist_cls_, 1.0f, 0.0f};
+        float sum = std::inner_product(qvec.begin(), qvec.end(), qvec.begin(), 0.0f);
+        return QueryDistance{&dot_dist_, sum > 0 ? 1 / std::sqrt(sum) : 0.0f, 1.0f};
+    }
+
     void Hnsw::SearchById_(int cur_node_id, float cur_dist, const float *qraw, size_t k, size_t ef_search, vector<pair<int, float>> &result)
     {
         MinHeap<float, int> dh;
@@ -1034,6 +978,13 @@ namespace n2
         }
     }
 
+    int Hnsw::ModelAttributeStride(size_t data_dim) const
+    {
+        // models written before the rows were padded keep the scalar compare
+        long long stride = memory_per_data_ - (long long)(sizeof(float) * data_dim);
+        return stride == AttributeStride(attribute_number_) ? (int)stride : 0;
+    }
+
     bool Hnsw::SetValuesFromModel(char *model)
     {
         if (model)
@@ -1048,15 +999,18 @@ namespace n2
             ptr = GetValueAndIncPtr<int>(ptr, enterpoint_id_);
             ptr = GetValueAndIncPtr<int>(ptr, num_nodes_);
             ptr = GetValueAndIncPtr<DistanceKind>(ptr, metric_);
+            size_t model_data_dim = *((size_t *)(ptr));
             ptr += sizeof(size_t);
             ptr = GetValueAndIncPtr<long long>(ptr, memory_per_data_);
             ptr = GetValueAndIncPtr<long long>(ptr, memory_per_link_level0_);
             ptr = GetValueAndIncPtr<long long>(ptr, memory_per_node_level0_);
             ptr = GetValueAndIncPtr<long long>(ptr, level0_offset_);
             ptr = GetValueAndIncPtr<int>(ptr, attribute_number_);
+            attribute_stride_ = ModelAttributeStride(model_data_dim);
             long long level0_size = memory_per_node_level0_ * num_nodes_;
             long long model_config_size = GetModelConfigSize();
             model_level0_ = model_ + model_config_size;
+            LoadFusionConfig(model_level0_ + level0_size, model_byte_size_ - model_config_size - level0_size);
             return true;
         }
         return false;
@@ -1102,10 +1056,56 @@ namespace n2
         }
     }
     
+    HybridQueryPlan Hnsw::MakeQueryPlan(const std::vector<std::string> &attributes, size_t k, int ef_search) const
+    {
+        HybridQueryPlan plan;
+        plan.attribute = Attribute2int(attributes);
+        if (plan.attribute.size() != attribute_number_)
+            plan.attribute.clear();
+        else
+            plan.attribute.resize(std::max(attribute_stride_, attribute_number_), 0);
+        plan.k = k;
+        plan.ef_search = ef_search;
+        plan.fusion = MakeSearchFusion();
+        plan.strict = strict_filter_;
+        plan.strict_budget = strict_budget_;
+        return plan;
+    }
+
     int Hnsw::SearchByVector_new(const std::vector<float> &qvec, std::vector<char> attribute, size_t k, int ef_search, std::vector<std::pair<int, float>> &result)
+    {
+        HybridQueryPlan plan;
+        attribute.resize(std::max(attribute_stride_, attribute_number_), 0);
+        plan.attribute.swap(attribute);
+        plan.k = k;
+        plan.ef_search = ef_search;
+        plan.fusion = MakeSearchFusion();
+        plan.strict = strict_filter_;
+        plan.strict_budget = strict_budget_;
+        return SearchByVector_new(qvec, plan, result);
+    }
+
+    int Hnsw::SearchByVector_new(const std::vector<float> &qvec, std::vector<std::string> attributes, size_t k, int ef_search, std::vector<std::pair<int, float>> &result)
     {
         if (model_ == nullptr)
             throw std::runtime_error("[Error] Model has not loaded!");
+        return SearchByVector_new(qvec, MakeQueryPlan(attributes, k, ef_search), result);
+    }
+
+    int Hnsw::SearchByVector_new(const std::vector<float> &qvec, const HybridQueryPlan &plan, std::vector<std::pair<int, float>> &result)
+    {
+        if (model_ == nullptr)
+            throw std::runtime_error("[Error] Model has not loaded!");
+        if (plan.attribute.empty())
+        {
+            std::cout << "wrong attributes";
+            return 0;
+        }
+        if (plan.strict)
+            return StrictSearchByVector_(qvec, plan, result);
+        const char *attribute = plan.attribute.data();
+        size_t k = plan.k;
+        int ef_search = plan.ef_search;
         // TODO: check Node 12bytes => 8bytes
         _mm_prefetch(&dist_cls_, _MM_HINT_T0);
         float PORTABLE_ALIGN32 TmpRes[8];
@@ -1114,31 +1114,14 @@ namespace n2
         {
             ef_search = 400;
         }
-        vector<float> qvec_copy(qvec);
-        if (metric_ == DistanceKind::ANGULAR)
-        {
-            NormalizeVector(qvec_copy);
-        }
-        qraw = &qvec_copy[0];
+        qraw = &qvec[0];
+        const QueryDistance qdist = MakeQueryDistance(qvec);
         _mm_prefetch(&dist_cls_, _MM_HINT_T0);
         // int maxlevel = maxlevel_;
         int cur_node_id = enterpoint_id_;
-        float cur_dist = dist_cls_->Evaluate(qraw, (float *)(model_level0_ + cur_node_id * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes);
-        float d2 = 0;
-        for (int i = 0; i < attribute.size(); i++)
-        {
-            if (attribute[i] != *((char *)(model_level0_ + cur_node_id * memory_per_node_level0_ + memory_per_link_level0_ + data_dim_ * sizeof(float) + i * sizeof(char))))
-                d2 += weight_search;
-        }
-        //ws
-        cur_dist += d2;
-
-        //auto
-        //cur_dist += cur_dist * d2 / (weight_search * attribute_number_);
-
-        //if (d2 == 0)
-        //    d2++;
-        //cur_dist = cur_dist * d2 * 2 / (cur_dist + d2);
+        float cur_dist = qdist.Evaluate(qraw, (float *)(model_level0_ + cur_node_id * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes);
+        const AttributeFusion &fusion = plan.fusion;
+        cur_dist = fusion.Apply(cur_dist, FusedMismatch(fusion, attribute, model_level0_ + cur_node_id * memory_per_node_level0_ + memory_per_link_level0_ + data_dim_ * sizeof(float)));
 
         int nub = 1;
 
@@ -1193,18 +1176,8 @@ namespace n2
                 if (visited[tnum] != mark)
                 {
                     visited[tnum] = mark;
-                    d = (dist_cls_->Evaluate(qraw, (float *)(model_level0_ + tnum * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes));
-                    float d2 = 0;
-                    for (int i = 0; i < attribute.size(); i++)
-                    {
-                        if (attribute[i] != *((char *)(model_level0_ + tnum * memory_per_node_level0_ + memory_per_link_level0_ + data_dim_ * sizeof(float) + i * sizeof(char))))
-                            d2 += weight_search;
-                    }
-                    d += d2;
-                    //d += d * d2 / (weight_search * attribute_number_);
-                    //if (d2 == 0)
-                    //    d2++;
-                    //d = d * d2 * 2 / (d + d2);
+                    d = (qdist.Evaluate(qraw, (float *)(model_level0_ + tnum * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes));
+                    d = fusion.Apply(d, FusedMismatch(fusion, attribute, model_level0_ + tnum * memory_per_node_level0_ + memory_per_link_level0_ + data_dim_ * sizeof(float)));
                     nub++;
                     if (d < topKey || total_size < ef_search)
                     {
@@ -1271,179 +1244,482 @@ namespace n2
         return nub;
     }
 
-    int Hnsw::SearchByVector_new(const std::vector<float> &qvec, std::vector<std::string> attributes, size_t k, int ef_search, std::vector<std::pair<int, float>> &result)
+    int Hnsw::BatchSearchByVector(const std::vector<std::vector<float>> &qvecs, const std::vector<HybridQueryPlan> &plans,
+                                  size_t group, std::vector<std::vector<std::pair<int, float>>> &results)
     {
-
         if (model_ == nullptr)
             throw std::runtime_error("[Error] Model has not loaded!");
-        // TODO: check Node 12bytes => 8bytes
-        _mm_prefetch(&dist_cls_, _MM_HINT_T0);
+        size_t n_queries = plans.size();
+        results.assign(n_queries, std::vector<std::pair<int, float>>());
+        auto groupable = [&](const HybridQueryPlan &plan)
+        {
+            return group > 1 && !plan.strict && !plan.attribute.empty();
+        };
+        auto same_group = [&](const HybridQueryPlan &a, const HybridQueryPlan &b)
+        {
+            return a.attribute == b.attribute && a.k == b.k && a.ef_search == b.ef_search &&
+                   a.fusion == b.fusion;
+        };
+        // queries that may walk together are ordered next to each other
+        std::vector<size_t> order(n_queries);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                         {
+                             const HybridQueryPlan &x = plans[a], &y = plans[b];
+                             bool gx = groupable(x), gy = groupable(y);
+                             if (gx != gy || !gx)
+                                 return gx > gy;
+                             if (x.attribute != y.attribute)
+                                 return x.attribute < y.attribute;
+                             return std::make_tuple(x.k, x.ef_search, (int)x.fusion.policy, x.fusion.weight) <
+                                    std::make_tuple(y.k, y.ef_search, (int)y.fusion.policy, y.fusion.weight);
+                         });
+
+        int nub = 0;
+        std::vector<const std::vector<float> *> group_qvecs;
+        std::vector<std::vector<std::pair<int, float>> *> group_results;
+        for (size_t i = 0; i < n_queries;)
+        {
+            const HybridQueryPlan &plan = plans[order[i]];
+            size_t end = i + 1;
+            if (groupable(plan))
+            {
+                while (end < n_queries && end - i < std::min(group, kMaxSearchGroup) &&
+                       groupable(plans[order[end]]) &&
+                       same_group(plan, plans[order[end]]))
+                    end++;
+            }
+            if (end - i == 1)
+            {
+                nub += SearchByVector_new(qvecs[order[i]], plan, results[order[i]]);
+                i = end;
+                continue;
+            }
+            group_qvecs.clear();
+            group_results.clear();
+            for (; i < end; i++)
+            {
+                group_qvecs.push_back(&qvecs[order[i]]);
+                group_results.push_back(&results[order[i]]);
+            }
+            nub += GroupSearchByVector_(group_qvecs.data(), group_qvecs.size(), plan, group_results.data());
+        }
+        return nub;
+    }
+
+    int Hnsw::GroupSearchByVector_(const std::vector<float> *const *qvecs, size_t n, const HybridQueryPlan &plan,
+                                   std::vector<std::pair<int, float>> *const *results)
+    {
+        const char *attribute = plan.attribute.data();
+        size_t k = plan.k;
+        int ef_search = plan.ef_search < 0 ? 400 : plan.ef_search;
         float PORTABLE_ALIGN32 TmpRes[8];
-        const float *qraw = nullptr;
 
-        std::vector<char> attribute = Attribute2int(attributes);
-        if (attribute.size() != attribute_number_)
-        {
-            std::cout << "wrong attributes";
-            return 0;
-        }
-        if (ef_search < 0)
-        {
-            ef_search = 400;
-        }
-        vector<float> qvec_copy(qvec);
-        if (metric_ == DistanceKind::ANGULAR)
-        {
-            NormalizeVector(qvec_copy);
-        }
-        qraw = &qvec_copy[0];
-        _mm_prefetch(&dist_cls_, _MM_HINT_T0);
-        // int maxlevel = maxlevel_;
+        // the search state of SearchByVector_new, once per query
+        struct Member
+        {
+            QueryDistance qdist;
+            MinHeap<float, int> dh;
+            std::priority_queue<pair<float, int>> visited_nodes;
+            size_t total_size;
+            float maxKey;
+            // the neighbours to score this round in adjacency order, and
+            // their distances in the order the round scored them
+            std::vector<int> wants;
+            std::vector<std::pair<int, float>> got;
+        };
+        std::vector<Member> members(n);
+        const float *qraws[kMaxSearchGroup];
+        const float *picked[kMaxSearchGroup];
+        size_t slot[kMaxSearchGroup];
+        float dists[kMaxSearchGroup], topKeys[kMaxSearchGroup];
+        for (size_t j = 0; j < n; ++j)
+        {
+            qraws[j] = &(*qvecs[j])[0];
+            members[j].qdist = MakeQueryDistance(*qvecs[j]);
+        }
+        // every member evaluates with the same distance class
+        const BaseDistance *dist = members[0].qdist.dist;
+        int nub = 0;
+        // fused distances of node id to the members of mask, into dists[j]
+        auto evaluate = [&](int id, unsigned mask)
+        {
+            const char *node = model_level0_ + id * memory_per_node_level0_ + memory_per_link_level0_;
+            size_t m = 0;
+            for (size_t j = 0; j < n; ++j)
+            {
+                if (mask >> j & 1)
+                {
+                    slot[m] = j;
+                    picked[m++] = qraws[j];
+                }
+            }
+            float raw[kMaxSearchGroup];
+            dist->EvaluateMany(picked, m, (const float *)node, data_dim_, raw, TmpRes);
+            float cnt = FusedMismatch(plan.fusion, attribute, node + data_dim_ * sizeof(float));
+            for (size_t c = 0; c < m; ++c)
+            {
+                const QueryDistance &qdist = members[slot[c]].qdist;
+                dists[slot[c]] = plan.fusion.Apply(qdist.offset + qdist.scale * raw[c], cnt);
+            }
+            nub += m;
+        };
+
+        // per node, the members that scored it and the members that want it
+        // scored in the current round (bit j for member j)
+        group_masks_.Reset();
+
+        const unsigned all = (1u << n) - 1;
         int cur_node_id = enterpoint_id_;
-        float cur_dist = dist_cls_->Evaluate(qraw, (float *)(model_level0_ + cur_node_id * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes);
-        float d2 = 0;
-        for (int i = 0; i < attribute.size(); i++)
-        {
-            if (attribute[i] != *((char *)(model_level0_ + cur_node_id * memory_per_node_level0_ + memory_per_link_level0_ + data_dim_ * sizeof(float) + i * sizeof(char))))
-                d2 += weight_search;
+        evaluate(cur_node_id, all);
+        group_masks_.Get(cur_node_id).scored = all;
+        for (size_t j = 0; j < n; ++j)
+        {
+            members[j].dh.push(dists[j], cur_node_id);
+            members[j].total_size = 1;
+            members[j].maxKey = dists[j];
+        }
+
+        // Every round each member expands its nearest candidate as
+        // SearchByVector_new would and collects the neighbours it has not
+        // scored yet. The round's nodes are then fetched once each and scored
+        // for all members that want them, and every member admits its own in
+        // its adjacency order, so its search is unchanged while overlapping
+        // neighbourhoods share their loads.
+        std::vector<int> round;
+        while (true)
+        {
+            round.clear();
+            bool active = false;
+            for (size_t j = 0; j < n; ++j)
+            {
+                Member &m = members[j];
+                if (m.dh.size() == 0 || m.visited_nodes.size() >= (ef_search >> 1))
+                    continue;
+                active = true;
+                MinHeap<float, int>::Item e = m.dh.top();
+                m.dh.pop();
+                m.visited_nodes.emplace(e.key, e.data);
+                topKeys[j] = m.maxKey;
+                m.wants.clear();
+                m.got.clear();
+                char *data = model_level0_ + e.data * memory_per_node_level0_;
+                int size = *((int *)data);
+                for (int l = 1; l <= size; ++l)
+                {
+                    int tnum = *((int *)(data + l * sizeof(int)));
+                    GroupMasks::Entry &masks = group_masks_.Get(tnum);
+                    if (masks.scored >> j & 1)
+                        continue;
+                    masks.scored |= 1u << j;
+                    m.wants.push_back(tnum);
+                    if (masks.wanted == 0)
+                    {
+                        _mm_prefetch(model_level0_ + tnum * memory_per_node_level0_ + memory_per_link_level0_, _MM_HINT_T0);
+                        round.push_back(tnum);
+                    }
+                    masks.wanted |= 1u << j;
+                }
+            }
+            if (!active)
+                break;
+            for (int tnum : round)
+            {
+                GroupMasks::Entry &masks = group_masks_.Get(tnum);
+                unsigned need = masks.wanted;
+                masks.wanted = 0;
+                evaluate(tnum, need);
+                for (size_t r = 0; r < n; ++r)
+                {
+                    if (need >> r & 1)
+                        members[r].got.emplace_back(tnum, dists[r]);
+                }
+            }
+            // admission depends on total_size, so it must follow the order
+            // of the member's own expansion rather than the round's
+            for (size_t j = 0; j < n; ++j)
+            {
+                Member &m = members[j];
+                if (m.wants.empty())
+                    continue;
+                auto by_id = [](const std::pair<int, float> &a, const std::pair<int, float> &b)
+                { return a.first < b.first; };
+                std::sort(m.got.begin(), m.got.end(), by_id);
+                for (int tnum : m.wants)
+                {
+                    float d = std::lower_bound(m.got.begin(), m.got.end(), std::make_pair(tnum, 0.0f), by_id)->second;
+                    if (d < topKeys[j] || m.total_size < ef_search)
+                    {
+                        m.dh.push(d, tnum);
+                        ++m.total_size;
+                        if (d > m.maxKey)
+                            m.maxKey = d;
+                    }
+                }
+                m.wants.clear();
+            }
         }
-        //ws
-        cur_dist += d2;
 
-        //auto
-        //cur_dist += cur_dist * d2 / (weight_search * attribute_number_);
+        for (size_t j = 0; j < n; ++j)
+        {
+            Member &m = members[j];
+            vector<pair<float, int>> res_t;
+            while (m.dh.size() && res_t.size() < k)
+            {
+                res_t.emplace_back(m.dh.top().key, m.dh.top().data);
+                m.dh.pop();
+            }
+            while (m.visited_nodes.size() > k)
+                m.visited_nodes.pop();
+            while (!m.visited_nodes.empty())
+            {
+                res_t.emplace_back(m.visited_nodes.top());
+                m.visited_nodes.pop();
+            }
+            std::sort(res_t.begin(), res_t.end());
+            size_t sz = min(k, res_t.size());
+            for (size_t i = 0; i < sz; ++i)
+                results[j]->push_back(pair<int, float>(res_t[i].second, res_t[i].first));
+        }
+        return nub;
+    }
 
-        //if (d2 == 0)
-        //    d2++;
-        //cur_dist = cur_dist * d2 * 2 / (cur_dist + d2);
-        int nub = 1;
+    int Hnsw::StrictSearchByVector_(const std::vector<float> &qvec, const HybridQueryPlan &plan, std::vector<std::pair<int, float>> &result)
+    {
+        const char *attribute = plan.attribute.data();
+        size_t k = plan.k;
+        size_t ef_search = plan.ef_search < 0 ? 400 : plan.ef_search;
+        ef_search = std::max(ef_search, k);
+        int budget = plan.strict_budget > 0 ? plan.strict_budget : num_nodes_;
+        float PORTABLE_ALIGN32 TmpRes[8];
+        const float *qraw = &qvec[0];
+        const QueryDistance qdist = MakeQueryDistance(qvec);
+
+        int nub = 0;
+        // only matches are returned anyway; the traversal needs a finite
+        // penalty, which is raised below until enough matches are found
+        AttributeFusion penalty = plan.fusion;
+        if (penalty.policy == FusionPolicy::MASK)
+            penalty.policy = FusionPolicy::ADDITIVE;
+        // mismatch of node id as the fusion weighs it; a node is a match when
+        // no attribute differs, whatever the weights
+        auto mismatch = [&](int id, bool &match) -> float
+        {
+            const char *attrs = model_level0_ + id * memory_per_node_level0_ + memory_per_link_level0_ + data_dim_ * sizeof(float);
+            float cnt = AttributeMismatch(attribute, attrs);
+            match = cnt == 0;
+            return penalty.policy == FusionPolicy::WEIGHTED ? FusedMismatch(penalty, attribute, attrs) : cnt;
+        };
+        // metric distance to node id
+        auto evaluate = [&](int id) -> float
+        {
+            ++nub;
+            return qdist.Evaluate(qraw, (float *)(model_level0_ + id * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes);
+        };
 
-        typedef typename MinHeap<float, int>::Item QueueItem;
-        std::queue<QueueItem> q;
         search_list_->Reset();
-
-        MinHeap<float, int> dh;
-        dh.push(cur_dist, cur_node_id);
-
         unsigned int mark = search_list_->GetVisitMark();
         unsigned int *visited = search_list_->GetVisited();
 
-        bool need_sort = false;
-        if (ensure_k_)
+        typedef pair<float, int> Item;
+        // candidates to expand (nearest first), the ef_search best fused
+        // distances, the k nearest exact matches, and the nodes left
+        // unexpanded, where the traversal resumes after the penalty is raised
+        std::priority_queue<Item, vector<Item>, std::greater<Item>> candidates;
+        std::priority_queue<Item> top, matches;
+        vector<Item> spill;
+        auto add_match = [&](int id, float d)
         {
-            if (!result.empty())
-                need_sort = true;
-            for (size_t i = 0; i < result.size(); ++i)
-                visited[result[i].first] = mark;
-            if (visited[cur_node_id] == mark)
-                return nub;
-        }
-        visited[cur_node_id] = mark;
-
-        std::priority_queue<pair<float, int>> visited_nodes;
-
-        vector<pair<int, float>> path;
-        if (ensure_k_)
-            path.emplace_back(cur_node_id, cur_dist);
+            if (matches.size() < k || d < matches.top().first)
+            {
+                matches.emplace(d, id);
+                if (matches.size() > k)
+                    matches.pop();
+            }
+        };
 
-        float d;
-        int tnum;
-        size_t total_size = 1;
-        float maxKey = cur_dist;
-        QueueItem e;
+        bool match;
+        int cur_node_id = enterpoint_id_;
+        float cnt = mismatch(cur_node_id, match);
+        float d = evaluate(cur_node_id);
+        if (match)
+            add_match(cur_node_id, d);
+        visited[cur_node_id] = mark;
+        d = penalty.Apply(d, cnt);
+        candidates.emplace(d, cur_node_id);
+        top.emplace(d, cur_node_id);
 
-        while (dh.size() > 0 && visited_nodes.size() < (ef_search >> 1))
+        bool exhausted = false;
+        while (true)
         {
-            e = dh.top();
-            dh.pop();
-            cur_node_id = e.data;
-            visited_nodes.emplace(e.key, e.data);
-            float topKey = maxKey;
-            char *level_offset = model_level0_ + cur_node_id * memory_per_node_level0_;
-            char *data = level_offset;
-            int size = *((int *)data);
-            for (int j = 1; j <= size; ++j)
+            while (!candidates.empty() && !exhausted)
             {
-                tnum = *((int *)(data + j * sizeof(int)));
-                _mm_prefetch(dist_cls_, _MM_HINT_T0);
-                if (visited[tnum] != mark)
+                Item e = candidates.top();
+                if (top.size() >= ef_search && e.first > top.top().first)
+                    break;
+                candidates.pop();
+                int *data = (int *)(model_level0_ + e.second * memory_per_node_level0_);
+                int size = *data;
+                for (int j = 1; j <= size; ++j)
                 {
+                    int tnum = data[j];
+                    if (visited[tnum] == mark)
+                        continue;
                     visited[tnum] = mark;
-                    d = (dist_cls_->Evaluate(qraw, (float *)(model_level0_ + tnum * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes));
-                    float d2 = 0;
-                    for (int i = 0; i < attribute.size(); i++)
+                    cnt = mismatch(tnum, match);
+                    d = evaluate(tnum);
+                    if (match)
+                        add_match(tnum, d);
+                    d = penalty.Apply(d, cnt);
+                    if (top.size() < ef_search || d < top.top().first)
                     {
-                        if (attribute[i] != *((char *)(model_level0_ + tnum * memory_per_node_level0_ + memory_per_link_level0_ + data_dim_ * sizeof(float) + i * sizeof(char))))
-                            d2 += weight_search;
+                        candidates.emplace(d, tnum);
+                        top.emplace(d, tnum);
+                        if (top.size() > ef_search)
+                            top.pop();
                     }
-                    d += d2;
-                    //d += d * d2 / (weight_search * attribute_number_);
-                    //if (d2 == 0)
-                    //    d2++;
-                    //d = d * d2 * 2 / (d + d2);
-                    nub++;
-                    if (d < topKey || total_size < ef_search)
+                    else
                     {
-                        q.emplace(QueueItem(d, tnum));
-                        ++total_size;
+                        spill.emplace_back(d, tnum);
+                    }
+                    if (nub >= budget)
+                    {
+                        exhausted = true;
+                        break;
                     }
                 }
             }
-            while (!q.empty())
+            while (!candidates.empty())
             {
-                dh.push(q.front().key, q.front().data);
-                if (q.front().key > maxKey)
-                    maxKey = q.front().key;
-                q.pop();
+                spill.push_back(candidates.top());
+                candidates.pop();
             }
-        }
-
-        // while(!res.empty()){
-        //     const FurtherFirstNew& temp = res.top();
-        //     result.push_back(pair<int, float>(temp.GetId(), temp.GetDistance()));
-        //     res.pop();
-        // }
-
-        // for(int i=0;i<k;i++){
-        //     std::cout<<"candidates.size() = "<<candidates.size() <<endl;
-        //     const CloserFirstNew& temp = candidates.top();
-        //     result.push_back(pair<int, float>(temp.GetId(), temp.GetDistance()));
-        //     res.pop();
-        // }
+            if (matches.size() >= k || exhausted || spill.empty())
+                break;
 
+            // too few matches: double the fusion weight, so non-matching nodes
+            // sink, and resume with twice the ef_search from the nodes left
+            // unexpanded. An additive penalty is raised in place; the
+            // multiplicative one scales the distance, which is computed again
+            AttributeFusion raised = penalty;
+            raised.weight = std::max(2 * penalty.weight, 1.0f);
+            auto raise = [&](const Item &item) -> Item
+            {
+                float cnt = mismatch(item.second, match);
+                if (match)
+                    return item;
+                if (penalty.policy == FusionPolicy::MULTIPLICATIVE)
+                    return Item(raised.Apply(evaluate(item.second), cnt), item.second);
+                return Item(item.first + cnt * (raised.weight - penalty.weight), item.second);
+            };
+            vector<Item> kept;
+            while (!top.empty())
+            {
+                kept.push_back(raise(top.top()));
+                top.pop();
+            }
+            for (size_t i = 0; i < kept.size(); ++i)
+                top.push(kept[i]);
+            for (size_t i = 0; i < spill.size(); ++i)
+                candidates.push(raise(spill[i]));
+            spill.clear();
+            penalty = raised;
+            ef_search = std::min(2 * ef_search, (size_t)num_nodes_);
+        }
 
-        vector<pair<float, int>> res_t;
-        while (dh.size() && res_t.size() < k)
+        vector<Item> res_t;
+        while (!matches.empty())
         {
-            res_t.emplace_back(dh.top().key, dh.top().data);
-            dh.pop();
+            res_t.push_back(matches.top());
+            matches.pop();
         }
-        while (visited_nodes.size() > k)
-            visited_nodes.pop();
-        while (!visited_nodes.empty())
+        for (size_t i = res_t.size(); i > 0; --i)
+            result.push_back(pair<int, float>(res_t[i - 1].second, res_t[i - 1].first));
+        return nub;
+    }
+
+    int Hnsw::RangeSearchByVector(const std::vector<float> &qvec, std::vector<std::string> attributes, float radius, int ef_search, std::vector<std::pair<int, float>> &result)
+    {
+        if (model_ == nullptr)
+            throw std::runtime_error("[Error] Model has not loaded!");
+        return RangeSearchByVector(qvec, MakeQueryPlan(attributes, 0, ef_search), radius, result);
+    }
+
+    int Hnsw::RangeSearchByVector(const std::vector<float> &qvec, const HybridQueryPlan &plan, float radius, std::vector<std::pair<int, float>> &result)
+    {
+        if (model_ == nullptr)
+            throw std::runtime_error("[Error] Model has not loaded!");
+        result.clear();
+        if (plan.attribute.empty())
         {
-            res_t.emplace_back(visited_nodes.top());
-            visited_nodes.pop();
+            std::cout << "wrong attributes";
+            return 0;
         }
-        _mm_prefetch(&res_t[0], _MM_HINT_T0);
-        std::sort(res_t.begin(), res_t.end());
-        size_t sz;
-        if (ensure_k_)
+        const char *attribute = plan.attribute.data();
+        size_t ef_search = plan.ef_search < 0 ? 400 : plan.ef_search;
+        float PORTABLE_ALIGN32 TmpRes[8];
+        const float *qraw = &qvec[0];
+        const QueryDistance qdist = MakeQueryDistance(qvec);
+
+        int nub = 0;
+        auto fused = [&](int id) -> float
         {
-            sz = min(k - result.size(), res_t.size());
-        }
+            const char *node = model_level0_ + id * memory_per_node_level0_ + memory_per_link_level0_;
+            ++nub;
+            return plan.fusion.Apply(qdist.Evaluate(qraw, (float *)node, data_dim_, TmpRes),
+                                     FusedMismatch(plan.fusion, attribute, node + data_dim_ * sizeof(float)));
+        };
+
+        search_list_->Reset();
+        unsigned int mark = search_list_->GetVisitMark();
+        unsigned int *visited = search_list_->GetVisited();
+
+        // Best-first search in which nodes inside the radius do not count
+        // against ef_search: they are never dropped from the candidate set,
+        // and ef_search candidates beyond the radius are kept to route
+        // through. It ends when no candidate is left to expand.
+        std::priority_queue<pair<float, int>, vector<pair<float, int>>, std::greater<pair<float, int>>> candidates;
+        std::priority_queue<pair<float, int>> outside;
+        int cur_node_id = enterpoint_id_;
+        float d = fused(cur_node_id);
+        visited[cur_node_id] = mark;
+        candidates.emplace(d, cur_node_id);
+        if (d <= radius)
+            result.emplace_back(cur_node_id, d);
         else
+            outside.emplace(d, cur_node_id);
+
+        while (!candidates.empty())
         {
-            sz = min(k, res_t.size());
-        }
-        for (size_t i = 0; i < sz; ++i)
-            result.push_back(pair<int, float>(res_t[i].second, res_t[i].first));
-        if (ensure_k_ && need_sort)
-        {
-            _mm_prefetch(&result[0], _MM_HINT_T0);
-            sort(result.begin(), result.end(), [](const pair<int, float> &i, const pair<int, float> &j) -> bool
-                 { return i.second < j.second; });
+            pair<float, int> e = candidates.top();
+            if (e.first > radius && outside.size() >= ef_search && e.first > outside.top().first)
+                break;
+            candidates.pop();
+            int *data = (int *)(model_level0_ + e.second * memory_per_node_level0_);
+            int size = *data;
+            for (int j = 1; j <= size; ++j)
+            {
+                int tnum = data[j];
+                if (visited[tnum] == mark)
+                    continue;
+                visited[tnum] = mark;
+                d = fused(tnum);
+                if (d <= radius)
+                {
+                    result.emplace_back(tnum, d);
+                    candidates.emplace(d, tnum);
+                }
+                else if (outside.size() < ef_search || d < outside.top().first)
+                {
+                    candidates.emplace(d, tnum);
+                    outside.emplace(d, tnum);
+                    if (outside.size() > ef_search)
+                        outside.pop();
+                }
+            }
         }
+        sort(result.begin(), result.end(), [](const pair<int, float> &i, const pair<int, float> &j) -> bool
+             { return i.second < j.second; });
         return nub;
     }
 
@@ -1469,12 +1745,8 @@ namespace n2
         {
             ef_search = 50 * k;
         }
-        vector<float> qvec_copy(qvec);
-        if (metric_ == DistanceKind::ANGULAR)
-        {
-            NormalizeVector(qvec_copy);
-        }
-        qraw = &qvec_copy[0];
+        qraw = &qvec[0];
+        const QueryDistance qdist = MakeQueryDistance(qvec);
         _mm_prefetch(&dist_cls_, _MM_HINT_T0);
         // int maxlevel = maxlevel_;
         int cur_node_id = enterpoint_id_;
@@ -1494,7 +1766,7 @@ namespace n2
         {
             int flag = true;
             char *current_node_address = model_level0_ + i * memory_per_node_level0_;
-            cur_dist = dist_cls_->Evaluate(qraw, (float *)(model_level0_ + i * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes);
+            cur_dist = qdist.Evaluate(qraw, (float *)(model_level0_ + i * memory_per_node_level0_ + memory_per_link_level0_), data_dim_, TmpRes);
             for (int j = 0; j < attribute.size(); j++)
             {
                 if (attribute[j] != *((int *)(model_level0_ + i * memory_per_node_level0_ + memory_per_link_level0_ + data_dim_ * sizeof(float) + j * sizeof(int))))
@@ -1569,23 +1841,85 @@ namespace n2
         ptr = SetValueAndIncPtr<int>(ptr, attribute_number_);
     }
 
+    AttributeFusion Hnsw::MakeFusion(FusionPolicy policy, float weight) const
+    {
+        AttributeFusion fusion;
+        fusion.policy = policy;
+        fusion.weight = weight;
+        fusion.attribute_number = (float)attribute_number_;
+        fusion.weights = fusion_row_weights_.data();
+        return fusion;
+    }
+
+    AttributeFusion Hnsw::MakeSearchFusion() const
+    {
+        if (search_fusion_set_)
+            return MakeFusion(search_fusion_policy_, weight_search_set_ ? weight_search : fusion_weight_);
+        if (weight_search_set_)
+            return MakeFusion(FusionPolicy::ADDITIVE, weight_search);
+        return MakeFusion(fusion_policy_, fusion_weight_);
+    }
+
+    void Hnsw::UpdateFusion()
+    {
+        fusion_weights_.resize(attribute_number_, 1.0f);
+        fusion_row_weights_.assign(std::max(attribute_stride_, attribute_number_), 0.0f);
+        std::copy(fusion_weights_.begin(), fusion_weights_.end(), fusion_row_weights_.begin());
+        build_fusion_ = MakeFusion(fusion_policy_, fusion_weight_);
+    }
+
+    size_t Hnsw::GetFusionConfigSize()
+    {
+        return sizeof(int) + sizeof(fusion_weight_) + sizeof(int) + sizeof(float) * fusion_weights_.size();
+    }
+
+    void Hnsw::SaveFusionConfig(char *ptr)
+    {
+        ptr = SetValueAndIncPtr<int>(ptr, (int)fusion_policy_);
+        ptr = SetValueAndIncPtr<float>(ptr, fusion_weight_);
+        ptr = SetValueAndIncPtr<int>(ptr, (int)fusion_weights_.size());
+        for (float w : fusion_weights_)
+            ptr = SetValueAndIncPtr<float>(ptr, w);
+    }
+
+    void Hnsw::LoadFusionConfig(char *ptr, long long size)
+    {
+        fusion_policy_ = FusionPolicy::MULTIPLICATIVE;
+        fusion_weight_ = 1;
+        fusion_weights_.clear();
+        if (size >= (long long)(2 * sizeof(int) + sizeof(float)))
+        {
+            int policy, n_weights;
+            ptr = GetValueAndIncPtr<int>(ptr, policy);
+            ptr = GetValueAndIncPtr<float>(ptr, fusion_weight_);
+            ptr = GetValueAndIncPtr<int>(ptr, n_weights);
+            if (policy < 0 || policy > (int)FusionPolicy::MASK || n_weights < 0 ||
+                size < (long long)(2 * sizeof(int) + sizeof(float) * (1 + n_weights)))
+                throw std::runtime_error("[Error] Invalid fusion configuration in model");
+            fusion_policy_ = (FusionPolicy)policy;
+            fusion_weights_.resize(n_weights);
+            for (int i = 0; i < n_weights; i++)
+                ptr = GetValueAndIncPtr<float>(ptr, fusion_weights_[i]);
+        }
+        UpdateFusion();
+    }
+
     void Hnsw::PrintConfigs() const
     {
         logger_->info("HNSW configurations & status: M({}), MaxM({}), MaxM0({}), efCon({}), levelmult({}), maxlevel({}), #nodes({}), dimension of data({}), memory per data({}), memory per link level0({}), memory per node level0({}), level0 offset({})", M_, MaxM_, MaxM0_, efConstruction_, levelmult_, maxlevel_, num_nodes_, data_dim_, memory_per_data_, memory_per_link_level0_, memory_per_node_level0_, level0_offset_);
     }
 
-    std::vector<char> Hnsw::Attribute2int(std::vector<std::string> str)
+    std::vector<char> Hnsw::Attribute2int(std::vector<std::string> str) const
     {
         std::vector<char> tmp;
         if (str.size() != attribute_number_)
             return tmp;
         for (int i = 0; i < str.size(); i++)
         {
-            for (int j = 0; j < attributes_code[i].size(); j++)
-            {
-                if (str[i] == attributes_code[i][j])
-                    tmp.push_back(j);
-            }
+            int code = attribute_dict_.Find(i, str[i]);
+            if (code < 0)
+                return std::vector<char>();
+            tmp.push_back(code);
         }
         return tmp;
     }